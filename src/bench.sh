@@ -0,0 +1,121 @@
+#!/bin/bash
+
+# end-to-end benchmark of ptgz compression and extraction
+# Generates (and caches) synthetic trees with gendata.pl, then runs ptgz -c and
+# ptgz -x with -t for every combination of shape, rank count and thread count.
+# Every phase timer of every run is appended to the results file as one JSON
+# object per line, together with the wall clock time of the whole run, so that
+# throughput and scaling can be compared between builds.
+#
+# environment:
+#   PTGZ    ptgz binary (default: ../bin/ptgz next to this script)
+#   MPIRUN  MPI launcher including any extra options (default: mpirun)
+
+set -e
+
+usage() {
+  echo "usage: bench.sh [-s 'SHAPES'] [-S SCALE] [-n 'RANKS'] [-t 'THREADS'] [-w WORKDIR] [-o RESULTS] [-V]"
+  echo "  -s  shapes to run, any of tiny huge deep mixed (default: all)"
+  echo "  -S  scale passed to gendata.pl (default: 1)"
+  echo "  -n  rank counts, at least 2 each (default: 2)"
+  echo "  -t  OpenMP thread counts per rank (default: 1)"
+  echo "  -w  work directory for data and archives (default: ./bench)"
+  echo "  -o  results file, JSON lines (default: WORKDIR/results.json)"
+  echo "  -V  verify every extraction against the source tree"
+}
+
+SRCDIR=$(cd $(dirname $0) && pwd)
+PTGZ=${PTGZ:-$SRCDIR/../bin/ptgz}
+MPIRUN=${MPIRUN:-mpirun}
+SHAPES="tiny huge deep mixed"
+SCALE=1
+RANKS=2
+THREADS=1
+WORKDIR=bench
+RESULTS=
+VERIFY=
+
+while getopts "s:S:n:t:w:o:Vh" opt ; do
+  case $opt in
+    s) SHAPES=$OPTARG ;;
+    S) SCALE=$OPTARG ;;
+    n) RANKS=$OPTARG ;;
+    t) THREADS=$OPTARG ;;
+    w) WORKDIR=$OPTARG ;;
+    o) RESULTS=$OPTARG ;;
+    V) VERIFY=yes ;;
+    h) usage ; exit 0 ;;
+    *) usage ; exit 1 ;;
+  esac
+done
+
+mkdir -p $WORKDIR/data
+WORKDIR=$(cd $WORKDIR && pwd)
+RESULTS=${RESULTS:-$WORKDIR/results.json}
+PTGZ=$(cd $(dirname $PTGZ) && pwd)/$(basename $PTGZ)
+
+# turn "timer NAME: key=value ..." lines into JSON objects
+# arguments: log file, then the fixed fields of every record
+timers_to_json() {
+  awk -v fixed="$2" '
+    /^timer [^ ]*: / {
+      name = $2; sub(/:$/, "", name)
+      line = "{" fixed ",\"phase\":\"" name "\""
+      for(i = 3 ; i <= NF ; i++) {
+        split($i, kv, "=")
+        line = line ",\"" kv[1] "\":" kv[2]
+      }
+      print line "}"
+    }' $1
+}
+
+now() {
+  date +%s.%N
+}
+
+elapsed() {
+  awk -v s=$1 -v e=$2 'BEGIN { printf("%.6f", e - s) }'
+}
+
+for shape in $SHAPES ; do
+  data=$WORKDIR/data/$shape-$SCALE
+  if [ ! -d $data ] ; then
+    echo "generating $shape (scale $SCALE)"
+    $SRCDIR/gendata.pl $shape $data.tmp $SCALE
+    mv $data.tmp $data
+  fi
+  bytes=$(du -s -B1 --apparent-size $data | cut -f1)
+  files=$(find $data | wc -l)
+
+  for ranks in $RANKS ; do
+    for threads in $THREADS ; do
+      run=$WORKDIR/run/$shape-$SCALE-$ranks-$threads
+      rm -rf $run
+      mkdir -p $run/extract
+      fixed="\"shape\":\"$shape\",\"scale\":$SCALE,\"ranks\":$ranks,\"threads\":$threads,\"data_bytes\":$bytes,\"data_files\":$files"
+
+      echo "compress $shape ranks=$ranks threads=$threads"
+      start=$(now)
+      (cd $data && OMP_NUM_THREADS=$threads $MPIRUN -np $ranks $PTGZ -c -t bench) >$run/compress.log 2>&1
+      end=$(now)
+      mv $data/bench.ptgz.tar $run/extract/
+      archive=$(stat -c %s $run/extract/bench.ptgz.tar)
+      echo "{$fixed,\"mode\":\"compress\",\"phase\":\"total\",\"wall\":$(elapsed $start $end),\"archive_bytes\":$archive}" >>$RESULTS
+      timers_to_json $run/compress.log "$fixed,\"mode\":\"compress\"" >>$RESULTS
+
+      echo "extract $shape ranks=$ranks threads=$threads"
+      start=$(now)
+      (cd $run/extract && OMP_NUM_THREADS=$threads $MPIRUN -np $ranks $PTGZ -x -t bench.ptgz.tar) >$run/extract.log 2>&1
+      end=$(now)
+      echo "{$fixed,\"mode\":\"extract\",\"phase\":\"total\",\"wall\":$(elapsed $start $end),\"archive_bytes\":$archive}" >>$RESULTS
+      timers_to_json $run/extract.log "$fixed,\"mode\":\"extract\"" >>$RESULTS
+
+      if [ -n "$VERIFY" ] ; then
+        diff -r --no-dereference $data $run/extract >/dev/null
+      fi
+      rm -rf $run/extract
+    done
+  done
+done
+
+echo "results in $RESULTS"
@@ -0,0 +1,213 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "blockwriter.hh"
+#include "tarentry.hh"
+#include "iopolicy.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define CHUNK_SIZE (1024ul*1024ul)
+
+namespace {
+// deflate stream into a file descriptor
+class zwriter
+{
+  public:
+  zwriter(int fd_, const std::string &dict, int level) :
+    fd(fd_), out(CHUNK_SIZE), ok(true) {
+    memset(&zs, 0, sizeof(zs));
+    ok = deflateInit2(&zs, level, Z_DEFLATED, 15, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK &&
+         (dict.empty() ||
+          deflateSetDictionary(&zs,
+                               reinterpret_cast<const Bytef*>(dict.data()),
+                               uInt(dict.size())) == Z_OK);
+  }
+  ~zwriter() { deflateEnd(&zs); }
+
+  bool write(const char *buf, size_t sz) {
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf));
+    zs.avail_in = uInt(sz);
+    return run(Z_NO_FLUSH);
+  }
+  bool finish() { return run(Z_FINISH); }
+
+  private:
+  int fd;
+  std::vector<char> out;
+  z_stream zs;
+  bool ok;
+
+  bool run(int flush) {
+    while(ok) {
+      zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+      zs.avail_out = uInt(out.size());
+      const int ret = deflate(&zs, flush);
+      if(ret == Z_STREAM_ERROR) {
+        ok = false;
+        errno = EINVAL;
+        break;
+      }
+      const char *p = &out[0];
+      size_t left = out.size() - zs.avail_out;
+      while(ok && left > 0) {
+        ssize_t written = ::write(fd, p, left);
+        if(written < 0 && errno != EINTR)
+          ok = false;
+        if(written > 0) {
+          p += written;
+          left -= size_t(written);
+        }
+      }
+      if(flush == Z_FINISH ? ret == Z_STREAM_END : zs.avail_in == 0)
+        break;
+    }
+    return ok;
+  }
+};
+}
+
+bool blockwriter::write(const std::string &list_fn,
+                        const std::string &out_fn) const
+{
+  std::ifstream list(list_fn.c_str());
+  if(!list.is_open()) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", list_fn.c_str(),
+            strerror(errno));
+    return false;
+  }
+  int out_fd = open(out_fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(out_fd < 0) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", out_fn.c_str(),
+            strerror(errno));
+    return false;
+  }
+
+  bool ok = true;
+  bool out_ok = true;
+  zwriter z(out_fd, dict, level);
+  std::vector<char> buf(CHUNK_SIZE);
+  std::string fn;
+  size_t off = 0;
+  hardlinks links;
+  while(out_ok && std::getline(list, fn)) {
+    struct stat st;
+    if((dereference ? stat(fn.c_str(), &st) : lstat(fn.c_str(), &st)) != 0) {
+      fprintf(stderr, "Could not stat '%s': %s\n", fn.c_str(),
+              strerror(errno));
+      ok = false;
+      continue;
+    }
+    tarentry ent(fn, off, st);
+    links.add(ent);
+    std::vector<char> hdr(ent.header_size());
+    ent.make_tar_header(&hdr[0]);
+    out_ok = z.write(&hdr[0], hdr.size());
+
+    // the sparse map, if any, and the data padded to whole blocks, zeros
+    // where it could not be read
+    const std::vector<char> map(ent.make_sparse_map());
+    if(out_ok && !map.empty())
+      out_ok = z.write(&map[0], map.size());
+    const std::vector<tar_extent> extents(ent.get_extents());
+    const size_t data_size = ent.size() - ent.header_size() - map.size();
+    int in_fd = ent.get_filesize() > 0 ? open(fn.c_str(), O_RDONLY) : -1;
+    if(ent.get_filesize() > 0 && in_fd < 0) {
+      fprintf(stderr, "Could not open '%s' for reading: %s\n", fn.c_str(),
+              strerror(errno));
+      ok = false;
+    }
+    readhints hints(in_fd, 0, in_fd >= 0 ? ent.get_filesize() : 0);
+    size_t done = 0;
+    for(size_t e = 0 ; out_ok && e < extents.size() ; e++) {
+      for(size_t pos = 0 ; out_ok && pos < extents[e].size ; ) {
+        const size_t chunk = std::min(buf.size(), extents[e].size - pos);
+        size_t got = 0;
+        while(in_fd >= 0 && got < chunk) {
+          ssize_t read_sz = pread(in_fd, &buf[got], chunk - got,
+                                  off_t(extents[e].offset + pos + got));
+          if(read_sz < 0 && errno == EINTR)
+            continue;
+          if(read_sz <= 0) {
+            fprintf(stderr, "Could not read '%s': %s\n", fn.c_str(),
+                    read_sz == 0 ? "File shrank" : strerror(errno));
+            ok = false;
+            close(in_fd);
+            in_fd = -1;
+            break;
+          }
+          got += size_t(read_sz);
+        }
+        if(in_fd >= 0)
+          hints.read_to(extents[e].offset + pos + got);
+        memset(&buf[got], 0, chunk - got);
+        out_ok = z.write(&buf[0], chunk);
+        pos += chunk;
+      }
+      done += extents[e].size;
+    }
+    if(out_ok) {
+      memset(&buf[0], 0, data_size - done);
+      out_ok = z.write(&buf[0], data_size - done);
+    }
+    if(in_fd >= 0) {
+      hints.done();
+      close(in_fd);
+    }
+    off += ent.size();
+  }
+
+  // end of archive
+  memset(&buf[0], 0, 2*BLOCKSIZE);
+  out_ok = out_ok && z.write(&buf[0], 2*BLOCKSIZE) && z.finish();
+  if(close(out_fd) != 0)
+    out_ok = false;
+  if(!out_ok)
+    fprintf(stderr, "Could not write to '%s': %s\n", out_fn.c_str(),
+            strerror(errno));
+  return ok && out_ok;
+}
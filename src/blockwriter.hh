@@ -0,0 +1,69 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef BLOCK_WRITER_HH_
+#define BLOCK_WRITER_HH_
+
+#include <stddef.h>
+
+#include <string>
+
+// in-process writer of compressed tar blocks
+// Writes the files of a list as a pax tar stream with the same layout as
+// tarentry, so offsets computed with tarentry hold, and deflates it in zlib
+// format with a preset dictionary. Unlike gzip, the zlib format records which
+// dictionary a stream needs, and zlib's inflate asks for it, so extractor can
+// read these blocks as well as gzip ones. Readers other than ptgz cannot.
+class blockwriter
+{
+  public:
+  blockwriter(const std::string &dict_, const int level_,
+              const bool dereference_ = false) :
+    dict(dict_), level(level_), dereference(dereference_) {};
+  ~blockwriter() {};
+
+  // compresses the files listed one per line in list_fn into out_fn, thread
+  // safe. Files that cannot be read are reported and their data is written
+  // as zeros so that the offsets of the following members still hold.
+  // Symlinks are stored as links unless dereference is set, like tar -h.
+  // Returns false if any file could not be read or out_fn not be written.
+  bool write(const std::string &list_fn, const std::string &out_fn) const;
+
+  private:
+  const std::string dict;
+  const int level;
+  const bool dereference;
+};
+
+#endif // BLOCK_WRITER_HH_
@@ -0,0 +1,362 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+// parallel replacement for choptar.pl
+// It takes an index file like the one written by mpitar, possibly with some
+// lines removed, or a list of member names that are looked up in the binary
+// index stored in the tar file itself, and produces a chopped tar file that
+// only contains the listed members.
+// * all member offsets and sizes are obtained up front, which fixes the output
+//   offset of every member so that members can be copied independently
+// * adjacent members are merged into a single range and large ranges are split
+//   into chunks so that all threads have something to do
+// * when stdout is a regular file the chunks are copied in parallel using
+//   copy_file_range (pread/pwrite if that is not possible), otherwise they are
+//   written to stdout sequentially
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "memberindex.hh"
+#include "tarentry.hh"
+
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+
+#define CHUNK_SIZE (64ul*1024ul*1024ul)
+#define COPY_BUFFER_SIZE (4ul*1024ul*1024ul)
+
+namespace {
+struct range {
+  size_t in_off;
+  size_t out_off;
+  size_t size;
+};
+bool operator<(const range &a, const range &b) { return a.in_off < b.in_off; }
+
+void usage(const char *cmd)
+{
+  fprintf(stderr, "usage: %s [-j THREADS] chop.idx data.tar >out.tar\n", cmd);
+  fprintf(stderr, "       %s [-j THREADS] -T files.txt data.tar >out.tar\n",
+          cmd);
+}
+
+void write_at(int fd, const char *buf, size_t sz, size_t off)
+{
+  while(sz > 0) {
+    ssize_t write_sz = pwrite(fd, buf, sz, off_t(off));
+    if(write_sz < 0) {
+      fprintf(stderr, "Could not write %zu bytes to output: %s\n", sz,
+              strerror(errno));
+      exit(1);
+    }
+    buf += write_sz;
+    sz -= size_t(write_sz);
+    off += size_t(write_sz);
+  }
+}
+
+void write_all(int fd, const char *buf, size_t sz)
+{
+  while(sz > 0) {
+    ssize_t write_sz = write(fd, buf, sz);
+    if(write_sz < 0) {
+      fprintf(stderr, "Could not write %zu bytes to output: %s\n", sz,
+              strerror(errno));
+      exit(1);
+    }
+    buf += write_sz;
+    sz -= size_t(write_sz);
+  }
+}
+
+size_t round_to_block(size_t sz)
+{
+  return (sz + BLOCKSIZE-1) & ~size_t(BLOCKSIZE-1);
+}
+
+// full size of a tar member including all headers and padding
+size_t member_size(int fd, const char *fn, size_t off)
+{
+  size_t data_off, data_sz;
+  tar_member_data(fd, fn, off, &data_off, &data_sz);
+  return data_off - off + round_to_block(data_sz);
+}
+
+void read_index(const char *idx_fn, std::vector<range> *ranges)
+{
+  FILE *fh = fopen(idx_fn, "r");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", idx_fn,
+            strerror(errno));
+    exit(1);
+  }
+  char *line = NULL;
+  size_t line_sz = 0;
+  while(getline(&line, &line_sz, fh) != -1) {
+    char *end;
+    range r;
+    r.in_off = size_t(strtoull(line, &end, 10));
+    r.out_off = r.size = 0;
+    if(end == line || *end != ' ') {
+      fprintf(stderr, "Invalid line in '%s': %s", idx_fn, line);
+      exit(1);
+    }
+    ranges->push_back(r);
+  }
+  free(line);
+  fclose(fh);
+}
+
+void lookup_files(const char *list_fn, const char *tar_fn, int tar_fd,
+                  std::vector<range> *ranges)
+{
+  memberindex bidx;
+  size_t bidx_off;
+  if(!memberindex::find_in_tar(tar_fd, tar_fn, &bidx_off)) {
+    fprintf(stderr, "Could not find a binary index in '%s'\n", tar_fn);
+    exit(1);
+  }
+  if(!bidx.open(tar_fn, bidx_off)) {
+    fprintf(stderr, "Could not map binary index of '%s': %s\n", tar_fn,
+            strerror(errno));
+    exit(1);
+  }
+  FILE *fh = strcmp(list_fn, "-") == 0 ? stdin : fopen(list_fn, "r");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", list_fn,
+            strerror(errno));
+    exit(1);
+  }
+  char *line = NULL;
+  size_t line_sz = 0;
+  ssize_t len;
+  while((len = getline(&line, &line_sz, fh)) != -1) {
+    if(len > 0 && line[len-1] == '\n')
+      line[--len] = '\0';
+    const memberindex_entry *ent = bidx.find(line, size_t(len));
+    if(ent == NULL) {
+      // directories are stored with a trailing slash
+      std::string dir = std::string(line) + "/";
+      ent = bidx.find(dir);
+    }
+    if(ent == NULL || ent->block != MEMBERINDEX_NO_BLOCK) {
+      fprintf(stderr, "'%s' is not a member of '%s'\n", line, tar_fn);
+      exit(1);
+    }
+    range r;
+    r.in_off = ent->offset;
+    r.out_off = 0;
+    r.size = ent->tarsize;
+    ranges->push_back(r);
+  }
+  free(line);
+  if(fh != stdin)
+    fclose(fh);
+}
+
+// copy a chunk using copy_file_range, returns false if the kernel or file
+// system cannot do it before anything was copied
+bool copy_chunk_in_kernel(int in_fd, int out_fd, const range &r)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+  loff_t in_off = loff_t(r.in_off), out_off = loff_t(r.out_off);
+  size_t left = r.size;
+  while(left > 0) {
+    ssize_t copied = copy_file_range(in_fd, &in_off, out_fd, &out_off, left, 0);
+    if(copied < 0 && left == r.size &&
+       (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+        errno == EOPNOTSUPP || errno == EBADF)) {
+      return false;
+    }
+    if(copied <= 0) {
+      fprintf(stderr, "Could not copy %zu bytes to output: %s\n", left,
+              copied == 0 ? "Unexpected end of file" : strerror(errno));
+      exit(1);
+    }
+    left -= size_t(copied);
+  }
+  return true;
+#else
+  (void)in_fd; (void)out_fd; (void)r;
+  return false;
+#endif
+}
+
+void copy_chunk(int in_fd, const char *in_fn, int out_fd, const range &r,
+                std::vector<char> &buf)
+{
+  for(size_t done = 0 ; done < r.size ; ) {
+    const size_t sz = std::min(r.size - done, buf.size());
+    pread_all(in_fd, in_fn, &buf[0], sz, r.in_off + done);
+    write_at(out_fd, &buf[0], sz, r.out_off + done);
+    done += sz;
+  }
+}
+}
+
+int main(int argc, char **argv)
+{
+  const char *list_fn = NULL;
+  int opt;
+  while((opt = getopt(argc, argv, "j:T:h")) != -1) {
+    switch(opt) {
+      case 'j':
+        omp_set_num_threads(atoi(optarg));
+        break;
+      case 'T':
+        list_fn = optarg;
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(argc - optind != (list_fn ? 1 : 2)) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *tar_fn = argv[argc-1];
+  int tar_fd = open(tar_fn, O_RDONLY);
+  if(tar_fd < 0) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", tar_fn,
+            strerror(errno));
+    return 1;
+  }
+
+  std::vector<range> ranges;
+  if(list_fn) {
+    lookup_files(list_fn, tar_fn, tar_fd, &ranges);
+  } else {
+    read_index(argv[optind], &ranges);
+    // only the headers tell how large each member is
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(size_t i = 0 ; i < ranges.size() ; i++)
+      ranges[i].size = member_size(tar_fd, tar_fn, ranges[i].in_off);
+  }
+
+  // members appear in the order they are in the input, each only once
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<range> chunks;
+  size_t out_sz = 0;
+  for(size_t i = 0 ; i < ranges.size() ; i++) {
+    if(i > 0 && ranges[i].in_off == ranges[i-1].in_off)
+      continue;
+    range r = ranges[i];
+    r.out_off = out_sz;
+    out_sz += r.size;
+    if(!chunks.empty() &&
+       chunks.back().in_off + chunks.back().size == r.in_off &&
+       chunks.back().size + r.size <= CHUNK_SIZE) {
+      chunks.back().size += r.size;
+      continue;
+    }
+    for(size_t done = 0 ; done < r.size ; done += CHUNK_SIZE) {
+      range c = r;
+      c.in_off += done;
+      c.out_off += done;
+      c.size = std::min(r.size - done, size_t(CHUNK_SIZE));
+      chunks.push_back(c);
+    }
+  }
+
+  static char term[2*BLOCKSIZE];
+  const int out_fd = STDOUT_FILENO;
+  struct stat out_stat;
+  const off_t out_base = lseek(out_fd, 0, SEEK_CUR);
+  const int out_flags = fcntl(out_fd, F_GETFL);
+  if(fstat(out_fd, &out_stat) == 0 && S_ISREG(out_stat.st_mode) &&
+     out_base != -1 && out_flags != -1 && !(out_flags & O_APPEND)) {
+    // regular file, every chunk knows where it goes
+    int use_kernel_copy = 1;
+    #pragma omp parallel
+    {
+      std::vector<char> buf;
+      #pragma omp for schedule(dynamic)
+      for(size_t i = 0 ; i < chunks.size() ; i++) {
+        range c = chunks[i];
+        c.out_off += size_t(out_base);
+        int try_kernel;
+        #pragma omp atomic read
+        try_kernel = use_kernel_copy;
+        if(try_kernel && copy_chunk_in_kernel(tar_fd, out_fd, c))
+          continue;
+        #pragma omp atomic write
+        use_kernel_copy = 0;
+        if(buf.empty())
+          buf.resize(COPY_BUFFER_SIZE);
+        copy_chunk(tar_fd, tar_fn, out_fd, c, buf);
+      }
+    }
+    write_at(out_fd, term, sizeof(term), size_t(out_base) + out_sz);
+    if(lseek(out_fd, out_base + off_t(out_sz + sizeof(term)), SEEK_SET) == -1) {
+      fprintf(stderr, "Could not seek output: %s\n", strerror(errno));
+      return 1;
+    }
+  } else {
+    // pipe or similar, write everything in order
+    std::vector<char> buf(COPY_BUFFER_SIZE);
+    for(size_t i = 0 ; i < chunks.size() ; i++) {
+      for(size_t done = 0 ; done < chunks[i].size ; ) {
+        const size_t sz = std::min(chunks[i].size - done, buf.size());
+        pread_all(tar_fd, tar_fn, &buf[0], sz, chunks[i].in_off + done);
+        write_all(out_fd, &buf[0], sz);
+        done += sz;
+      }
+    }
+    write_all(out_fd, term, sizeof(term));
+  }
+
+  close(tar_fd);
+  return 0;
+}
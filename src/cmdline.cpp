@@ -40,16 +40,16 @@
 
 namespace {
 void usage(const char *cmd) {
-  fprintf(stdout, "%s: -c -f FILE [-T FILE] [FILE]...\n", cmd);
+  fprintf(stdout, "%s: -c -f FILE [-N] [-T FILE] [FILE]...\n", cmd);
 }
 }
 
 cmdline::cmdline(const int argc, char * const argv[], bool mute) :
-  action(ACTION_INVALID), entries(), tarfilename()
+  action(ACTION_INVALID), entries(), tarfilename(), numa(false)
 {
   int opt;
   opterr = 0; // we handle our own errors
-  while((opt = getopt(argc, argv, "-cf:T:h")) != -1) {
+  while((opt = getopt(argc, argv, "-cf:NT:h")) != -1) {
     switch(opt) {
       case 'c':
         if(action && action != ACTION_CREATE) {
@@ -73,6 +73,9 @@ cmdline::cmdline(const int argc, char * const argv[], bool mute) :
         }
         tarfilename = optarg;
         break;
+      case 'N':
+        numa = true;
+        break;
       case 'T':
         entries.add_entry(new filelist(optarg));
         break;
@@ -51,11 +51,14 @@ class cmdline
   action get_action() const { return action; };
   fileentries& get_fileentries() { return entries; };
   const std::string &get_tarfilename() const { return tarfilename; };
+  // place ranks, threads and buffers on NUMA nodes
+  bool get_numa() const { return numa; };
 
   private:
   action action;
   fileentries entries;
   std::string tarfilename;
+  bool numa;
 };
 
 #endif // CMDLINE_HH_
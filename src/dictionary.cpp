@@ -0,0 +1,280 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "dictionary.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+#include <queue>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// bytes read from each sample file
+#define SAMPLE_SIZE (64u*1024u)
+// total sample bytes kept
+#define MAX_SAMPLE_BYTES (4u*1024u*1024u)
+// length of the substrings that are counted
+#define DMER_SIZE 8u
+// length of the pieces of samples the dictionary is made of
+#define SEGMENT_SIZE 64u
+// substrings are counted in this many ranges of their keys in parallel
+#define KEY_RANGES 64u
+
+namespace {
+uint64_t dmer(const char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// a substring spread evenly over all 64 bit values, so that ranges of keys
+// hold about the same number of substrings. Odd multipliers lose nothing.
+uint64_t dmer_key(const char *p)
+{
+  return dmer(p) * 0x9e3779b97f4a7c15ull;
+}
+
+size_t key_range(const uint64_t key)
+{
+  return size_t(key / (UINT64_MAX / KEY_RANGES + 1));
+}
+
+// a segment of the samples and its score when last computed
+struct segment {
+  size_t score;
+  size_t off;
+  bool operator<(const segment &o) const {
+    return score < o.score || (score == o.score && off > o.off);
+  }
+};
+}
+
+void dictionary::add_file(const std::string &fn)
+{
+  int fd = open(fn.c_str(), O_RDONLY);
+  if(fd < 0)
+    return;
+  std::vector<char> buf(SAMPLE_SIZE);
+  ssize_t sz = read(fd, &buf[0], buf.size());
+  close(fd);
+  if(sz > 0)
+    add_sample(&buf[0], size_t(sz));
+}
+
+void dictionary::add_files(const std::vector<std::string> &fns,
+                           const std::vector<size_t> &sizes)
+{
+  // pick the files add_sample() would keep by their sizes, the others need
+  // not be read
+  std::vector<size_t> picked;
+  size_t total = samples.size();
+  for(size_t i = 0 ; i < fns.size() ; i++) {
+    const size_t sz = std::min(sizes[i], size_t(SAMPLE_SIZE));
+    if(sz >= DMER_SIZE && total + sz <= MAX_SAMPLE_BYTES) {
+      picked.push_back(i);
+      total += sz;
+    }
+  }
+
+  std::vector<std::string> bufs(picked.size());
+  #pragma omp parallel for schedule(dynamic)
+  for(size_t i = 0 ; i < picked.size() ; i++) {
+    int fd = open(fns[picked[i]].c_str(), O_RDONLY);
+    if(fd < 0)
+      continue;
+    bufs[i].resize(SAMPLE_SIZE);
+    ssize_t sz = read(fd, &bufs[i][0], bufs[i].size());
+    close(fd);
+    bufs[i].resize(sz > 0 ? size_t(sz) : 0);
+  }
+  for(size_t i = 0 ; i < bufs.size() ; i++) {
+    if(!bufs[i].empty())
+      add_sample(bufs[i].data(), bufs[i].size());
+  }
+}
+
+void dictionary::add_sample(const char *buf, const size_t sz)
+{
+  if(samples.size() + sz > MAX_SAMPLE_BYTES || sz < DMER_SIZE)
+    return;
+  starts.push_back(samples.size());
+  samples.append(buf, sz);
+  // segments do not span samples
+  for(size_t i = 0 ; i + SEGMENT_SIZE <= sz ; i += SEGMENT_SIZE / 2)
+    offsets.push_back(samples.size() - sz + i);
+}
+
+std::vector<uint32_t> dictionary::weights() const
+{
+  // the substrings of all samples with their positions, grouped into ranges
+  // of their keys that are counted in parallel
+  std::vector<std::vector<std::pair<uint64_t, uint32_t> > > ranges(KEY_RANGES);
+  for(size_t s = 0 ; s < starts.size() ; s++) {
+    const size_t end = s + 1 < starts.size() ? starts[s + 1] : samples.size();
+    for(size_t i = starts[s] ; i + DMER_SIZE <= end ; i++) {
+      const uint64_t key = dmer_key(&samples[i]);
+      ranges[key_range(key)].push_back(std::make_pair(key, uint32_t(i)));
+    }
+  }
+
+  // sorted, all positions of a substring follow each other in the order of
+  // the samples, so it is easy to count in how many samples it occurs
+  std::vector<uint32_t> weight(samples.size(), 0);
+  #pragma omp parallel for schedule(dynamic)
+  for(size_t r = 0 ; r < KEY_RANGES ; r++) {
+    std::vector<std::pair<uint64_t, uint32_t> > &range = ranges[r];
+    std::sort(range.begin(), range.end());
+    for(size_t i = 0 ; i < range.size() ; ) {
+      size_t count = 0;
+      size_t sample_end = 0;
+      size_t j = i;
+      for( ; j < range.size() && range[j].first == range[i].first ; j++) {
+        if(range[j].second < sample_end)
+          continue;
+        count++;
+        std::vector<size_t>::const_iterator next =
+          std::upper_bound(starts.begin(), starts.end(), range[j].second);
+        sample_end = next != starts.end() ? *next : samples.size();
+      }
+      // a substring found in a single file does not help any other file
+      for( ; count > 1 && i < j ; i++)
+        weight[range[i].second] = uint32_t(count - 1);
+      i = j;
+    }
+    std::vector<std::pair<uint64_t, uint32_t> >().swap(range);
+  }
+  return weight;
+}
+
+size_t dictionary::score(const size_t off, const std::vector<uint32_t> &weight,
+                         const std::unordered_set<uint64_t> &used) const
+{
+  size_t sum = 0;
+  for(size_t i = off ; i + DMER_SIZE <= off + SEGMENT_SIZE ; i++) {
+    if(weight[i] > 0 && !used.count(dmer(&samples[i])))
+      sum += weight[i];
+  }
+  return sum;
+}
+
+std::string dictionary::train(const size_t max_size) const
+{
+  // greedily take the segment covering the most frequent substrings that are
+  // not yet in the dictionary. Scores only go down as the dictionary grows, so
+  // a segment whose recomputed score is still the best can be taken.
+  const std::vector<uint32_t> weight(weights());
+  std::unordered_set<uint64_t> used;
+  std::vector<segment> segs(offsets.size());
+  #pragma omp parallel for schedule(static)
+  for(size_t i = 0 ; i < offsets.size() ; i++) {
+    segs[i].off = offsets[i];
+    segs[i].score = score(offsets[i], weight, used);
+  }
+  std::priority_queue<segment> heap;
+  for(size_t i = 0 ; i < segs.size() ; i++) {
+    if(segs[i].score > 0)
+      heap.push(segs[i]);
+  }
+  std::vector<segment>().swap(segs);
+
+  const size_t tail_size = std::min(tail.size(), max_size);
+  std::vector<size_t> chosen;
+  size_t used_size = tail_size;
+  while(!heap.empty() && used_size + SEGMENT_SIZE <= max_size) {
+    segment seg = heap.top();
+    heap.pop();
+    const size_t now = score(seg.off, weight, used);
+    if(now == 0)
+      continue;
+    if(now < seg.score && !heap.empty() && now < heap.top().score) {
+      seg.score = now;
+      heap.push(seg);
+      continue;
+    }
+    chosen.push_back(seg.off);
+    used_size += SEGMENT_SIZE;
+    for(size_t i = seg.off ; i + DMER_SIZE <= seg.off + SEGMENT_SIZE ; i++)
+      used.insert(dmer(&samples[i]));
+  }
+
+  // the best segments go last, closest to the data
+  std::string dict;
+  dict.reserve(used_size);
+  for(size_t i = chosen.size() ; i-- > 0 ; )
+    dict.append(samples, chosen[i], SEGMENT_SIZE);
+  dict.append(tail, tail.size() - tail_size, tail_size);
+  return dict;
+}
+
+std::string dictionary::load(const std::string &fn)
+{
+  FILE *fh = fopen(fn.c_str(), "rb");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  std::vector<char> buf(MAX_SIZE);
+  size_t sz = fread(&buf[0], 1, buf.size(), fh);
+  if(ferror(fh)) {
+    fprintf(stderr, "Could not read from '%s': %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  fclose(fh);
+  return std::string(&buf[0], sz);
+}
+
+void dictionary::save(const std::string &fn, const std::string &dict)
+{
+  FILE *fh = fopen(fn.c_str(), "wb");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  if(fwrite(dict.data(), 1, dict.size(), fh) != dict.size() ||
+     fclose(fh) != 0) {
+    fprintf(stderr, "Could not write to '%s': %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef DICTIONARY_HH_
+#define DICTIONARY_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// preset dictionary for deflate built from sample files
+// deflate can refer back to a dictionary of up to 32 KiB at the start of a
+// stream, which helps blocks whose files share content that is too far apart
+// for the 32 KiB window, such as the first files of each block. The
+// dictionary is made of the 64 byte pieces of the samples that cover the 8
+// byte substrings found in the most sample files, picked greedily so that
+// pieces do not repeat each other, followed by a typical tar header, with the
+// most valuable data at the end where the distances are shortest.
+class dictionary
+{
+  public:
+  dictionary() {};
+  ~dictionary() {};
+
+  // adds the first bytes of the file fn, unreadable files are skipped
+  void add_file(const std::string &fn);
+  // adds the first bytes of the files fns, reading them in parallel. sizes
+  // are the sizes of the files as far as known, files that would not fit in
+  // the samples any more are not read at all.
+  void add_files(const std::vector<std::string> &fns,
+                 const std::vector<size_t> &sizes);
+  void add_sample(const char *buf, const size_t sz);
+  // bytes put at the very end of the dictionary, e.g. a tar header
+  void set_tail(const std::string &tail_) { tail = tail_; }
+
+  // builds the dictionary of at most max_size bytes, counting the
+  // substrings of the samples in parallel
+  std::string train(const size_t max_size = MAX_SIZE) const;
+
+  // read and write a dictionary file, these print a message and exit on
+  // errors
+  static std::string load(const std::string &fn);
+  static void save(const std::string &fn, const std::string &dict);
+
+  static const size_t MAX_SIZE = 32768;
+
+  private:
+  // all samples back to back, the start of every sample and of every segment
+  // in them
+  std::string samples;
+  std::vector<size_t> starts;
+  std::vector<size_t> offsets;
+  std::string tail;
+
+  // for every position of the samples the number of other samples the 8 byte
+  // substring starting there occurs in
+  std::vector<uint32_t> weights() const;
+  // sum of the weights of the substrings of the segment at off not in used
+  size_t score(const size_t off, const std::vector<uint32_t> &weight,
+               const std::unordered_set<uint64_t> &used) const;
+};
+
+#endif // DICTIONARY_HH_
@@ -0,0 +1,35 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+# this script lists the members of a binary index that are stored in a block
+# as "block offset tarsize path", one per line
+
+if(scalar @ARGV != 1) {
+  print STDERR "usage: index.bidx\n";
+  exit 1;
+}
+
+my $NO_BLOCK = 0xffffffff;
+
+open(my $bidx_fh, "<", $ARGV[0]) or die $!;
+binmode($bidx_fh);
+local $/;
+my $data = <$bidx_fh>;
+close($bidx_fh);
+
+# see memberindex_header and memberindex_entry in memberindex.hh
+my ($magic, $version, $entry_size, $count, $nblocks, $entries_off,
+    $blocks_off, $strings_off, $strings_size) =
+  unpack("Z8 V V Q< Q< Q< Q< Q< Q<", $data);
+die "$ARGV[0] is not a binary index\n" if($magic ne "PTGZBIX");
+
+for(my $i = 0 ; $i < $count ; $i++) {
+  my ($path_off, $offset, $size, $tarsize, $mtime, $path_len, $block) =
+    unpack("Q< Q< Q< Q< q< V V",
+           substr($data, $entries_off + $i * $entry_size, $entry_size));
+  next if($block == $NO_BLOCK);
+  my $path = substr($data, $strings_off + $path_off, $path_len);
+  print "$block $offset $tarsize $path\n";
+}
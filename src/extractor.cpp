@@ -0,0 +1,771 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "extractor.hh"
+#include "tarentry.hh"
+#include "iopolicy.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <omp.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#define INPUT_CHUNK_SIZE (1024ul*1024ul)
+#define DATA_CHUNK_SIZE (1024ul*1024ul)
+// number of open directories per thread before the cache is emptied
+#define DIRFD_CACHE_SIZE 256
+// smaller files are written in a single call, which allocates them in one go
+// anyway
+#define PREALLOCATE_MIN_SIZE DATA_CHUNK_SIZE
+#define GNU_LONGNAME 'L'
+#define GNU_LONGLINK 'K'
+#define CONTTYPE '7'
+#define XGLTYPE 'g'
+
+struct extractor::thread_state {
+  std::unordered_map<std::string, int> fds;
+  std::vector<metadata> files;
+  std::vector<metadata> dirs;
+
+  ~thread_state() { clear(); }
+  void clear() {
+    for(std::unordered_map<std::string, int>::iterator it = fds.begin() ;
+        it != fds.end() ; ++it)
+      close(it->second);
+    fds.clear();
+  }
+};
+
+namespace {
+// inflates a gzip stream stored in a range of a file
+class gzreader
+{
+  public:
+  gzreader(int fd_, size_t off, size_t sz, const std::string &dict_) :
+    fd(fd_), pos(off), end(off+sz), in(INPUT_CHUNK_SIZE), dict(dict_),
+    hints(fd_, off, sz), ended(false), errmsg(NULL) {
+    memset(&zs, 0, sizeof(zs));
+    // 32 accepts gzip and zlib headers
+    if(inflateInit2(&zs, 15+32) != Z_OK)
+      errmsg = "Could not initialize zlib";
+  }
+  // the archive is read once, what was read is dropped from the page cache
+  ~gzreader() { inflateEnd(&zs); hints.done(); }
+
+  // reads exactly sz bytes, false on errors or at the end of the stream
+  bool read(char *buf, size_t sz) {
+    if(errmsg)
+      return false;
+    if(ended) {
+      errmsg = "Unexpected end of compressed data";
+      return false;
+    }
+    zs.next_out = reinterpret_cast<Bytef*>(buf);
+    zs.avail_out = uInt(sz);
+    while(zs.avail_out > 0) {
+      if(zs.avail_in == 0 && !fill())
+        return false;
+      int ret = step();
+      if(ret == Z_STREAM_END) {
+        // concatenated gzip members are a single stream, like for gunzip
+        if(zs.avail_in == 0 && pos == end) {
+          ended = true;
+          if(zs.avail_out > 0)
+            errmsg = "Unexpected end of compressed data";
+          return zs.avail_out == 0;
+        }
+        inflateReset(&zs);
+      } else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+        errmsg = zs.msg ? zs.msg : "Invalid compressed data";
+        return false;
+      }
+    }
+    return true;
+  }
+  bool skip(size_t sz) {
+    char buf[4*BLOCKSIZE];
+    while(sz > 0) {
+      const size_t chunk = sz < sizeof(buf) ? sz : sizeof(buf);
+      if(!read(buf, chunk))
+        return false;
+      sz -= chunk;
+    }
+    return true;
+  }
+
+  // inflates whatever follows the end of the tar archive, which checks the
+  // CRC at the end of the gzip stream
+  bool drain() {
+    char buf[4*BLOCKSIZE];
+    while(!ended && !errmsg) {
+      zs.next_out = reinterpret_cast<Bytef*>(buf);
+      zs.avail_out = uInt(sizeof(buf));
+      if(zs.avail_in == 0 && !fill())
+        return false;
+      int ret = step();
+      if(ret == Z_STREAM_END) {
+        if(zs.avail_in == 0 && pos == end)
+          ended = true;
+        else
+          inflateReset(&zs);
+      } else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+        errmsg = zs.msg ? zs.msg : "Invalid compressed data";
+      }
+    }
+    return errmsg == NULL;
+  }
+
+  bool at_end() const { return ended; }
+  const char *error() const { return errmsg; }
+  size_t total_out() const { return size_t(zs.total_out); }
+
+  private:
+  int fd;
+  size_t pos, end;
+  std::vector<char> in;
+  const std::string &dict;
+  readhints hints;
+  z_stream zs;
+  bool ended;
+  const char *errmsg;
+
+  // inflates, supplying the preset dictionary to zlib streams that ask for
+  // one
+  int step() {
+    int ret = inflate(&zs, Z_NO_FLUSH);
+    if(ret == Z_NEED_DICT) {
+      if(dict.empty())
+        return Z_DATA_ERROR;
+      ret = inflateSetDictionary(&zs,
+                                 reinterpret_cast<const Bytef*>(dict.data()),
+                                 uInt(dict.size()));
+      if(ret == Z_OK)
+        ret = inflate(&zs, Z_NO_FLUSH);
+    }
+    return ret;
+  }
+
+  // read the next chunk of compressed data
+  bool fill() {
+    if(pos == end) {
+      errmsg = "Unexpected end of compressed data";
+      return false;
+    }
+    const size_t sz = end - pos < in.size() ? end - pos : in.size();
+    size_t done = 0;
+    while(done < sz) {
+      ssize_t read_sz = pread(fd, &in[done], sz - done, off_t(pos + done));
+      if(read_sz <= 0) {
+        errmsg = read_sz == 0 ? "Unexpected end of file" : strerror(errno);
+        return false;
+      }
+      done += size_t(read_sz);
+    }
+    pos += sz;
+    // lets the kernel read ahead while this chunk is inflated
+    hints.read_to(pos);
+    zs.next_in = reinterpret_cast<Bytef*>(&in[0]);
+    zs.avail_in = uInt(sz);
+    return true;
+  }
+};
+
+// checks the checksum of a tar header
+bool valid_header(const ustar_hdr &hdr)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(&hdr);
+  unsigned long sum = 0;
+  for(size_t i = 0 ; i < sizeof(hdr) ; i++)
+    sum += p[i];
+  for(size_t i = 0 ; i < sizeof(hdr.chksum) ; i++)
+    sum += ' ' - (unsigned char)hdr.chksum[i];
+  char buf[sizeof(hdr.chksum)+1];
+  memcpy(buf, hdr.chksum, sizeof(hdr.chksum));
+  buf[sizeof(hdr.chksum)] = '\0';
+  return strtoul(buf, NULL, 8) == sum;
+}
+
+bool zero_block(const ustar_hdr &hdr)
+{
+  const char *p = reinterpret_cast<const char*>(&hdr);
+  for(size_t i = 0 ; i < sizeof(hdr) ; i++)
+    if(p[i])
+      return false;
+  return true;
+}
+
+unsigned long octal_field(const char *field, size_t sz)
+{
+  char buf[16];
+  assert(sz < sizeof(buf));
+  memcpy(buf, field, sz);
+  buf[sz] = '\0';
+  return strtoul(buf, NULL, 8);
+}
+
+std::string string_field(const char *field, size_t sz)
+{
+  return std::string(field, strnlen(field, sz));
+}
+
+// member name relative to the current directory without leading or trailing
+// slashes, empty if it must not be extracted
+std::string clean_path(const std::string &name)
+{
+  const size_t start = name.find_first_not_of('/');
+  if(start == std::string::npos)
+    return "";
+  std::string path(name, start);
+  while(!path.empty() && path[path.size()-1] == '/')
+    path.erase(path.size()-1);
+  // no escaping from the current directory
+  for(size_t p = 0 ; p <= path.size() ; ) {
+    size_t q = path.find('/', p);
+    if(q == std::string::npos)
+      q = path.size();
+    if(q - p == 2 && path[p] == '.' && path[p+1] == '.')
+      return "";
+    p = q + 1;
+  }
+  return path;
+}
+
+bool write_all(int fd, const char *buf, size_t sz)
+{
+  while(sz > 0) {
+    ssize_t write_sz = write(fd, buf, sz);
+    if(write_sz < 0) {
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += write_sz;
+    sz -= size_t(write_sz);
+  }
+  return true;
+}
+
+// reads the map of data extents at the start of the data of a GNU pax sparse
+// 1.0 member, *left is reduced by the blocks it takes up. Returns false if it
+// is invalid or cannot be read.
+bool read_sparse_map(gzreader &in, size_t *left, std::vector<tar_extent> *map)
+{
+  // "<count>\n" followed by "<offset>\n<size>\n" for each extent
+  std::string text;
+  std::vector<size_t> numbers;
+  size_t p = 0;
+  char block[BLOCKSIZE];
+  for(;;) {
+    for(size_t nl = text.find('\n', p) ; nl != std::string::npos ;
+        nl = text.find('\n', p)) {
+      char *end;
+      numbers.push_back(size_t(strtoull(text.c_str() + p, &end, 10)));
+      if(nl == p || end != text.c_str() + nl)
+        return false;
+      p = nl + 1;
+      if(numbers.size() == 1 + 2*numbers[0]) {
+        map->clear();
+        for(size_t i = 1 ; i < numbers.size() ; i += 2) {
+          const tar_extent ext = {numbers[i], numbers[i+1]};
+          map->push_back(ext);
+        }
+        return true;
+      }
+    }
+    if(*left < BLOCKSIZE || !in.read(block, BLOCKSIZE))
+      return false;
+    *left -= BLOCKSIZE;
+    text.append(block, BLOCKSIZE);
+  }
+}
+
+// location of a deferred metadata entry in the per thread lists
+struct metadata_ref {
+  size_t state, index;
+  metadata_ref(size_t state_, size_t index_) : state(state_), index(index_) {};
+};
+
+size_t depth(const std::string &path)
+{
+  return size_t(std::count(path.begin(), path.end(), '/'));
+}
+}
+
+extractor::extractor(const bool defer_files_) :
+  states(size_t(omp_get_max_threads())), defer_files(defer_files_),
+  is_root(geteuid() == 0), nerrors(0), nmembers(0)
+{
+  // tar applies the umask unless run by root
+  mask = umask(0);
+  umask(mask);
+  if(is_root)
+    mask = 0;
+  for(size_t i = 0 ; i < states.size() ; i++)
+    states[i] = new thread_state;
+}
+
+extractor::~extractor()
+{
+  for(size_t i = 0 ; i < states.size() ; i++)
+    delete states[i];
+}
+
+void extractor::error(const char *fn, const std::string &member,
+                      const char *what)
+{
+  fprintf(stderr, "Could not extract '%s' from '%s': %s\n", member.c_str(),
+          fn, what);
+  #pragma omp atomic
+  nerrors++;
+}
+
+void extractor::stream_error(const char *fn, size_t off, const char *what)
+{
+  fprintf(stderr, "Could not extract the tar stream at %zu of '%s': %s\n", off,
+          fn, what);
+  #pragma omp atomic
+  nerrors++;
+}
+
+bool extractor::get_dir(thread_state &cache, const char *path, size_t len,
+                        int *dirfd)
+{
+  if(len == 0) {
+    *dirfd = AT_FDCWD;
+    return true;
+  }
+  const std::string key(path, len);
+  std::unordered_map<std::string, int>::const_iterator it = cache.fds.find(key);
+  if(it != cache.fds.end()) {
+    *dirfd = it->second;
+    return true;
+  }
+
+  size_t parent_len = len;
+  while(parent_len > 0 && path[parent_len-1] != '/')
+    parent_len--;
+  const char *name = path + parent_len;
+  int parentfd;
+  if(!get_dir(cache, path, parent_len > 0 ? parent_len-1 : 0, &parentfd))
+    return false;
+  const std::string base(name, len - parent_len);
+  // a symlink extracted earlier must not lead later members out of the tree
+  const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+  int fd = openat(parentfd, base.c_str(), flags);
+  if(fd < 0 && errno == ENOENT) {
+    // missing parent of a member, its own entry sets mode and time later
+    if(mkdirat(parentfd, base.c_str(), 0777) != 0 && errno != EEXIST)
+      return false;
+    fd = openat(parentfd, base.c_str(), flags);
+  }
+  if(fd < 0)
+    return false;
+
+  // simply start over when full, parents are cheap to look up again
+  if(cache.fds.size() >= DIRFD_CACHE_SIZE)
+    cache.clear();
+  cache.fds[key] = fd;
+  *dirfd = fd;
+  return true;
+}
+
+size_t extractor::extract(int fd, const char *fn, size_t off, size_t sz)
+{
+  thread_state &state = *states[size_t(omp_get_thread_num())];
+  gzreader in(fd, off, sz, dict);
+  std::vector<char> data(DATA_CHUNK_SIZE);
+
+  // values from pax extended or GNU long name headers for the next member
+  std::string long_path, long_link;
+  size_t pax_size = 0;
+  bool have_pax_size = false;
+  // real size of a sparse file, only GNU sparse format 1.0 is supported
+  size_t sparse_size = 0;
+  bool have_sparse = false;
+  bool other_sparse = false;
+  size_t zero_blocks = 0;
+  size_t count = 0;
+  ustar_hdr hdr;
+  while(!in.at_end() && in.read(reinterpret_cast<char*>(&hdr), sizeof(hdr))) {
+    if(zero_block(hdr)) {
+      // two zero blocks end the archive
+      if(++zero_blocks == 2) {
+        in.drain();
+        break;
+      }
+      continue;
+    }
+    zero_blocks = 0;
+    if(!valid_header(hdr)) {
+      stream_error(fn, off, "Invalid tar header checksum");
+      return in.total_out();
+    }
+    size_t size = tar_size_field(hdr);
+
+    // headers that describe the next member
+    if(hdr.typeflag == XHDTYPE || hdr.typeflag == XGLTYPE ||
+       hdr.typeflag == GNU_LONGNAME || hdr.typeflag == GNU_LONGLINK) {
+      std::string value(size, '\0');
+      if(!in.read(&value[0], size) ||
+         !in.skip(((size + BLOCKSIZE-1) & ~size_t(BLOCKSIZE-1)) - size))
+        break;
+      if(hdr.typeflag == GNU_LONGNAME) {
+        long_path = value.c_str();
+      } else if(hdr.typeflag == GNU_LONGLINK) {
+        long_link = value.c_str();
+      } else if(hdr.typeflag == XHDTYPE) {
+        // records are "<length> <keyword>=<value>\n"
+        for(size_t p = 0 ; p < value.size() ; ) {
+          char *end;
+          const size_t len = size_t(strtoull(value.c_str() + p, &end, 10));
+          const size_t eq = value.find('=', p);
+          if(end == value.c_str() + p || *end != ' ' || len == 0 ||
+             p + len > value.size() || eq == std::string::npos ||
+             eq > p + len) {
+            stream_error(fn, off, "Invalid pax extended header");
+            return in.total_out();
+          }
+          const size_t key_start = size_t(end + 1 - value.c_str());
+          const std::string key(value, key_start, eq - key_start);
+          const std::string val(value, eq + 1, p + len - 1 - (eq + 1));
+          if(key == "path") {
+            long_path = val;
+          } else if(key == "linkpath") {
+            long_link = val;
+          } else if(key == "size") {
+            pax_size = size_t(strtoull(val.c_str(), NULL, 10));
+            have_pax_size = true;
+          } else if(key == "GNU.sparse.name") {
+            long_path = val;
+          } else if(key == "GNU.sparse.realsize") {
+            sparse_size = size_t(strtoull(val.c_str(), NULL, 10));
+            have_sparse = true;
+          } else if(key.compare(0, 11, "GNU.sparse.") == 0 &&
+                    !(key == "GNU.sparse.major" && val == "1") &&
+                    !(key == "GNU.sparse.minor" && val == "0")) {
+            other_sparse = true;
+          }
+          p += len;
+        }
+      }
+      continue;
+    }
+
+    std::string name = long_path;
+    if(name.empty()) {
+      name = string_field(hdr.name, sizeof(hdr.name));
+      if(memcmp(hdr.magic, TMAGIC, sizeof(hdr.magic)) == 0 && hdr.prefix[0])
+        name = string_field(hdr.prefix, sizeof(hdr.prefix)) + "/" + name;
+    }
+    std::string link = long_link;
+    if(link.empty())
+      link = string_field(hdr.linkname, sizeof(hdr.linkname));
+    if(have_pax_size)
+      size = pax_size;
+    const bool sparse = have_sparse && !other_sparse;
+    const bool unsupported_sparse = other_sparse;
+    long_path.clear();
+    long_link.clear();
+    have_pax_size = false;
+    have_sparse = false;
+    other_sparse = false;
+    count++;
+
+    const size_t data_size = hdr.typeflag == REGTYPE ||
+                             hdr.typeflag == '\0' ||
+                             hdr.typeflag == CONTTYPE ? size : 0;
+    size_t skip_size = ((size + BLOCKSIZE-1) & ~size_t(BLOCKSIZE-1)) -
+                       data_size;
+    const std::string path = clean_path(name);
+    const size_t slash = path.rfind('/');
+    const std::string base = slash == std::string::npos ? path :
+                             path.substr(slash + 1);
+    const mode_t mode = mode_t(octal_field(hdr.mode, sizeof(hdr.mode)));
+    const uid_t uid = uid_t(octal_field(hdr.uid, sizeof(hdr.uid)));
+    const gid_t gid = gid_t(octal_field(hdr.gid, sizeof(hdr.gid)));
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_NOW;
+    times[1].tv_sec = time_t(octal_field(hdr.mtime, sizeof(hdr.mtime)));
+    times[1].tv_nsec = 0;
+
+    int dirfd = AT_FDCWD;
+    const char *failed = NULL;
+    if(path.empty() || base == ".") {
+      if(hdr.typeflag != DIRTYPE)
+        failed = "Refusing to extract member outside of the current directory";
+    } else if(!get_dir(state, path.c_str(),
+                       slash == std::string::npos ? 0 : slash, &dirfd)) {
+      failed = strerror(errno);
+    } else if(unsupported_sparse) {
+      failed = "Unsupported sparse file format";
+    }
+
+    if(failed) {
+      // the data is skipped along with the padding
+      skip_size += data_size;
+    } else if(hdr.typeflag == DIRTYPE) {
+      // owner always has access until finish_dirs() sets the real mode
+      if(mkdirat(dirfd, base.c_str(), (mode & MODE_MASK) | S_IRWXU) != 0 &&
+         errno != EEXIST) {
+        failed = strerror(errno);
+      } else {
+        metadata meta;
+        meta.path = path;
+        meta.mode = mode & MODE_MASK & ~mask;
+        meta.uid = uid;
+        meta.gid = gid;
+        meta.mtime = times[1];
+        meta.set_owner = is_root;
+        meta.set_mode = true;
+        state.dirs.push_back(meta);
+      }
+    } else if(hdr.typeflag == SYMTYPE) {
+      int ierr = symlinkat(link.c_str(), dirfd, base.c_str());
+      if(ierr != 0 && errno == EEXIST && unlinkat(dirfd, base.c_str(), 0) == 0)
+        ierr = symlinkat(link.c_str(), dirfd, base.c_str());
+      if(ierr != 0 ||
+         (is_root && fchownat(dirfd, base.c_str(), uid, gid,
+                              AT_SYMLINK_NOFOLLOW) != 0) ||
+         utimensat(dirfd, base.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+        failed = strerror(errno);
+    } else if(hdr.typeflag == LNKTYPE) {
+      const std::string target = clean_path(link);
+      int ierr = -1;
+      if(target.empty()) {
+        errno = EINVAL;
+      } else {
+        ierr = linkat(AT_FDCWD, target.c_str(), dirfd, base.c_str(), 0);
+        if(ierr != 0 && errno == EEXIST &&
+           unlinkat(dirfd, base.c_str(), 0) == 0)
+          ierr = linkat(AT_FDCWD, target.c_str(), dirfd, base.c_str(), 0);
+      }
+      if(ierr != 0)
+        failed = strerror(errno);
+    } else if(data_size == size) {
+      // regular file, replace whatever is there like tar does
+      int out_fd = openat(dirfd, base.c_str(),
+                          O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                          mode & MODE_MASK);
+      if(out_fd < 0 && errno == EEXIST &&
+         unlinkat(dirfd, base.c_str(), 0) == 0)
+        out_fd = openat(dirfd, base.c_str(),
+                        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                        mode & MODE_MASK);
+      if(out_fd < 0)
+        failed = strerror(errno);
+      else if(!sparse && data_size >= PREALLOCATE_MIN_SIZE)
+        // keeps the file contiguous, file systems without support do not
+        // need it
+        fallocate(out_fd, FALLOC_FL_KEEP_SIZE, 0, off_t(data_size));
+      // the data of a sparse file is its map followed by the data extents,
+      // the holes between them are left unwritten
+      size_t left = data_size;
+      std::vector<tar_extent> extents;
+      if(!sparse) {
+        const tar_extent all = {0, data_size};
+        extents.push_back(all);
+      } else if(!read_sparse_map(in, &left, &extents)) {
+        if(in.error()) {
+          if(out_fd >= 0)
+            close(out_fd);
+          break;
+        }
+        failed = "Invalid sparse map";
+      }
+      size_t extents_size = 0;
+      for(size_t e = 0 ; e < extents.size() ; e++)
+        extents_size += extents[e].size;
+      // large files are written back while they are extracted
+      writeback wb(out_fd, 0);
+      if(extents_size != left) {
+        failed = "Invalid sparse map";
+        extents.clear();
+      }
+      for(size_t e = 0 ; e < extents.size() && left > 0 ; e++) {
+        if(sparse && out_fd >= 0 && !failed &&
+           lseek(out_fd, off_t(extents[e].offset), SEEK_SET) < 0)
+          failed = strerror(errno);
+        for(size_t done = 0 ; done < extents[e].size ; ) {
+          const size_t chunk = std::min(extents[e].size - done, data.size());
+          if(!in.read(&data[0], chunk))
+            break;
+          if(out_fd >= 0 && !failed && !write_all(out_fd, &data[0], chunk))
+            failed = strerror(errno);
+          done += chunk;
+          left -= chunk;
+          if(out_fd >= 0 && !failed)
+            wb.written_to(extents[e].offset + done);
+        }
+        if(in.error())
+          break;
+      }
+      // the data that goes with an invalid map
+      if(extents.empty() && in.skip(left))
+        left = 0;
+      if(left > 0) {
+        if(out_fd >= 0)
+          close(out_fd);
+        break;
+      }
+      if(sparse && out_fd >= 0 && !failed &&
+         ftruncate(out_fd, off_t(sparse_size)) != 0)
+        failed = strerror(errno);
+      if(out_fd >= 0 && !failed)
+        wb.done();
+      if(out_fd >= 0 && defer_files) {
+        metadata meta;
+        meta.path = path;
+        meta.mode = mode & MODE_MASK;
+        meta.uid = uid;
+        meta.gid = gid;
+        meta.mtime = times[1];
+        meta.set_owner = is_root;
+        meta.set_mode = is_root;
+        if(!failed)
+          state.files.push_back(meta);
+        if(close(out_fd) != 0 && !failed)
+          failed = strerror(errno);
+      } else if(out_fd >= 0) {
+        // chown clears set-id bits, so it goes before chmod
+        if(!failed && is_root &&
+           (fchown(out_fd, uid, gid) != 0 ||
+            fchmod(out_fd, mode & MODE_MASK) != 0))
+          failed = strerror(errno);
+        if(!failed && futimens(out_fd, times) != 0)
+          failed = strerror(errno);
+        if(close(out_fd) != 0 && !failed)
+          failed = strerror(errno);
+      }
+    } else {
+      failed = "Unsupported member type";
+    }
+    if(failed)
+      error(fn, name, failed);
+    if(!in.skip(skip_size))
+      break;
+  }
+  if(in.error())
+    stream_error(fn, off, in.error());
+
+  #pragma omp atomic
+  nmembers += count;
+  return in.total_out();
+}
+
+void extractor::apply(thread_state &state, const metadata &meta)
+{
+  const size_t slash = meta.path.rfind('/');
+  const char *base = slash == std::string::npos ? meta.path.c_str() :
+                     meta.path.c_str() + slash + 1;
+  int dirfd;
+  struct timespec times[2];
+  times[0].tv_sec = 0;
+  times[0].tv_nsec = UTIME_NOW;
+  times[1] = meta.mtime;
+  // chown clears set-id bits, so it goes before chmod
+  if(!get_dir(state, meta.path.c_str(),
+              slash == std::string::npos ? 0 : slash, &dirfd) ||
+     (meta.set_owner && fchownat(dirfd, base, meta.uid, meta.gid, 0) != 0) ||
+     (meta.set_mode && fchmodat(dirfd, base, meta.mode, 0) != 0) ||
+     utimensat(dirfd, base, times, 0) != 0)
+    error(".", meta.path, strerror(errno));
+}
+
+size_t extractor::finish_files()
+{
+  std::vector<metadata_ref> files;
+  for(size_t t = 0 ; t < states.size() ; t++) {
+    for(size_t i = 0 ; i < states[t]->files.size() ; i++)
+      files.push_back(metadata_ref(t, i));
+  }
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for(size_t i = 0 ; i < files.size() ; i++) {
+    thread_state &state = *states[size_t(omp_get_thread_num())];
+    apply(state, states[files[i].state]->files[files[i].index]);
+  }
+
+  for(size_t t = 0 ; t < states.size() ; t++)
+    states[t]->files.clear();
+  return files.size();
+}
+
+size_t extractor::dir_levels() const
+{
+  size_t levels = 0;
+  for(size_t t = 0 ; t < states.size() ; t++) {
+    for(size_t i = 0 ; i < states[t]->dirs.size() ; i++)
+      levels = std::max(levels, depth(states[t]->dirs[i].path) + 1);
+  }
+  return levels;
+}
+
+size_t extractor::finish_dirs(const size_t level)
+{
+  std::vector<metadata_ref> dirs;
+  for(size_t t = 0 ; t < states.size() ; t++) {
+    for(size_t i = 0 ; i < states[t]->dirs.size() ; i++) {
+      if(depth(states[t]->dirs[i].path) == level)
+        dirs.push_back(metadata_ref(t, i));
+    }
+  }
+
+  #pragma omp parallel for schedule(dynamic, 64)
+  for(size_t i = 0 ; i < dirs.size() ; i++) {
+    thread_state &state = *states[size_t(omp_get_thread_num())];
+    apply(state, states[dirs[i].state]->dirs[dirs[i].index]);
+  }
+
+  // the top level is the last one, nothing is left to do after it
+  if(level == 0) {
+    for(size_t t = 0 ; t < states.size() ; t++) {
+      states[t]->clear();
+      states[t]->dirs.clear();
+    }
+  }
+  return dirs.size();
+}
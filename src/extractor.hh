@@ -0,0 +1,122 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef EXTRACTOR_HH_
+#define EXTRACTOR_HH_
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+// in-process extraction of gzip or zlib compressed tar streams
+// Each thread inflates a stream with zlib and writes its members with the
+// *at() calls relative to directory file descriptors it keeps open, so that
+// a path is only resolved component by component when its directory is not
+// cached yet, and missing directories are created once when they are first
+// needed. Compressed input is read in chunks with the next chunk announced to
+// the kernel ahead of time so that reading overlaps inflating and writing.
+// Directory modes and times are applied by finish_dirs() since extracting
+// into a directory changes its mtime. With defer_files the ownership, mode and
+// times of regular files are collected as well and applied in parallel by
+// finish_files(),
+// so that metadata updates are not interleaved with writing data. Large files
+// are preallocated to their final size before their data is written.
+class extractor
+{
+  public:
+  extractor(const bool defer_files_ = false);
+  ~extractor();
+
+  // preset dictionary for zlib streams written by blockwriter
+  void set_dictionary(const std::string &dict_) { dict = dict_; }
+
+  // extracts the compressed tar stream stored in the sz bytes at off of
+  // fd into the current directory, thread safe. Problems with single members
+  // are reported and counted and the rest of the stream is still extracted.
+  // Returns the number of uncompressed bytes.
+  size_t extract(int fd, const char *fn, size_t off, size_t sz);
+  // applies the deferred metadata of files, call once all extract() calls
+  // are done. Returns the number of files that were updated.
+  size_t finish_files();
+  // number of levels of directories with deferred metadata, one more than
+  // the depth of the deepest one
+  size_t dir_levels() const;
+  // applies the deferred metadata of the directories at depth level, call
+  // after finish_files() for each level from the deepest up. A directory may
+  // lose write or search permission, so when several processes extract into
+  // the same tree all of them have to be done with a level before any starts
+  // on the one above. Returns the number of directories that were updated.
+  size_t finish_dirs(const size_t level);
+
+  // accessors
+  size_t errors() const { return nerrors; }
+  size_t members() const { return nmembers; }
+
+  private:
+  struct thread_state;
+  struct metadata {
+    std::string path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+    bool set_owner;
+    bool set_mode;
+  };
+
+  // open directories and deferred metadata of each thread, no locking needed
+  std::vector<thread_state*> states;
+  const bool defer_files;
+  const bool is_root;
+  mode_t mask;
+  std::string dict;
+  size_t nerrors;
+  size_t nmembers;
+
+  // fd of directory path[0..len), creating missing directories, AT_FDCWD
+  // for the empty path. Returns false and sets errno on failure.
+  bool get_dir(thread_state &state, const char *path, size_t len, int *dirfd);
+  void apply(thread_state &state, const metadata &meta);
+  void error(const char *fn, const std::string &member, const char *what);
+  void stream_error(const char *fn, size_t off, const char *what);
+
+  // no copies, we own the file descriptors
+  extractor(const extractor&);
+  extractor &operator=(const extractor&);
+};
+
+#endif // EXTRACTOR_HH_
@@ -0,0 +1,114 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+
+# this script generates reproducible synthetic directory trees for
+# benchmarking. The same shape, scale and seed always produce the same tree.
+#
+# shapes:
+#   tiny   100000*SCALE files of 0 to 4 KiB, 1000 per directory
+#   huge   4 files of 256*SCALE MiB of incompressible data
+#   deep   20*SCALE chains of 32 nested directories with 8 small files each
+#   mixed  200*SCALE files of 4 KiB to 16 MiB, one third each text,
+#          random and zeros
+
+if(scalar @ARGV < 2 || scalar @ARGV > 4) {
+  print STDERR "usage: gendata.pl tiny|huge|deep|mixed DIR [SCALE] [SEED]\n";
+  exit 1;
+}
+
+my ($shape, $dir, $scale, $seed) = @ARGV;
+$scale = 1 unless defined($scale);
+$seed = 42 unless defined($seed);
+srand($seed);
+
+my @words = qw(lorem ipsum dolor sit amet consectetur adipiscing elit sed do
+               eiusmod tempor incididunt ut labore et dolore magna aliqua
+               config value true false null timestamp error warning info
+               debug request response status user id name path size);
+
+# 1 MiB of random data, reused so that large files are cheap to write but
+# still do not compress
+my $random = join('', map { chr(int(rand(256))) } 1..(1<<20));
+
+sub text {
+  my ($sz) = @_;
+  my $out = '';
+  while(length($out) < $sz) {
+    $out .= $words[int(rand(scalar @words))] . (rand() < 0.1 ? "\n" : " ");
+  }
+  return substr($out, 0, $sz);
+}
+
+sub write_file {
+  my ($fn, $sz, $kind) = @_;
+  open(my $fh, ">", $fn) or die "$fn: $!";
+  binmode($fh);
+  my $left = $sz;
+  my $chunk = 0;
+  while($left > 0) {
+    my $n = $left < (1<<20) ? $left : (1<<20);
+    if($kind eq "text") {
+      print $fh text($n);
+    } elsif($kind eq "zeros") {
+      print $fh "\0" x $n;
+    } else {
+      # rotate the buffer so that consecutive chunks differ
+      my $off = ($chunk * 4099) % (1<<20);
+      my $buf = substr($random, $off) . substr($random, 0, $off);
+      print $fh substr($buf, 0, $n);
+    }
+    $left -= $n;
+    $chunk++;
+  }
+  close($fh) or die "$fn: $!";
+}
+
+sub make_dir {
+  my ($d) = @_;
+  return if -d $d;
+  mkdir($d) or die "$d: $!";
+}
+
+make_dir($dir);
+if($shape eq "tiny") {
+  my $n = int(100000*$scale);
+  for(my $i = 0 ; $i < $n ; $i++) {
+    my $sub = sprintf("%s/d%05d", $dir, int($i/1000));
+    make_dir($sub) if $i % 1000 == 0;
+    write_file(sprintf("%s/f%07d.txt", $sub, $i), int(rand(4097)), "text");
+  }
+} elsif($shape eq "huge") {
+  for(my $i = 0 ; $i < 4 ; $i++) {
+    write_file(sprintf("%s/huge%d.bin", $dir, $i), int(256*$scale*(1<<20)),
+               "random");
+  }
+} elsif($shape eq "deep") {
+  my $chains = int(20*$scale);
+  $chains = 1 if $chains < 1;
+  for(my $c = 0 ; $c < $chains ; $c++) {
+    my $path = sprintf("%s/chain%04d", $dir, $c);
+    for(my $level = 0 ; $level < 32 ; $level++) {
+      make_dir($path);
+      for(my $f = 0 ; $f < 8 ; $f++) {
+        write_file("$path/file$f", int(rand(8193)), "text");
+      }
+      $path .= sprintf("/level%02d", $level);
+    }
+  }
+} elsif($shape eq "mixed") {
+  my $n = int(200*$scale);
+  my @kinds = ("text", "random", "zeros");
+  for(my $i = 0 ; $i < $n ; $i++) {
+    my $sub = sprintf("%s/m%03d", $dir, int($i/20));
+    make_dir($sub) if $i % 20 == 0;
+    # log uniform between 4 KiB and 16 MiB
+    my $sz = int(4096 * 2**(rand(12)));
+    my $kind = $kinds[$i % 3];
+    write_file(sprintf("%s/%s%06d", $sub, $kind, $i), $sz, $kind);
+  }
+} else {
+  print STDERR "unknown shape '$shape'\n";
+  exit 1;
+}
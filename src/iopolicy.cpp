@@ -0,0 +1,120 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "iopolicy.hh"
+
+#include <fcntl.h>
+
+// the amount of data read ahead and written back at a time
+#define IO_WINDOW_SIZE (8ul*1024ul*1024ul)
+
+readhints::readhints(const int fd_, const size_t off, const size_t size) :
+  fd(fd_), end(off+size), dropped(off),
+  ahead(size > IO_WINDOW_SIZE ? off : off+size)
+{
+  // small files are read by the kernel's own read ahead in one go
+  if(ahead < end) {
+    posix_fadvise(fd, off_t(off), off_t(size), POSIX_FADV_SEQUENTIAL);
+    read_to(off);
+  }
+}
+
+void readhints::read_to(const size_t pos)
+{
+  if(ahead >= end || pos + IO_WINDOW_SIZE <= ahead)
+    return;
+  // keep one window ahead of the reader, and drop what it is done with
+  const size_t next = pos + 2*IO_WINDOW_SIZE < end ? pos + 2*IO_WINDOW_SIZE :
+                                                     end;
+  posix_fadvise(fd, off_t(ahead), off_t(next - ahead), POSIX_FADV_WILLNEED);
+  ahead = next;
+  if(pos > dropped) {
+    posix_fadvise(fd, off_t(dropped), off_t(pos - dropped),
+                  POSIX_FADV_DONTNEED);
+    dropped = pos;
+  }
+}
+
+void readhints::done()
+{
+  if(end > dropped)
+    posix_fadvise(fd, off_t(dropped), off_t(end - dropped),
+                  POSIX_FADV_DONTNEED);
+  dropped = end;
+}
+
+writeback::writeback(const int fd_, const size_t off, FILE *fh_) :
+  fd(fd_), fh(fh_), end(off), submitted(off), dropped(off)
+{
+}
+
+void writeback::written_to(const size_t pos)
+{
+  end = pos;
+  if(end < submitted + IO_WINDOW_SIZE)
+    return;
+  if(fh != NULL)
+    fflush(fh);
+  sync_file_range(fd, off_t(submitted), off_t(end - submitted),
+                  SYNC_FILE_RANGE_WRITE);
+  // the window before is most likely on disk by now, clean pages can be
+  // dropped
+  if(submitted > dropped) {
+    sync_file_range(fd, off_t(dropped), off_t(submitted - dropped),
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, off_t(dropped), off_t(submitted - dropped),
+                  POSIX_FADV_DONTNEED);
+  }
+  dropped = submitted;
+  submitted = end;
+}
+
+void writeback::moved_to(const size_t off)
+{
+  // waiting for every small file would make writing them synchronous, the
+  // kernel writes them back on its own
+  if(submitted > dropped || end >= dropped + IO_WINDOW_SIZE) {
+    if(fh != NULL)
+      fflush(fh);
+    sync_file_range(fd, off_t(dropped), off_t(end - dropped),
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(fd, off_t(dropped), off_t(end - dropped),
+                  POSIX_FADV_DONTNEED);
+  }
+  end = off;
+  submitted = off;
+  dropped = off;
+}
@@ -0,0 +1,96 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef IO_POLICY_HH_
+#define IO_POLICY_HH_
+
+#include <stddef.h>
+#include <stdio.h>
+
+// page cache hints for data that is read or written once
+// Every file ptgz and mpitar archive or extract passes through the page cache
+// exactly once. Left alone the kernel keeps all of it cached, evicting the
+// working set of everyone else on the node, and lets dirty pages pile up
+// until they are written back in bursts. These classes tell the kernel what
+// will be read next, start writing back output as it is produced and drop
+// data from the cache once it has been read or written. Both work in windows
+// of a few MiB and cost no system calls for files smaller than a window other
+// than dropping them when done. Hints that are not supported, e.g. by some
+// network file systems, are ignored.
+
+// reads of [off, off+size) of fd, in order
+class readhints
+{
+  public:
+  readhints(const int fd_, const size_t off, const size_t size);
+  ~readhints() {};
+
+  // everything before pos has been read, asks for the next window
+  void read_to(const size_t pos);
+  // drops everything read from the page cache
+  void done();
+
+  private:
+  const int fd;
+  const size_t end;
+  size_t dropped;
+  size_t ahead;
+};
+
+// writes to fd from off on, in order
+// When fh is given it is the stdio stream writing to fd and is flushed before
+// its data is written back.
+class writeback
+{
+  public:
+  writeback(const int fd_, const size_t off, FILE *fh_ = NULL);
+  ~writeback() {};
+
+  // everything before pos has been written, starts writing back the last
+  // window and waits for the one before it, which is then dropped
+  void written_to(const size_t pos);
+  // waits for everything written after the last call to done() or moved_to()
+  // and drops it, unless it is less than a window, then continues at off
+  void moved_to(const size_t off);
+  void done() { moved_to(end); }
+
+  private:
+  const int fd;
+  FILE *fh;
+  size_t end;
+  size_t submitted;
+  size_t dropped;
+};
+
+#endif // IO_POLICY_HH_
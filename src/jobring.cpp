@@ -0,0 +1,146 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "jobring.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// number of records that can be in the ring at once
+#define JOB_RING_SLOTS 1024
+
+// processes of one host see the same memory, so the counters are updated
+// with the compiler's atomics directly rather than through MPI calls
+struct jobring::header {
+  uint64_t head;    // records put
+  uint64_t next;    // records taken
+  uint64_t closed;
+  uint64_t count;
+  slot slots[JOB_RING_SLOTS];
+};
+
+jobring::jobring(MPI_Comm comm, const size_t capacity_) :
+  capacity(capacity_), hdr(NULL), data(NULL), tail(0), data_head(0),
+  data_tail(0)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  // only rank 0 allocates, everyone else uses its memory
+  char *base;
+  const int ierr = MPI_Win_allocate_shared(
+    MPI_Aint(rank == 0 ? sizeof(header) + capacity : 0), 1, MPI_INFO_NULL,
+    comm, &base, &win);
+  if(ierr != MPI_SUCCESS) {
+    fprintf(stderr, "Could not create job ring window: %d\n", ierr);
+    exit(1);
+  }
+  MPI_Aint size;
+  int disp_unit;
+  MPI_Win_shared_query(win, 0, &size, &disp_unit, &base);
+  hdr = reinterpret_cast<header*>(base);
+  data = base + sizeof(header);
+  if(rank == 0)
+    memset(hdr, 0, sizeof(header));
+  MPI_Barrier(comm);
+}
+
+jobring::~jobring()
+{
+  MPI_Win_free(&win);
+}
+
+bool jobring::put(const std::string &rec)
+{
+  const uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+  // free the records that have been copied out, oldest first
+  while(tail < head &&
+        __atomic_load_n(&hdr->slots[tail % JOB_RING_SLOTS].copied,
+                        __ATOMIC_ACQUIRE)) {
+    const slot &s = hdr->slots[tail % JOB_RING_SLOTS];
+    data_tail = s.off + s.len;
+    tail++;
+  }
+  if(head - tail >= JOB_RING_SLOTS || !fits(rec.size()))
+    return false;
+  // records are never split, one that does not fit before the end of the
+  // buffer starts over at its beginning
+  uint64_t off = data_head;
+  if(off % capacity + rec.size() > capacity)
+    off += capacity - off % capacity;
+  if(off + rec.size() - data_tail > capacity)
+    return false;
+  memcpy(data + off % capacity, rec.data(), rec.size());
+  slot &s = hdr->slots[head % JOB_RING_SLOTS];
+  s.off = off;
+  s.len = rec.size();
+  s.copied = 0;
+  data_head = off + rec.size();
+  __atomic_store_n(&hdr->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void jobring::close()
+{
+  __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+}
+
+int jobring::take(std::string *rec)
+{
+  uint64_t next = __atomic_load_n(&hdr->next, __ATOMIC_RELAXED);
+  for(;;) {
+    // closed is read first, a record put before closing is then seen as well
+    const uint64_t closed = __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+    const uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    if(next >= head)
+      return closed ? -1 : 0;
+    if(__atomic_compare_exchange_n(&hdr->next, &next, next + 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      break;
+  }
+  slot &s = hdr->slots[next % JOB_RING_SLOTS];
+  rec->assign(data + s.off % capacity, s.len);
+  __atomic_store_n(&s.copied, 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+void jobring::add_count(const uint64_t n)
+{
+  __atomic_fetch_add(&hdr->count, n, __ATOMIC_RELAXED);
+}
+
+uint64_t jobring::take_count()
+{
+  return __atomic_exchange_n(&hdr->count, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,95 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef JOB_RING_HH_
+#define JOB_RING_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <mpi.h>
+
+// queue of serialized jobs shared by the ranks of one host
+// Rank 0 of the communicator puts records into a ring buffer in a shared
+// memory window and every rank, including rank 0, takes them, so ranks never
+// wait for the one that feeds them to answer a message. Records are claimed
+// with atomic operations on the shared memory, the space they take is reused
+// once their taker has copied them out. The ranks also share a byte counter
+// for reporting progress.
+// Construction and destruction are collective, all ranks of the communicator
+// must be on the same host, e.g. from MPI_Comm_split_type(MPI_COMM_TYPE_SHARED).
+class jobring
+{
+  public:
+  jobring(MPI_Comm comm, const size_t capacity_);
+  ~jobring();
+
+  // rank 0 only: appends a record, false if there is no room for it now
+  bool put(const std::string &rec);
+  // whether a record of size bytes can ever be put
+  bool fits(const size_t size) const { return size <= capacity; }
+  // rank 0 only: no more records will be put
+  void close();
+
+  // takes the next record, 1 if one was taken, 0 if there is none right now
+  // and -1 once the ring is closed and empty
+  int take(std::string *rec);
+
+  // adds to and takes everything from the shared counter
+  void add_count(const uint64_t n);
+  uint64_t take_count();
+
+  private:
+  struct slot {
+    uint64_t off;
+    uint64_t len;
+    uint64_t copied;
+  };
+  struct header;
+
+  const size_t capacity;
+  MPI_Win win;
+  header *hdr;
+  char *data;
+  // the producer's view of the data still in use
+  uint64_t tail, data_head, data_tail;
+
+  // no copies, we own the window
+  jobring(const jobring&);
+  jobring &operator=(const jobring&);
+};
+
+#endif // JOB_RING_HH_
@@ -0,0 +1,426 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "memberindex.hh"
+#include "tarentry.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+
+#define TAIL_SIZE (2*PATH_MAX + 4*BLOCKSIZE)
+
+namespace {
+// bytewise comparison of two paths of possibly different length
+int compare_paths(const char *a, const size_t alen,
+                  const char *b, const size_t blen)
+{
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  if(c != 0)
+    return c;
+  return alen < blen ? -1 : (alen > blen ? 1 : 0);
+}
+
+struct entry_less {
+  entry_less(const char *strings_) : strings(strings_) {};
+  bool operator()(const memberindex_entry &a,
+                  const memberindex_entry &b) const {
+    return compare_paths(strings + a.path_off, a.path_len,
+                         strings + b.path_off, b.path_len) < 0;
+  }
+  const char *strings;
+};
+
+// whether a table of count elements of size sz at off lies within avail bytes
+bool fits(const uint64_t off, const uint64_t count, const size_t sz,
+          const size_t avail)
+{
+  return off <= avail && count <= (avail - off) / sz;
+}
+
+void write_all(FILE *fh, const char *fn, const void *buf, const size_t sz)
+{
+  if(sz > 0 && fwrite(buf, 1, sz, fh) != sz) {
+    fprintf(stderr, "Could not write %zu bytes to '%s': %s\n", sz, fn,
+            strerror(errno));
+    exit(1);
+  }
+}
+
+// returns the offset and name of the last line of the text in buf
+bool last_index_line(const char *buf, size_t sz, size_t *off, std::string *fn)
+{
+  while(sz > 0 && (buf[sz-1] == '\0' || buf[sz-1] == '\n'))
+    sz--;
+  size_t start = sz;
+  while(start > 0 && buf[start-1] != '\n')
+    start--;
+  const std::string line(buf+start, sz-start);
+  char *end;
+  *off = size_t(strtoull(line.c_str(), &end, 10));
+  if(end == line.c_str() || *end != ' ')
+    return false;
+  *fn = end+1;
+  return true;
+}
+
+// data of the text index mpitar stores as the last member of a tar file,
+// exits if there is none
+void text_index_data(int fd, const char *fn, size_t *data_off,
+                     size_t *data_sz)
+{
+  struct stat statbuf;
+  if(fstat(fd, &statbuf) != 0) {
+    fprintf(stderr, "Could not stat '%s': %s\n", fn, strerror(errno));
+    exit(1);
+  }
+  const size_t tar_sz = size_t(statbuf.st_size);
+  std::vector<char> tail(std::min(tar_sz, size_t(TAIL_SIZE)));
+  pread_all(fd, fn, &tail[0], tail.size(), tar_sz - tail.size());
+  size_t idx_off;
+  std::string idx_fn;
+  if(!last_index_line(&tail[0], tail.size(), &idx_off, &idx_fn)) {
+    fprintf(stderr, "Could not find the index at the end of '%s'\n", fn);
+    exit(1);
+  }
+  tar_member_data(fd, fn, idx_off, data_off, data_sz);
+}
+}
+
+void memberindex_writer::add(const std::string &path, const uint32_t block,
+                             const uint64_t offset, const uint64_t size,
+                             const uint64_t tarsize, const uint32_t mode,
+                             const int64_t mtime)
+{
+  memberindex_entry ent;
+  memset(&ent, 0, sizeof(ent));
+  ent.path_off = strings.size();
+  ent.path_len = uint32_t(path.size());
+  ent.block = block;
+  ent.offset = offset;
+  ent.size = size;
+  ent.tarsize = tarsize;
+  ent.mode = mode;
+  ent.mtime = mtime;
+  entries.push_back(ent);
+  strings += path;
+
+  if(block != MEMBERINDEX_NO_BLOCK) {
+    if(block >= blocks.size())
+      blocks.resize(size_t(block) + 1);
+    blocks[block].rawsize += tarsize;
+    blocks[block].count += 1;
+  }
+}
+
+void memberindex_writer::write(const char *fn)
+{
+  std::sort(entries.begin(), entries.end(), entry_less(strings.data()));
+
+  memberindex_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, MEMBERINDEX_MAGIC, sizeof(MEMBERINDEX_MAGIC));
+  hdr.version = MEMBERINDEX_VERSION;
+  hdr.entry_size = uint32_t(sizeof(memberindex_entry));
+  hdr.count = entries.size();
+  hdr.nblocks = blocks.size();
+  hdr.entries_off = sizeof(hdr);
+  hdr.blocks_off = hdr.entries_off + hdr.count*sizeof(memberindex_entry);
+  hdr.strings_off = hdr.blocks_off + hdr.nblocks*sizeof(memberindex_block);
+  hdr.strings_size = strings.size();
+
+  FILE *fh = fopen(fn, "wb");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", fn,
+            strerror(errno));
+    exit(1);
+  }
+  write_all(fh, fn, &hdr, sizeof(hdr));
+  write_all(fh, fn, entries.data(), entries.size()*sizeof(entries[0]));
+  write_all(fh, fn, blocks.data(), blocks.size()*sizeof(blocks[0]));
+  write_all(fh, fn, strings.data(), strings.size());
+  if(fclose(fh) != 0) {
+    fprintf(stderr, "Could not write to '%s': %s\n", fn, strerror(errno));
+    exit(1);
+  }
+}
+
+memberindex_stream::memberindex_stream(const char *fn_, const uint64_t count,
+                                       const size_t nblocks) :
+  fn(fn_), entries_fh(NULL), strings_fh(NULL), added(0), blocks(nblocks)
+{
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, MEMBERINDEX_MAGIC, sizeof(MEMBERINDEX_MAGIC));
+  hdr.version = MEMBERINDEX_VERSION;
+  hdr.entry_size = uint32_t(sizeof(memberindex_entry));
+  hdr.count = count;
+  hdr.nblocks = nblocks;
+  hdr.entries_off = sizeof(hdr);
+  hdr.blocks_off = hdr.entries_off + hdr.count*sizeof(memberindex_entry);
+  hdr.strings_off = hdr.blocks_off + hdr.nblocks*sizeof(memberindex_block);
+
+  // one handle fills the tables from the front, the other the string pool
+  // behind them, so both are written sequentially
+  entries_fh = fopen(fn.c_str(), "wb");
+  if(entries_fh != NULL)
+    strings_fh = fopen(fn.c_str(), "r+b");
+  if(strings_fh == NULL ||
+     fseeko(entries_fh, off_t(hdr.entries_off), SEEK_SET) != 0 ||
+     fseeko(strings_fh, off_t(hdr.strings_off), SEEK_SET) != 0) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+}
+
+memberindex_stream::~memberindex_stream()
+{
+  if(entries_fh)
+    fclose(entries_fh);
+  if(strings_fh)
+    fclose(strings_fh);
+}
+
+void memberindex_stream::add(const std::string &path, const uint32_t block,
+                             const uint64_t offset, const uint64_t size,
+                             const uint64_t tarsize, const uint32_t mode,
+                             const int64_t mtime)
+{
+  if(added == hdr.count) {
+    fprintf(stderr, "Too many entries for the index '%s'\n", fn.c_str());
+    exit(1);
+  }
+  // lookups binary search on this order
+  if(added > 0 && compare_paths(prev.data(), prev.size(), path.data(),
+                                path.size()) >= 0) {
+    fprintf(stderr, "Entry '%s' is out of order in the index '%s'\n",
+            path.c_str(), fn.c_str());
+    exit(1);
+  }
+  prev = path;
+  memberindex_entry ent;
+  memset(&ent, 0, sizeof(ent));
+  ent.path_off = hdr.strings_size;
+  ent.path_len = uint32_t(path.size());
+  ent.block = block;
+  ent.offset = offset;
+  ent.size = size;
+  ent.tarsize = tarsize;
+  ent.mode = mode;
+  ent.mtime = mtime;
+  write_all(entries_fh, fn.c_str(), &ent, sizeof(ent));
+  write_all(strings_fh, fn.c_str(), path.data(), path.size());
+  hdr.strings_size += path.size();
+  added++;
+
+  if(block < blocks.size()) {
+    blocks[block].rawsize += tarsize;
+    blocks[block].count += 1;
+  }
+}
+
+void memberindex_stream::finish()
+{
+  if(added != hdr.count) {
+    fprintf(stderr, "Missing entries in the index '%s'\n", fn.c_str());
+    exit(1);
+  }
+  // the entries end where the block table starts
+  write_all(entries_fh, fn.c_str(), blocks.data(),
+            blocks.size()*sizeof(blocks[0]));
+  if(fseeko(entries_fh, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Could not seek in '%s': %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  write_all(entries_fh, fn.c_str(), &hdr, sizeof(hdr));
+  const int err1 = fclose(entries_fh);
+  const int err2 = fclose(strings_fh);
+  entries_fh = NULL;
+  strings_fh = NULL;
+  if(err1 != 0 || err2 != 0) {
+    fprintf(stderr, "Could not write to '%s': %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+}
+
+bool memberindex::open(const char *fn, const size_t off)
+{
+  close();
+
+  int fd = ::open(fn, O_RDONLY);
+  if(fd < 0)
+    return false;
+  struct stat statbuf;
+  if(fstat(fd, &statbuf) != 0) {
+    int err = errno;
+    ::close(fd);
+    errno = err;
+    return false;
+  }
+  if(size_t(statbuf.st_size) < off + sizeof(memberindex_header)) {
+    ::close(fd);
+    errno = EINVAL;
+    return false;
+  }
+
+  // mmap needs a page aligned offset
+  const size_t pagesize = size_t(sysconf(_SC_PAGESIZE));
+  const size_t mapoff = off & ~(pagesize-1);
+  mapsize = size_t(statbuf.st_size) - mapoff;
+  base = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, off_t(mapoff));
+  int err = errno;
+  ::close(fd);
+  if(base == MAP_FAILED) {
+    base = NULL;
+    mapsize = 0;
+    errno = err;
+    return false;
+  }
+
+  const char *start = static_cast<const char*>(base) + (off - mapoff);
+  const size_t avail = mapsize - (off - mapoff);
+  hdr = reinterpret_cast<const memberindex_header*>(start);
+  if(memcmp(hdr->magic, MEMBERINDEX_MAGIC, sizeof(MEMBERINDEX_MAGIC)) != 0 ||
+     hdr->version != MEMBERINDEX_VERSION ||
+     hdr->entry_size != sizeof(memberindex_entry) ||
+     !fits(hdr->entries_off, hdr->count, sizeof(memberindex_entry), avail) ||
+     !fits(hdr->blocks_off, hdr->nblocks, sizeof(memberindex_block), avail) ||
+     !fits(hdr->strings_off, hdr->strings_size, 1, avail)) {
+    close();
+    errno = EINVAL;
+    return false;
+  }
+  entries = reinterpret_cast<const memberindex_entry*>(start + hdr->entries_off);
+  blocks = reinterpret_cast<const memberindex_block*>(start + hdr->blocks_off);
+  strings = start + hdr->strings_off;
+
+  return true;
+}
+
+void memberindex::close()
+{
+  if(base)
+    munmap(base, mapsize);
+  base = NULL;
+  mapsize = 0;
+  hdr = NULL;
+  entries = NULL;
+  blocks = NULL;
+  strings = NULL;
+}
+
+const memberindex_entry *memberindex::find(const char *path,
+                                           const size_t len) const
+{
+  size_t lo = 0, hi = count();
+  while(lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const memberindex_entry &ent = entries[mid];
+    // paths are only checked when probed, which keeps open() and lookups
+    // from touching more than O(log n) entries
+    if(!in_pool(ent)) {
+      errno = EINVAL;
+      return NULL;
+    }
+    int c = compare_paths(strings + ent.path_off, ent.path_len, path, len);
+    if(c == 0)
+      return &ent;
+    if(c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+bool memberindex::find_in_tar(int fd, const char *fn, size_t *off)
+{
+  size_t data_off, data_sz;
+  text_index_data(fd, fn, &data_off, &data_sz);
+
+  // the index lists the binary index just before itself
+  std::vector<char> tail(std::min(data_sz, size_t(TAIL_SIZE)));
+  pread_all(fd, fn, &tail[0], tail.size(), data_off + data_sz - tail.size());
+  size_t sz = tail.size();
+  while(sz > 0 && tail[sz-1] == '\n')
+    sz--;
+  while(sz > 0 && tail[sz-1] != '\n')
+    sz--;
+  size_t bidx_off;
+  std::string bidx_fn;
+  if(!last_index_line(&tail[0], sz, &bidx_off, &bidx_fn) ||
+     bidx_fn.size() < 5 || bidx_fn.compare(bidx_fn.size()-5, 5, ".bidx"))
+    return false;
+  tar_member_data(fd, fn, bidx_off, &data_off, &data_sz);
+  *off = data_off;
+  return true;
+}
+
+void memberindex::text_in_tar(int fd, const char *fn,
+                              std::unordered_map<std::string, size_t> *offsets)
+{
+  size_t data_off, data_sz;
+  text_index_data(fd, fn, &data_off, &data_sz);
+  std::vector<char> text(data_sz);
+  pread_all(fd, fn, text.data(), text.size(), data_off);
+
+  offsets->clear();
+  for(size_t start = 0, end = 0 ; start < text.size() ; start = end + 1) {
+    end = start;
+    while(end < text.size() && text[end] != '\n')
+      end++;
+    if(end == start)
+      continue;
+    const std::string line(&text[start], end - start);
+    char *name;
+    const size_t off = size_t(strtoull(line.c_str(), &name, 10));
+    if(name == line.c_str() || *name != ' ') {
+      fprintf(stderr, "Invalid line '%s' in the index of '%s'\n",
+              line.c_str(), fn);
+      exit(1);
+    }
+    (*offsets)[name+1] = off;
+  }
+}
@@ -0,0 +1,203 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef MEMBER_INDEX_HH_
+#define MEMBER_INDEX_HH_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// binary index of the members of an archive
+// The file is meant to be mmap'ed and used in place. All integers are in
+// native byte order. Layout:
+//   memberindex_header
+//   memberindex_entry[count]    sorted by path (bytewise)
+//   memberindex_block[nblocks]  per block totals, empty for plain tar files
+//   string pool                 paths, not NUL terminated
+// A lookup is a binary search over the entry table which touches O(log n)
+// entries and pool pages and allocates no memory.
+
+#define MEMBERINDEX_MAGIC "PTGZBIX"
+#define MEMBERINDEX_VERSION 1
+#define MEMBERINDEX_NO_BLOCK 0xffffffffu
+
+struct memberindex_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;    // sizeof(memberindex_entry) of the writer
+  uint64_t count;
+  uint64_t nblocks;
+  uint64_t entries_off;
+  uint64_t blocks_off;
+  uint64_t strings_off;
+  uint64_t strings_size;
+};
+
+struct memberindex_entry {
+  uint64_t path_off;      // into the string pool
+  uint64_t offset;        // of the member's first header in its block
+  uint64_t size;          // of the file content
+  uint64_t tarsize;       // of the member including headers and padding
+  int64_t mtime;
+  uint32_t path_len;
+  uint32_t block;         // MEMBERINDEX_NO_BLOCK for plain tar files
+  uint32_t mode;          // st_mode including the file type bits
+  uint32_t pad;
+};
+
+struct memberindex_block {
+  uint64_t rawsize;       // uncompressed tar size of the block
+  uint64_t count;         // number of members in the block
+};
+
+class memberindex_writer
+{
+  public:
+  memberindex_writer(const size_t nblocks_ = 0) : blocks(nblocks_) {};
+  ~memberindex_writer() {};
+
+  // not thread safe, callers need to serialize calls
+  void add(const std::string &path, const uint32_t block,
+           const uint64_t offset, const uint64_t size, const uint64_t tarsize,
+           const uint32_t mode, const int64_t mtime);
+  // sorts the entries and writes the index file, exits on error
+  void write(const char *fn);
+
+  size_t count() const { return entries.size(); }
+
+  private:
+  std::vector<memberindex_entry> entries;
+  std::vector<memberindex_block> blocks;
+  std::string strings;
+};
+
+// writes an index whose entries arrive sorted by path straight to disk, so
+// that only the block table is kept in memory. The number of entries has to
+// be known up front, it places the string pool behind the tables.
+class memberindex_stream
+{
+  public:
+  // opens fn for an index of count entries in nblocks blocks, exits on error
+  memberindex_stream(const char *fn, const uint64_t count,
+                     const size_t nblocks);
+  ~memberindex_stream();
+
+  // like memberindex_writer::add(), but paths have to be added in strictly
+  // increasing bytewise order. Not thread safe, exits on error or if they
+  // are not.
+  void add(const std::string &path, const uint32_t block,
+           const uint64_t offset, const uint64_t size, const uint64_t tarsize,
+           const uint32_t mode, const int64_t mtime);
+  // writes the block table and the header and closes the file
+  void finish();
+
+  private:
+  std::string fn;
+  FILE *entries_fh;
+  FILE *strings_fh;
+  memberindex_header hdr;
+  uint64_t added;
+  // path of the last entry, to check the order
+  std::string prev;
+  std::vector<memberindex_block> blocks;
+
+  // no copies, we own the file handles
+  memberindex_stream(const memberindex_stream&);
+  memberindex_stream &operator=(const memberindex_stream&);
+};
+
+class memberindex
+{
+  public:
+  memberindex() : base(NULL), mapsize(0), hdr(NULL), entries(NULL),
+                  blocks(NULL), strings(NULL) {};
+  ~memberindex() { close(); };
+
+  // map the index stored in fn starting at byte off, which need not be page
+  // aligned so that an index stored inside of a tar file can be used in
+  // place. Returns false and sets errno on failure.
+  bool open(const char *fn, const size_t off = 0);
+  void close();
+  // offset of the binary index mpitar stores in front of the text index at
+  // the end of a tar file, to be passed to open(). Returns false if the text
+  // index lists none, as in tar files made before it existed, and exits if
+  // there is no text index either.
+  static bool find_in_tar(int fd, const char *fn, size_t *off);
+  // header offsets of the members listed in the text index at the end of a
+  // tar file by name, for tar files without a binary index, exits if there
+  // is no text index
+  static void text_in_tar(int fd, const char *fn,
+                          std::unordered_map<std::string, size_t> *offsets);
+
+  // binary search for a member, NULL if not found or if a probed entry
+  // points outside the string pool, which sets errno to EINVAL
+  const memberindex_entry *find(const char *path, const size_t len) const;
+  const memberindex_entry *find(const std::string &path) const {
+    return find(path.data(), path.size());
+  }
+
+  // accessors
+  size_t count() const { return hdr ? size_t(hdr->count) : 0; }
+  size_t nblocks() const { return hdr ? size_t(hdr->nblocks) : 0; }
+  const memberindex_entry &entry(const size_t i) const { return entries[i]; }
+  const memberindex_block &block(const size_t i) const { return blocks[i]; }
+  // NULL if the path of ent lies outside the string pool
+  const char *path(const memberindex_entry &ent) const {
+    return in_pool(ent) ? strings + ent.path_off : NULL;
+  }
+
+  private:
+  void *base;
+  size_t mapsize;
+  const memberindex_header *hdr;
+  const memberindex_entry *entries;
+  const memberindex_block *blocks;
+  const char *strings;
+
+  bool in_pool(const memberindex_entry &ent) const {
+    return ent.path_off <= hdr->strings_size &&
+           ent.path_len <= hdr->strings_size - ent.path_off;
+  }
+
+  // no copies, we own the mapping
+  memberindex(const memberindex&);
+  memberindex &operator=(const memberindex&);
+};
+
+#endif // MEMBER_INDEX_HH_
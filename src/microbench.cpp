@@ -0,0 +1,311 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+// microbenchmarks for the per file code paths of mpitar
+// Each case reports the time and the number of heap allocations per operation.
+// Output is one line per case, which can be saved and passed back with -b to
+// print the relative change against that baseline:
+//   microbench >before.txt
+//   ... change code ...
+//   microbench -b before.txt
+// At 100M files every 10ns/op are one second of CPU time.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "tarentry.hh"
+#include "fileentry.hh"
+
+// count every heap allocation made by the process
+static size_t allocations = 0;
+
+void *operator new(size_t sz)
+{
+  allocations++;
+  void *p = malloc(sz ? sz : 1);
+  if(!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t sz)
+{
+  return operator new(sz);
+}
+
+void operator delete(void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+  free(p);
+}
+
+namespace {
+// results of the previous calls to report(), keyed by name
+std::map<std::string, double> baseline;
+// keeps the compiler from optimizing away the benchmarked calls
+volatile size_t sink;
+
+double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return double(ts.tv_sec) + 1e-9*double(ts.tv_nsec);
+}
+
+void usage(const char *cmd)
+{
+  fprintf(stderr, "usage: %s [-n ITERATIONS] [-f FILES] [-b BASELINE]\n", cmd);
+  fprintf(stderr, "  -n  iterations of the in memory cases (default 200000)\n");
+  fprintf(stderr, "  -f  files in the list and tree cases (default 20000)\n");
+  fprintf(stderr, "  -b  output of an earlier run to compare to\n");
+}
+
+void read_baseline(const char *fn)
+{
+  FILE *fh = fopen(fn, "r");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", fn,
+            strerror(errno));
+    exit(1);
+  }
+  char name[256];
+  double ns, allocs;
+  while(fscanf(fh, "%255s ns/op=%lf allocs/op=%lf%*[^\n]", name, &ns,
+               &allocs) == 3) {
+    baseline[name] = ns;
+  }
+  fclose(fh);
+}
+
+void report(const char *name, double elapsed, size_t allocs, size_t ops)
+{
+  const double ns = 1e9 * elapsed / double(ops);
+  printf("%-28s ns/op=%.1f allocs/op=%.2f", name, ns,
+         double(allocs) / double(ops));
+  std::map<std::string, double>::const_iterator base = baseline.find(name);
+  if(base != baseline.end() && base->second > 0.)
+    printf(" base_ns/op=%.1f change=%+.1f%%", base->second,
+           100. * (ns - base->second) / base->second);
+  printf("\n");
+}
+
+// runs op iterations times and reports time and allocations per operation,
+// where each call of op does ops_per_call operations
+template<class OP>
+void run(const char *name, size_t iterations, OP op, size_t ops_per_call = 1)
+{
+  // warm up caches, passwd lookups and the like
+  for(size_t i = 0 ; i < iterations / 100 + 1 ; i++)
+    op();
+  const size_t allocs0 = allocations;
+  const double start = now();
+  for(size_t i = 0 ; i < iterations ; i++)
+    op();
+  const double elapsed = now() - start;
+  report(name, elapsed, allocations - allocs0, iterations * ops_per_call);
+}
+
+// a regular file entry that does not need to exist on disk
+tarentry make_entry(const std::string &fn)
+{
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  st.st_mode = S_IFREG | 0644;
+  st.st_uid = getuid();
+  st.st_gid = getgid();
+  st.st_size = 12345;
+  st.st_mtime = 1500000000;
+  return tarentry(fn, 0, st);
+}
+
+void bench_tarentry(const char *kind, const std::string &fn, size_t iterations)
+{
+  const tarentry ent(make_entry(fn));
+  const std::string buf(ent.serialize());
+  std::string name;
+
+  name = std::string("size/") + kind;
+  run(name.c_str(), iterations, [&]() { sink = ent.size(); });
+  name = std::string("make_tar_header/") + kind;
+  run(name.c_str(), iterations, [&]() {
+    sink = ent.make_tar_header().size();
+  });
+  // a job worth of headers into one reused buffer
+  const std::vector<tarentry> job(100, ent);
+  std::vector<char> headers(tarentry::headers_size(&job[0], &job[0] + 100));
+  name = std::string("make_tar_headers/") + kind;
+  run(name.c_str(), iterations / 100 + 1, [&]() {
+    sink = tarentry::make_tar_headers(&job[0], &job[0] + 100, &headers[0]);
+  }, 100);
+  name = std::string("serialize/") + kind;
+  run(name.c_str(), iterations, [&]() { sink = ent.serialize().size(); });
+  name = std::string("deserialize/") + kind;
+  run(name.c_str(), iterations, [&]() {
+    tarentry other;
+    sink = other.deserialize(buf.data());
+  });
+}
+
+// a directory with nfiles empty files in subdirectories of 1000 files each
+// and a list of all of their names
+void make_tree(const std::string &dir, const std::string &list, size_t nfiles)
+{
+  FILE *fh = fopen(list.c_str(), "w");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", list.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  for(size_t i = 0 ; i < nfiles ; i++) {
+    char sub[PATH_MAX], fn[PATH_MAX+32];
+    snprintf(sub, sizeof(sub), "%s/d%05zu", dir.c_str(), i / 1000);
+    snprintf(fn, sizeof(fn), "%s/f%07zu", sub, i);
+    if(i % 1000 == 0 && mkdir(sub, 0755) != 0) {
+      fprintf(stderr, "Could not create '%s': %s\n", sub, strerror(errno));
+      exit(1);
+    }
+    FILE *f = fopen(fn, "w");
+    if(f == NULL) {
+      fprintf(stderr, "Could not create '%s': %s\n", fn, strerror(errno));
+      exit(1);
+    }
+    fclose(f);
+    fprintf(fh, "%s\n", fn);
+  }
+  fclose(fh);
+}
+
+// times one full pass over all names returned by a fileentry
+template<class ENTRY>
+void bench_nextfile(const char *name, const std::string &arg)
+{
+  // first pass brings the directory entries into the page cache
+  for(int pass = 0 ; pass < 2 ; pass++) {
+    ENTRY entry(arg);
+    const size_t allocs0 = allocations;
+    const double start = now();
+    size_t count = 0;
+    while(!entry.nextfile().empty())
+      count++;
+    const double elapsed = now() - start;
+    if(pass == 1)
+      report(name, elapsed, allocations - allocs0, count);
+  }
+}
+}
+
+int main(int argc, char **argv)
+{
+  size_t iterations = 200000;
+  size_t nfiles = 20000;
+  int opt;
+  while((opt = getopt(argc, argv, "n:f:b:h")) != -1) {
+    switch(opt) {
+      case 'n':
+        iterations = size_t(atol(optarg));
+        break;
+      case 'f':
+        nfiles = size_t(atol(optarg));
+        break;
+      case 'b':
+        read_baseline(optarg);
+        break;
+      case 'h':
+        usage(argv[0]);
+        return 0;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if(optind != argc || iterations == 0 || nfiles == 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // a typical name and one that needs a pax path record
+  bench_tarentry("short", "project/data/run0042/output.dat", iterations);
+  std::string long_fn("project");
+  while(long_fn.size() < 200)
+    long_fn += "/a_rather_long_directory_name";
+  bench_tarentry("pax", long_fn + "/output.dat", iterations);
+
+  char tmpdir[] = "/tmp/microbench.XXXXXX";
+  if(mkdtemp(tmpdir) == NULL) {
+    fprintf(stderr, "Could not create temporary directory: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  const std::string tree = std::string(tmpdir) + "/tree";
+  const std::string list = std::string(tmpdir) + "/files.txt";
+  if(mkdir(tree.c_str(), 0755) != 0) {
+    fprintf(stderr, "Could not create '%s': %s\n", tree.c_str(),
+            strerror(errno));
+    return 1;
+  }
+  make_tree(tree, list, nfiles);
+  bench_nextfile<filelist>("filelist::nextfile", list);
+  bench_nextfile<filearg>("filearg::nextfile", tree);
+
+  const std::string cmd = std::string("rm -rf ") + tmpdir;
+  if(system(cmd.c_str()) != 0)
+    fprintf(stderr, "Could not remove '%s'\n", tmpdir);
+
+  return 0;
+}
@@ -41,8 +41,14 @@
 //   places it at the given offset
 // * the master bunches up files in lots of 100 or 1e6 bytes of data (whichever
 //   is reached first) in the jobs
-// * op to 3 jobs are send to a given client at once, clients ack jobs when
-//   they are done with it and this triggers a new job to be send to them
+// * the master only talks to one leader per host, it sends batches of one
+//   job for each worker of the host
+// * op to 3 batches are send to a given leader at once, the leader splits them
+//   into jobs and puts them into a ring in shared memory that all workers of
+//   its host, including itself, take jobs from, and acks a batch once it is in
+//   the ring, which triggers a new batch to be send to it
+// * each worker reads the files of the jobs it took in a second thread while
+//   it writes, so its input and output are busy at the same time
 // * currently it supports regular files, directories and symbolic links and
 //   the output is identical to a regular tar as long as the same file list is
 //   passed to tar's -T option
@@ -60,25 +66,34 @@
 #include <math.h>
 
 #include<mpi.h>
+#include<omp.h>
 
 #include<vector>
 #include<queue>
+#include<deque>
+#include<algorithm>
 #include<string>
 
-//#define DO_TIMING
 #include "cmdline.hh"
 #include "fileentry.hh"
 #include "timer.hh"
 #include "tarentry.hh"
+#include "memberindex.hh"
+#include "iopolicy.hh"
+#include "numaplace.hh"
+#include "jobring.hh"
+#include "prefetcher.hh"
 
 #define MAX_JOBS_IN_FLIGHT 3
 #define MAX_FILES_IN_JOB 100
 #define TARGET_JOB_SIZE (1024ul*1024ul*1024ul)
 #define COPY_BLOCK_SIZE (1024*1024*512)
 #define STREAM_BUFFER_SIZE (COPY_BLOCK_SIZE)
+#define READ_AHEAD_SIZE (COPY_BLOCK_SIZE/2) /* each of two buffers */
+#define JOB_RING_SIZE (16ul*1024ul*1024ul)
+#define RING_POLL_INTERVAL 1000 /* microseconds */
 
 
-std::vector<timer*> timer::all_timers;
 timer timer_all("all");
 timer timer_stat("stat"), timer_open("open");
 timer timer_read("read"), timer_write("write"), timer_seek("seek");
@@ -87,13 +102,15 @@ timer timer_worker_wait("worker_wait"), timer_master_wait("master_wait");
 #define DIM(v) (sizeof(v)/sizeof(v[0]))
 
 static void copy_file_content(FILE *out_fh, const char *out_fn,
-                              const tarentry &ent);
+                              writeback *wb, prefetcher *ra,
+                              const tarentry &ent, const char *hdr);
 
-static int find_unused_request(int count, MPI_Request *request);
+static std::string make_job(fileentries &entries, size_t *off, FILE *idx_fh,
+                            memberindex_writer *bidx, hardlinks *links);
 size_t show_progress(size_t total, size_t chunksize, int show_percent);
 
 void master(const char *out_fn, fileentries& entries);
-void worker(const char *out_fn);
+void worker(const char *out_fn, MPI_Comm local);
 
 int mpitar(int argc, char **argv)
 {
@@ -124,8 +141,21 @@ int mpitar(int argc, char **argv)
         }
         rc = 1;
       } else {
+        if(args.get_numa() && !numaplace::enable(MPI_COMM_WORLD) &&
+           rank == 0) {
+          fprintf(stderr, "NUMA placement is not available, ignoring -N.\n");
+        }
+        /* the workers of each host share a ring of jobs that the first of
+         * them, the leader, fills with batches from the master, so the master
+         * only talks to one rank per host */
+        MPI_Comm host, local;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                            MPI_INFO_NULL, &host);
+        MPI_Comm_split(host, rank ? 0 : MPI_UNDEFINED, rank, &local);
+        MPI_Comm_free(&host);
         if(rank) {
-          worker(args.get_tarfilename().c_str());
+          worker(args.get_tarfilename().c_str(), local);
+          MPI_Comm_free(&local);
         } else {
           master(args.get_tarfilename().c_str(), args.get_fileentries());
         }
@@ -140,9 +170,6 @@ int mpitar(int argc, char **argv)
 
   timer_all.stop(__LINE__);
 
-  if(rc == 0)
-    timer::print_timers();
-
   MPI_Barrier(MPI_COMM_WORLD);
   return rc;
 }
@@ -182,111 +209,111 @@ void master(const char *out_fn, fileentries& entries)
   }
   timer_open.stop(__LINE__);
 
+  char bidx_fn[1024];
+  size_t bidx_fn_size = snprintf(bidx_fn, sizeof(bidx_fn), "%s.bidx", out_fn);
+  assert(bidx_fn_size < sizeof(bidx_fn));
+  memberindex_writer bidx;
+  hardlinks links;
+
+  /* the leader of each host and the number of workers it feeds */
   int size;
   MPI_Comm_size(MPI_COMM_WORLD, &size);
-  std::vector<int> jobs_in_flight((size_t)size);
-  std::vector<MPI_Request> recv_requests(MAX_JOBS_IN_FLIGHT*size_t(size), MPI_REQUEST_NULL);
+  std::vector<int> host_workers((size_t)size);
+  const int no_workers = 0;
+  MPI_Gather(&no_workers, 1, MPI_INT, &host_workers[0], 1, MPI_INT, 0,
+             MPI_COMM_WORLD);
+  std::vector<int> leaders, leader_workers;
+  for(int r = 1 ; r < size ; r++) {
+    if(host_workers[r] > 0) {
+      leaders.push_back(r);
+      leader_workers.push_back(host_workers[r]);
+    }
+  }
+  const size_t nleaders = leaders.size();
+  const size_t max_host_size = size_t(*std::max_element(leader_workers.begin(),
+                                                        leader_workers.end()));
+
+  /* every host has up to MAX_JOBS_IN_FLIGHT batches at a time, each in its
+   * own slot of these */
+  std::vector<MPI_Request> recv_requests(MAX_JOBS_IN_FLIGHT*nleaders, MPI_REQUEST_NULL);
   std::vector<int> recv_completed(recv_requests.size());
+  std::vector<MPI_Status> recv_status(recv_requests.size());
   std::vector<unsigned long long int> recv_buffers(recv_requests.size());
   std::vector<MPI_Request> send_requests(recv_requests.size(), MPI_REQUEST_NULL);
   std::vector<std::string> send_buffers(recv_requests.size());
+  std::vector<int> free_slots;
+  for(int b = 0 ; b < (int)recv_requests.size() ; b++)
+    free_slots.push_back(b);
 
+  std::deque<std::string> ready;  /* jobs made ahead of time */
   size_t off = 0;
   int done = 0;
-  do {
-    for(int current_worker = 1 ; current_worker < size && !done ; current_worker++) {
-      /* process some MPI requests every once in a while to keep things going */
-
-      /* kick the send requests every once in a while in case MPI does not
-       * process them otherwise */
-      int dummy1, dummy2;
-      timer_master_wait.start(__LINE__);
-      MPI_Testany((int)send_requests.size(), &send_requests[0], &dummy1, &dummy2,
-                  MPI_STATUSES_IGNORE);
-
-      /* check for ack's of workers */
-      int count;
-      std::vector<MPI_Status> status(recv_requests.size());
-      MPI_Testsome((int)recv_requests.size(), &recv_requests[0], &count,
-                   &recv_completed[0], &status[0]);
-      timer_master_wait.stop(__LINE__);
-      for(int r = 0 ; count != MPI_UNDEFINED && r < count ; r++) {
-        int idx = recv_completed[r];
-        show_progress(off, size_t(recv_buffers[idx]), 0);
-        int w = status[r].MPI_SOURCE;
-        jobs_in_flight[w] -= 1;
-      }
-
-      /* if the curent worker is underworked, give it something to do */
-      if(jobs_in_flight[current_worker] < MAX_JOBS_IN_FLIGHT) {
-        const int buf0num = current_worker*MAX_JOBS_IN_FLIGHT;
-        int recv_id = find_unused_request(MAX_JOBS_IN_FLIGHT, &recv_requests[buf0num]);
-        assert(recv_id >= 0);
-        int send_id = find_unused_request(MAX_JOBS_IN_FLIGHT,
-                                          &send_requests[buf0num]);
-        assert(send_id >= 0);
-        send_buffers[buf0num+send_id].clear();
-        assert(send_buffers[buf0num+send_id].size() == 0);
-        /* make a job package for a worker containing up to MAX_FILES_IN_JOB
-         * files and aiming to be at least TARGET_JOB_SIZE bytes worth of files
-         * */
-        for(size_t n = 0, job_sz = 0 ;
-            n < MAX_FILES_IN_JOB &&
-              job_sz < TARGET_JOB_SIZE &&
-              !done ;
-            n++) {
-          const std::string fn(entries.nextfile());
-          if(fn.empty()) {
-            done = 1;
-            break;
-          }
-          timer_stat.start(__LINE__);
-          tarentry ent(fn, off);
-          timer_stat.stop(__LINE__);
-          const size_t sz = ent.size();
-          job_sz += sz;
-          //printf("%s (%zu bytes)\n", fn, sz);
-          /* enough room for
-           * filename, \0, decimal file size, \0, decimal offset into output, \0
-           * using 20 decimal digits is enough for 64 bit numbers */
-          send_buffers.at(buf0num+send_id) += ent.serialize();
-          timer_write.start(__LINE__);
-          fprintf(idx_fh, "%zu %s\n", off, fn.c_str());
-          timer_write.stop(__LINE__);
-          off += sz;
-        }
-        if(!send_buffers[buf0num+send_id].empty()) {
-          /* prepare for "done" message from worker */
-          timer_master_wait.start(__LINE__);
-          MPI_Irecv(&recv_buffers[buf0num+recv_id], 1, MPI_UNSIGNED_LONG_LONG, current_worker,
-                    send_id, MPI_COMM_WORLD, &recv_requests[buf0num+recv_id]);
-          MPI_Isend(send_buffers.at(buf0num+send_id).data(),
-                    (int)send_buffers.at(buf0num+send_id).size(), MPI_BYTE,
-                    current_worker, send_id, MPI_COMM_WORLD,
-                    &send_requests[buf0num+send_id]);
-          timer_master_wait.stop(__LINE__);
-          jobs_in_flight[current_worker] += 1;
+  int in_flight = 0;
+  for(;;) {
+    /* give every host whose slot is free a batch with a job for each of its
+     * workers, its leader splits it up again */
+    for(size_t i = 0 ; i < free_slots.size() ; i++) {
+      const int b = free_slots[i];
+      const int current_worker = leaders[size_t(b/MAX_JOBS_IN_FLIGHT)];
+      const int tag = b%MAX_JOBS_IN_FLIGHT;
+      const size_t host_size = size_t(leader_workers[size_t(b/MAX_JOBS_IN_FLIGHT)]);
+      std::string &batch = send_buffers[size_t(b)];
+      batch.clear();
+      for(size_t n = 0 ; n < host_size ; n++) {
+        if(ready.empty() && !done) {
+          ready.push_back(make_job(entries, &off, idx_fh, &bidx, &links));
+          done = ready.back().empty();
         }
+        if(ready.empty() || ready.front().empty())
+          break;
+        batch += ready.front();
+        ready.pop_front();
       }
+      if(batch.empty())
+        continue;
+      /* prepare for "done" message from the leader */
+      timer_master_wait.start(__LINE__);
+      MPI_Irecv(&recv_buffers[size_t(b)], 1, MPI_UNSIGNED_LONG_LONG,
+                current_worker, tag, MPI_COMM_WORLD, &recv_requests[size_t(b)]);
+      MPI_Isend(batch.data(), (int)batch.size(), MPI_BYTE, current_worker, tag,
+                MPI_COMM_WORLD, &send_requests[size_t(b)]);
+      timer_master_wait.stop(__LINE__);
+      in_flight += 1;
     }
-  } while(!done);
-  printf("\rAll done in master, waiting for workers\n");
+    free_slots.clear();
 
-  /* done, wait for everything to settle down */
-  timer_master_wait.start(__LINE__);
-  MPI_Waitall((int)send_requests.size(), &send_requests[0], MPI_STATUSES_IGNORE);
-  MPI_Waitall((int)recv_requests.size(), &recv_requests[0], MPI_STATUSES_IGNORE);
+    /* make the jobs of the next batch while the workers are busy */
+    while(!done && ready.size() < max_host_size) {
+      ready.push_back(make_job(entries, &off, idx_fh, &bidx, &links));
+      done = ready.back().empty();
+    }
+    if(in_flight == 0)
+      break;
 
-  printf("All communication finished in master\n");
-  timer_master_wait.stop(__LINE__);
+    /* sleep until hosts ack batches, then refill just their slots */
+    int count;
+    timer_master_wait.start(__LINE__);
+    MPI_Waitsome((int)recv_requests.size(), &recv_requests[0], &count,
+                 &recv_completed[0], &recv_status[0]);
+    timer_master_wait.stop(__LINE__);
+    for(int r = 0 ; r < count ; r++) {
+      const int b = recv_completed[r];
+      show_progress(off, size_t(recv_buffers[size_t(b)]), 0);
+      /* the batch has arrived if it was acked */
+      MPI_Wait(&send_requests[size_t(b)], MPI_STATUS_IGNORE);
+      in_flight -= 1;
+      free_slots.push_back(b);
+    }
+  }
+  printf("\rAll communication finished in master\n");
 
-  /* tell all workers to quit */
-  for(int current_worker = 1 ; current_worker < size ; current_worker++) {
-    /* the empty file name is magic and tells the worker to quit */
+  /* tell all leaders to quit, they tell their workers */
+  for(size_t current_leader = 0 ; current_leader < nleaders ; current_leader++) {
+    /* the empty file name is magic and tells the leader to quit */
     std::string terminate = tarentry().serialize();
     timer_master_wait.start(__LINE__);
-    MPI_Send(terminate.c_str(), (int)terminate.size(), MPI_BYTE, current_worker,
-             0, MPI_COMM_WORLD);
+    MPI_Send(terminate.c_str(), (int)terminate.size(), MPI_BYTE,
+             leaders[current_leader], 0, MPI_COMM_WORLD);
     timer_master_wait.stop(__LINE__);
   }
 
@@ -299,7 +326,22 @@ void master(const char *out_fn, fileentries& entries)
   show_progress(off, off-current, 0); /* show 100% written */
   printf("\n");
 
-  /* add index file to tar */
+  /* add binary index, then the text index file to tar, they are small
+   * enough to be read without a second thread */
+  writeback wb(out_fd, off, out_fh);
+  prefetcher ra(READ_AHEAD_SIZE, &timer_open, &timer_read);
+  timer_write.start(__LINE__);
+  bidx.write(bidx_fn);
+  fprintf(idx_fh, "%zu %s\n", off, bidx_fn);
+  timer_write.stop(__LINE__);
+  timer_stat.start(__LINE__);
+  tarentry bidx_ent(bidx_fn, off);
+  timer_stat.stop(__LINE__);
+  ra.add(bidx_ent);
+  copy_file_content(out_fh, out_fn, &wb, &ra, bidx_ent,
+                    &bidx_ent.make_tar_header()[0]);
+  off += bidx_ent.size();
+
   timer_write.start(__LINE__);
   fprintf(idx_fh, "%zu %s\n", off, idx_fn);
   int ierr_fclose = fclose(idx_fh);
@@ -312,7 +354,10 @@ void master(const char *out_fn, fileentries& entries)
   timer_stat.start(__LINE__);
   tarentry idx_ent(idx_fn, off);
   timer_stat.stop(__LINE__);
-  copy_file_content(out_fh, out_fn, idx_ent);
+  ra.add(idx_ent);
+  ra.close();
+  copy_file_content(out_fh, out_fn, &wb, &ra, idx_ent,
+                    &idx_ent.make_tar_header()[0]);
   off += idx_ent.size();
 
   /* terminate tar file */
@@ -332,6 +377,7 @@ void master(const char *out_fn, fileentries& entries)
     exit(1);
   }
   timer_write.start(__LINE__);
+  wb.done();
   int ierr_close = fclose(out_fh);
   timer_write.stop(__LINE__);
   if(ierr_close != 0) {
@@ -347,18 +393,56 @@ void master(const char *out_fn, fileentries& entries)
 }
 
 /* make this a non-local type to make the compiler happy */
-struct filedesc_t  {
-  tarentry ent;
-  int ask_for_work;
+/* the files of one job, their tar headers are made in one go into a single
+ * buffer */
+struct job_t  {
+  std::vector<tarentry> ents;
+  std::vector<char> headers;
+  size_t next;      /* next file to copy */
+  size_t next_hdr;  /* offset of its header in headers */
+  job_t(const std::string &rec) : next(0), next_hdr(0) {
+    for(const char *p = rec.data() ; p < rec.data() + rec.size() ; ) {
+      ents.push_back(tarentry());
+      p += ents.back().deserialize(p);
+    }
+    if(!ents.empty()) {
+      const tarentry *first = &ents[0];
+      const tarentry *last = first + ents.size();
+      headers.resize(tarentry::headers_size(first, last));
+      tarentry::make_tar_headers(first, last, &headers[0]);
+    }
+  };
+};
+/* a job of a batch from the master that the leader has not put into the ring
+ * yet, the batch is acknowledged once its last job is in */
+struct pending_t {
+  std::string rec;
   int tag;
-  filedesc_t(tarentry ent_, int ask_for_work_, int tag_) :
-    ent(ent_), ask_for_work(ask_for_work_), tag(tag_) {};
+  bool last;
 };
-void worker(const char *out_fn)
+/* queues a job and the reading of its files */
+static void push_job(std::queue<job_t> *jobs, prefetcher *ra,
+                     const std::string &rec)
+{
+  jobs->push(job_t(rec));
+  const std::vector<tarentry> &ents = jobs->back().ents;
+  for(size_t i = 0 ; i < ents.size() ; i++)
+    ra->add(ents[i]);
+}
+void worker(const char *out_fn, MPI_Comm local)
 {
-  std::queue<filedesc_t> files;
+  std::queue<job_t> jobs;
   int file_count = 0;
 
+  int local_rank, local_size;
+  MPI_Comm_rank(local, &local_rank);
+  MPI_Comm_size(local, &local_size);
+  const bool leader = local_rank == 0;
+  /* let the master know who feeds how many workers */
+  const int host_workers = leader ? local_size : 0;
+  MPI_Gather(&host_workers, 1, MPI_INT, NULL, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  jobring ring(local, JOB_RING_SIZE);
+
   timer_open.start(__LINE__);
   // I need this barrier so that all ranks wait until the last one has opened
   // and truncated the file
@@ -380,67 +464,132 @@ void worker(const char *out_fn)
     exit(1);
   }
   timer_open.stop(__LINE__);
-  static char buffer[STREAM_BUFFER_SIZE];
-  setbuffer(out_fh, buffer, sizeof(buffer));
+  /* allocated here rather than static so that it is on this rank's NUMA node
+   * with -N */
+  char *buffer = static_cast<char*>(numaplace::alloc(STREAM_BUFFER_SIZE));
+  setbuffer(out_fh, buffer, STREAM_BUFFER_SIZE);
+  /* the output is written back as it is produced rather than all at once at
+   * the end */
+  writeback wb(out_fd, 0, out_fh);
+  prefetcher ra(READ_AHEAD_SIZE, &timer_open, &timer_read);
+
+  /* the second thread reads the files of the jobs taken while this one
+   * writes them, only this one makes MPI calls */
+  #pragma omp parallel num_threads(2)
+  if(omp_get_thread_num() == 1) {
+    ra.run();
+  } else {
+    std::queue<pending_t> pending;
+    int done = 0;       /* the master has no more batches */
+    int closed = 0;     /* the ring has been closed */
+    int finished = 0;   /* the ring is closed and empty */
+    while(!finished || !jobs.empty()) {
+      if(leader && !done) {
+        int flag;
+        MPI_Status status;
+        timer_worker_wait.start(__LINE__);
+        MPI_Iprobe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
+        timer_worker_wait.stop(__LINE__);
+        if(flag) {
+          int count;
+          timer_worker_wait.start(__LINE__);
+          MPI_Get_count(&status, MPI_BYTE, &count);
+          std::vector<char> recv_buffer(count);
+          int tag = status.MPI_TAG;
+          MPI_Recv(&recv_buffer[0], count, MPI_BYTE, 0, MPI_ANY_TAG,
+                   MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+          timer_worker_wait.stop(__LINE__);
+          /* split the batch into jobs of up to MAX_FILES_IN_JOB files aiming
+           * to be at least TARGET_JOB_SIZE bytes, like the master used to */
+          const char *s = &recv_buffer[0];
+          const char *job_start = s;
+          size_t n = 0, job_sz = 0;
+          for(const char *p = s ; p - s < (ptrdiff_t)recv_buffer.size() ; ) {
+            tarentry ent;
+            p += ent.deserialize(p);
+            /* magic empty file name for end of work? */
+            if(ent.get_filename().empty()) {
+              done = 1;
+              break;
+            }
+            n += 1;
+            job_sz += ent.size();
+            if(n == MAX_FILES_IN_JOB || job_sz >= TARGET_JOB_SIZE ||
+               p - s == (ptrdiff_t)recv_buffer.size()) {
+              pending_t job;
+              job.rec.assign(job_start, p);
+              job.tag = tag;
+              job.last = p - s == (ptrdiff_t)recv_buffer.size();
+              pending.push(job);
+              job_start = p;
+              n = 0;
+              job_sz = 0;
+            }
+          }
+        }
+      }
 
-  int done = 0;
-  do {
-    MPI_Status status;
-    int count, flag;
-    if(files.empty()) {
-      timer_worker_wait.start(__LINE__);
-      MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
-      timer_worker_wait.stop(__LINE__);
-      flag = 1;
-    } else {
-      timer_worker_wait.start(__LINE__);
-      MPI_Iprobe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &flag, &status);
-      timer_worker_wait.stop(__LINE__);
-    }
-    if(flag) {
-      timer_worker_wait.start(__LINE__);
-      MPI_Get_count(&status, MPI_BYTE, &count);
-      std::vector<char> recv_buffer(count);
-      int tag = status.MPI_TAG;
-      MPI_Recv(&recv_buffer[0], count, MPI_BYTE, 0, MPI_ANY_TAG, MPI_COMM_WORLD,
-               MPI_STATUS_IGNORE);
-      timer_worker_wait.stop(__LINE__);
-      int first = 1;
-      for(char *p = &recv_buffer[0], *s = p ; p - s < (ptrdiff_t)recv_buffer.size() ; ) {
-        tarentry ent;
-        p += ent.deserialize(p);
-        /* magic empty file name for end of work? */
-        if(ent.get_filename().empty()) {
-          done = 1;
+      /* keep the ring filled, jobs too large for it are done by the leader */
+      while(leader && !pending.empty()) {
+        pending_t &job = pending.front();
+        if(!ring.fits(job.rec.size()))
+          push_job(&jobs, &ra, job.rec);
+        else if(!ring.put(job.rec))
           break;
+        if(job.last) {
+          assert(sizeof(size_t) <= sizeof(unsigned long long int));
+          unsigned long long int chunk_written = ring.take_count();
+          timer_worker_wait.start(__LINE__);
+          MPI_Send(&chunk_written, 1, MPI_UNSIGNED_LONG_LONG, 0, job.tag,
+                   MPI_COMM_WORLD);
+          timer_worker_wait.stop(__LINE__);
         }
-        files.push(filedesc_t(ent, first, tag));
-        first = 0;
+        pending.pop();
+      }
+      if(leader && done && pending.empty() && !closed) {
+        ring.close();
+        closed = 1;
       }
-    }
 
-    /* only do one file, then look for more work from master, this assumes that
-     * MPI is much faster than IO */
-    if(!files.empty()) {
-      assert(sizeof(size_t) <= sizeof(unsigned long long int));
-      static unsigned long long int chunk_written = 0;
-      const filedesc_t& file = files.front();
-      copy_file_content(out_fh, out_fn, file.ent);
-      file_count += 1;
-      chunk_written += static_cast<unsigned long long int>(file.ent.size());
-      if(file.ask_for_work) {
+      if(jobs.empty() && !finished) {
+        std::string rec;
         timer_worker_wait.start(__LINE__);
-        MPI_Send(&chunk_written, 1, MPI_UNSIGNED_LONG_LONG, 0, file.tag, MPI_COMM_WORLD);
+        const int got = ring.take(&rec);
+        if(got > 0) {
+          push_job(&jobs, &ra, rec);
+        } else if(got < 0) {
+          finished = 1;
+        } else if(leader && !done && pending.empty()) {
+          /* nothing to do until the master sends more */
+          MPI_Status status;
+          MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &status);
+        } else if(!leader) {
+          usleep(RING_POLL_INTERVAL);
+        }
         timer_worker_wait.stop(__LINE__);
-        chunk_written = 0;
       }
-      files.pop();
-    }
 
-  } while(!done || !files.empty());
+      /* only do one file, then look for more work, this assumes that MPI is
+       * much faster than IO */
+      if(!jobs.empty()) {
+        job_t& job = jobs.front();
+        const tarentry& ent = job.ents[job.next];
+        copy_file_content(out_fh, out_fn, &wb, &ra, ent,
+                          &job.headers[job.next_hdr]);
+        file_count += 1;
+        ring.add_count(ent.size());
+        job.next_hdr += ent.header_size();
+        if(++job.next == job.ents.size())
+          jobs.pop();
+      }
+    }
+    /* everything has been queued */
+    ra.close();
+  }
 
   /* this will usually induce a delay while caches are flushed */
   timer_write.start(__LINE__);
+  wb.done();
   int ierr_close = fclose(out_fh);
   timer_write.stop(__LINE__);
   if(ierr_close != 0) {
@@ -448,6 +597,7 @@ void worker(const char *out_fn)
             strerror(errno));
     exit(1);
   }
+  numaplace::free(buffer, STREAM_BUFFER_SIZE);
   // the barrier before master reports 100% done
   timer_worker_wait.start(__LINE__);
   MPI_Barrier(MPI_COMM_WORLD);
@@ -458,28 +608,41 @@ void worker(const char *out_fn)
   timer_worker_wait.stop(__LINE__);
 }
 
-static int find_unused_request(int count, MPI_Request *request)
+static std::string make_job(fileentries &entries, size_t *off, FILE *idx_fh,
+                            memberindex_writer *bidx, hardlinks *links)
 {
-  int flag, idx;
-  
-  for(int r = 0 ; r < count ; r++) {
-    if(request[r] == MPI_REQUEST_NULL) {
-      return r;
-    }
+  /* a job contains up to MAX_FILES_IN_JOB files and aims to be at least
+   * TARGET_JOB_SIZE bytes worth of files */
+  std::string job;
+  for(size_t n = 0, job_sz = 0 ;
+      n < MAX_FILES_IN_JOB && job_sz < TARGET_JOB_SIZE ;
+      n++) {
+    const std::string fn(entries.nextfile());
+    if(fn.empty())
+      break;
+    timer_stat.start(__LINE__);
+    tarentry ent(fn, *off);
+    timer_stat.stop(__LINE__);
+    links->add(ent);
+    const size_t sz = ent.size();
+    job_sz += sz;
+    job += ent.serialize();
+    timer_write.start(__LINE__);
+    fprintf(idx_fh, "%zu %s\n", *off, fn.c_str());
+    timer_write.stop(__LINE__);
+    bidx->add(ent.get_filename(), MEMBERINDEX_NO_BLOCK, *off,
+              ent.get_filesize(), sz, ent.get_mode(), ent.get_mtime());
+    *off += sz;
   }
-
-  timer_master_wait.start(__LINE__);
-  MPI_Testany(count, request, &idx, &flag, MPI_STATUSES_IGNORE);
-  timer_master_wait.stop(__LINE__);
-  return flag ? idx : -1;
+  return job;
 }
 
 static void copy_file_content(FILE *out_fh, const char *out_fn,
-                              const tarentry &ent)
+                              writeback *wb, prefetcher *ra,
+                              const tarentry &ent, const char *hdr)
 {
   const size_t off = ent.get_offset();
-  const char *in_fn = ent.get_filename().c_str();
-  const std::vector<char> hdr(ent.make_tar_header());
+  const size_t hdr_sz = ent.header_size();
 
   // seek only when required to avoid flushes
   // ftell however seems to call fflush() so we keep track of the file pointer
@@ -494,52 +657,56 @@ static void copy_file_content(FILE *out_fh, const char *out_fn,
       exit(1);
     }
     file_off = off;
+    wb->moved_to(off);
   }
   timer_seek.stop(__LINE__);
 
   timer_write.start(__LINE__);
-  size_t written = fwrite(hdr.data(), 1, hdr.size(), out_fh);
+  size_t written = fwrite(hdr, 1, hdr_sz, out_fh);
   timer_write.stop(__LINE__);
-  if(written != hdr.size()) {
-    fprintf(stderr, "Could not write %zu bytes to '%s': %s\n", hdr.size(),
+  if(written != hdr_sz) {
+    fprintf(stderr, "Could not write %zu bytes to '%s': %s\n", hdr_sz,
             out_fn, strerror(errno));
     exit(1);
   }
-  file_off += hdr.size();
-  if(!ent.is_reg())
+  file_off += hdr_sz;
+  wb->written_to(file_off);
+  if(!ent.is_reg() || ent.is_hardlink())
     return;
 
-  timer_open.start(__LINE__);
-  int in_fd = open(in_fn, O_RDONLY);
-  timer_open.stop(__LINE__);
-  if(in_fd < 0) {
-    fprintf(stderr, "Could not open '%s' for reading: %s\n", in_fn,
-            strerror(errno));
-    exit(1);
-  }
-  off_t size = (off_t)ent.get_filesize();
-  off_t offset = 0;
-  while(offset < size) {
-    static char fbuf[COPY_BLOCK_SIZE]; /* TODO: find an optimal number */
-    timer_read.start(__LINE__);
-    ssize_t read_sz = read(in_fd, fbuf, size_t(size-offset) > sizeof(fbuf) ? sizeof(fbuf) : (size-offset));
-    timer_read.stop(__LINE__);
-    if(read_sz == -1) {
-      fprintf(stderr, "Could not read from '%s': %s\n", in_fn, strerror(errno));
+  /* sparse files store a map of their data extents first */
+  const std::vector<char> map(ent.make_sparse_map());
+  if(!map.empty()) {
+    timer_write.start(__LINE__);
+    written = fwrite(&map[0], 1, map.size(), out_fh);
+    timer_write.stop(__LINE__);
+    if(written != map.size()) {
+      fprintf(stderr, "Could not write %zu bytes to '%s': %s\n", map.size(),
+              out_fn, strerror(errno));
       exit(1);
     }
-    offset += read_sz;
+    file_off += map.size();
+  }
+
+  /* the data itself comes from the read ahead thread */
+  const size_t data_sz = ent.get_datasize() - map.size();
+  for(size_t copied = 0 ; copied < data_sz ; ) {
+    size_t read_sz;
+    const char *data = ra->get(data_sz - copied, &read_sz);
     timer_write.start(__LINE__);
-    size_t write_sz = fwrite(fbuf, 1, read_sz, out_fh);
+    size_t write_sz = fwrite(data, 1, read_sz, out_fh);
     timer_write.stop(__LINE__);
-    if(write_sz != size_t(read_sz)) {
+    timer_write.count(write_sz);
+    if(write_sz != read_sz) {
       fprintf(stderr, "Could not write %zu bytes to '%s': %s\n",
-              size_t(read_sz), out_fn, strerror(errno));
+              read_sz, out_fn, strerror(errno));
       exit(1);
     }
+    copied += read_sz;
+    wb->written_to(file_off + copied);
   }
-  assert(offset == size);
-  file_off += size;
+  file_off += data_sz;
+  const size_t size = ent.get_datasize();
 
   static char block[BLOCKSIZE]; /* bunch of zeros for padding to block size */
   if(size % BLOCKSIZE) {
@@ -554,11 +721,7 @@ static void copy_file_content(FILE *out_fh, const char *out_fn,
     }
     file_off += padsize;
   }
-  timer_open.start(__LINE__);
-  int ierr_close = close(in_fd);
-  assert(ierr_close == 0);
-  timer_open.stop(__LINE__);
-
+  wb->written_to(file_off);
 }
 
 size_t show_progress(size_t total, size_t chunksize, int show_percent)
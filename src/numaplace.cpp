@@ -0,0 +1,141 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "numaplace.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+
+#include <omp.h>
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+namespace {
+// node of every OpenMP thread
+std::vector<int> thread_nodes;
+}
+
+bool numaplace::enabled = false;
+
+bool numaplace::enable(MPI_Comm comm)
+{
+  // ranks sharing memory are on the same host
+  MPI_Comm host;
+  MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &host);
+  int host_rank, host_size;
+  MPI_Comm_rank(host, &host_rank);
+  MPI_Comm_size(host, &host_size);
+  MPI_Comm_free(&host);
+#ifdef HAVE_LIBNUMA
+  if(numa_available() < 0)
+    return false;
+  std::vector<int> nodes;
+  for(int n = 0 ; n <= numa_max_node() ; n++)
+    if(numa_bitmask_isbitset(numa_all_nodes_ptr, n))
+      nodes.push_back(n);
+  if(nodes.empty())
+    return false;
+
+  // with more ranks than nodes ranks share a node, with fewer each rank
+  // spreads its threads over the nodes it gets
+  std::vector<int> mine;
+  if(size_t(host_size) >= nodes.size())
+    mine.push_back(nodes[size_t(host_rank) % nodes.size()]);
+  else
+    for(size_t i = size_t(host_rank) ; i < nodes.size() ;
+        i += size_t(host_size))
+      mine.push_back(nodes[i]);
+
+  thread_nodes.assign(size_t(omp_get_max_threads()), -1);
+  bool ok = true;
+  #pragma omp parallel
+  {
+    const int t = omp_get_thread_num();
+    const int n = mine[size_t(t) % mine.size()];
+    if(numa_run_on_node(n) != 0) {
+      fprintf(stderr, "Could not run thread %d on NUMA node %d: %s\n", t, n,
+              strerror(errno));
+      #pragma omp atomic write
+      ok = false;
+    }
+    numa_set_preferred(n);
+    thread_nodes[size_t(t)] = n;
+  }
+  enabled = ok;
+  return ok;
+#else
+  (void)host_rank;
+  return false;
+#endif
+}
+
+int numaplace::node()
+{
+  const size_t t = size_t(omp_get_thread_num());
+  return enabled && t < thread_nodes.size() ? thread_nodes[t] : -1;
+}
+
+void *numaplace::alloc(const size_t size)
+{
+  void *p;
+#ifdef HAVE_LIBNUMA
+  if(enabled)
+    p = node() >= 0 ? numa_alloc_onnode(size, node()) :
+                      numa_alloc_local(size);
+  else
+#endif
+    p = malloc(size);
+  if(p == NULL) {
+    fprintf(stderr, "Could not allocate %zu bytes: %s\n", size,
+            strerror(ENOMEM));
+    exit(1);
+  }
+  return p;
+}
+
+void numaplace::free(void *p, const size_t size)
+{
+#ifdef HAVE_LIBNUMA
+  if(enabled) {
+    numa_free(p, size);
+    return;
+  }
+#endif
+  (void)size;
+  ::free(p);
+}
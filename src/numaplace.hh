@@ -0,0 +1,71 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef NUMA_PLACE_HH_
+#define NUMA_PLACE_HH_
+
+#include <stddef.h>
+
+#include <mpi.h>
+
+// optional placement of ranks, threads and buffers on NUMA nodes (sockets)
+// Memory attached to another socket is slower to reach than local memory.
+// enable() deals the nodes of a host out to the ranks running on it, pins
+// every OpenMP thread of a rank to the CPUs of one of its nodes and makes the
+// memory each thread allocates come from that node. Buffers a thread
+// allocates and fills itself, like the compression and copy buffers of
+// blockwriter, tarappender and extractor, are then local to it. Long lived
+// buffers that are not filled right away should come from alloc().
+// Needs libnuma and -DHAVE_LIBNUMA, without it enable() fails and alloc()
+// is malloc().
+class numaplace
+{
+  public:
+  // collective, pins the threads of the current OpenMP team size, false if
+  // NUMA is not available
+  static bool enable(MPI_Comm comm);
+  static bool is_enabled() { return enabled; }
+
+  // node of the calling OpenMP thread, -1 unless enabled
+  static int node();
+
+  // size bytes on the node of the calling thread, exits if out of memory
+  static void *alloc(const size_t size);
+  static void free(void *p, const size_t size);
+
+  private:
+  static bool enabled;
+};
+
+#endif // NUMA_PLACE_HH_
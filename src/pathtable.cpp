@@ -0,0 +1,457 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "pathtable.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+#include <queue>
+
+#include <unistd.h>
+#include <omp.h>
+
+// smallest number of records in a sorted run spilled to disk
+#define MIN_RUN_SIZE (64u*1024u)
+
+namespace {
+// sort key and file number, the key is the inverted size so that ascending
+// order is largest first
+struct sortrec {
+  uint64_t key;
+  uint32_t file;
+};
+
+// stable least significant digit radix sort of v on key, 8 bits per pass
+// Passes over bytes that are the same in all keys, such as the high bytes of
+// the sizes of small files, are skipped. Every thread of the team, however
+// many the runtime gives us, counts and scatters a fixed slice of v so that
+// the order within a digit stays stable.
+void radix_sort(std::vector<sortrec> &v)
+{
+  const size_t n = v.size();
+  uint64_t all_or = 0, all_and = ~uint64_t(0);
+  #pragma omp parallel for reduction(|:all_or) reduction(&:all_and)
+  for(size_t i = 0 ; i < n ; i++) {
+    all_or |= v[i].key;
+    all_and &= v[i].key;
+  }
+  const uint64_t varies = all_or ^ all_and;
+
+  std::vector<sortrec> tmp(n);
+  std::vector<size_t> counts(size_t(omp_get_max_threads()) * 256);
+  for(unsigned shift = 0 ; shift < 64 ; shift += 8) {
+    if(((varies >> shift) & 0xff) == 0)
+      continue;
+    std::fill(counts.begin(), counts.end(), 0);
+    #pragma omp parallel
+    {
+      const size_t nthreads = size_t(omp_get_num_threads());
+      const size_t t = size_t(omp_get_thread_num());
+      const size_t begin = n * t / nthreads, end = n * (t + 1) / nthreads;
+      size_t *count = &counts[t * 256];
+      for(size_t i = begin ; i < end ; i++)
+        count[(v[i].key >> shift) & 0xff]++;
+      #pragma omp barrier
+      #pragma omp single
+      {
+        // digit major, thread minor, which keeps the sort stable
+        size_t sum = 0;
+        for(size_t d = 0 ; d < 256 ; d++) {
+          for(size_t u = 0 ; u < nthreads ; u++) {
+            const size_t c = counts[u * 256 + d];
+            counts[u * 256 + d] = sum;
+            sum += c;
+          }
+        }
+      }
+      for(size_t i = begin ; i < end ; i++)
+        tmp[count[(v[i].key >> shift) & 0xff]++] = v[i];
+    }
+    v.swap(tmp);
+  }
+}
+
+// sorted run of records spilled to an unlinked scratch file
+struct run {
+  FILE *fh;
+  std::vector<sortrec> buf;
+  size_t pos;
+  bool next(sortrec &rec) {
+    if(pos == buf.size()) {
+      buf.resize(buf.capacity());
+      const size_t got = fread(&buf[0], sizeof(sortrec), buf.size(), fh);
+      if(got == 0 && ferror(fh)) {
+        fprintf(stderr, "Could not read sort run: %s\n", strerror(errno));
+        exit(1);
+      }
+      buf.resize(got);
+      pos = 0;
+      if(got == 0)
+        return false;
+    }
+    rec = buf[pos++];
+    return true;
+  }
+};
+
+// heap entry of the merge, smallest key first and the earlier file on ties
+struct merge_head {
+  sortrec rec;
+  size_t run;
+  bool operator<(const merge_head &o) const {
+    return rec.key > o.rec.key ||
+           (rec.key == o.rec.key && rec.file > o.rec.file);
+  }
+};
+
+FILE *scratch_file(const std::string &dir)
+{
+  std::string fn = dir + "/ptgz-sort.XXXXXX";
+  std::vector<char> tmpl(fn.begin(), fn.end());
+  tmpl.push_back('\0');
+  const int fd = mkstemp(&tmpl[0]);
+  if(fd < 0) {
+    fprintf(stderr, "Could not create sort run in '%s': %s\n", dir.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  // the file goes away with the handle, even if we do not get to close it
+  unlink(&tmpl[0]);
+  FILE *fh = fdopen(fd, "w+b");
+  if(fh == NULL) {
+    fprintf(stderr, "Could not open sort run in '%s': %s\n", dir.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  return fh;
+}
+
+// v[i] = v[order[i]] for all i at once, in place by following the cycles of
+// order so that no second copy of v is needed
+template<class T>
+void permute(std::vector<T> &v, const std::vector<uint32_t> &order)
+{
+  std::vector<bool> done(order.size());
+  for(size_t start = 0 ; start < order.size() ; start++) {
+    if(done[start])
+      continue;
+    const T first = v[start];
+    size_t i = start;
+    for(;;) {
+      done[i] = true;
+      const size_t from = order[i];
+      if(from == start) {
+        v[i] = first;
+        break;
+      }
+      v[i] = v[from];
+      i = from;
+    }
+  }
+}
+}
+
+pathtable::pathtable(const std::string &root)
+{
+  dir_names.push_back(add_name(root.c_str(), false));
+  dir_parents.push_back(0);
+}
+
+uint64_t pathtable::add_name(const char *name, const bool is_dir)
+{
+  const uint64_t off = names.size();
+  names.insert(names.end(), name, name + strlen(name));
+  if(is_dir)
+    names.push_back('/');
+  names.push_back('\0');
+  return off;
+}
+
+uint32_t pathtable::add_dir(const uint32_t parent, const char *name)
+{
+  if(full()) {
+    fprintf(stderr, "Too many directories\n");
+    exit(1);
+  }
+  dir_names.push_back(add_name(name, true));
+  dir_parents.push_back(parent);
+  return uint32_t(dir_names.size() - 1);
+}
+
+void pathtable::add_file(const uint32_t dir, const char *name,
+                         const uint64_t size, const uint32_t mode,
+                         const int64_t mtime, const uint64_t length)
+{
+  if(full()) {
+    fprintf(stderr, "Too many files\n");
+    exit(1);
+  }
+  if(length != size)
+    lengths.push_back(std::make_pair(uint32_t(sizes.size()), length));
+  file_names.push_back(add_name(name, false));
+  file_dirs.push_back(dir);
+  sizes.push_back(size);
+  modes.push_back(mode);
+  mtimes.push_back(mtime);
+}
+
+void pathtable::add_link(const uint32_t dir, const char *name,
+                         const uint32_t file)
+{
+  if(full()) {
+    fprintf(stderr, "Too many files\n");
+    exit(1);
+  }
+  link_names.push_back(add_name(name, false));
+  link_dirs.push_back(dir);
+  link_files.push_back(file);
+}
+
+void pathtable::clear()
+{
+  // swap to actually release the memory
+  std::vector<uint64_t>().swap(dir_names);
+  std::vector<uint32_t>().swap(dir_parents);
+  std::vector<uint64_t>().swap(file_names);
+  std::vector<uint32_t>().swap(file_dirs);
+  std::vector<uint64_t>().swap(sizes);
+  std::vector<uint32_t>().swap(modes);
+  std::vector<int64_t>().swap(mtimes);
+  std::vector<std::pair<uint32_t, uint64_t> >().swap(lengths);
+  std::vector<uint64_t>().swap(link_names);
+  std::vector<uint32_t>().swap(link_dirs);
+  std::vector<uint32_t>().swap(link_files);
+  std::vector<char>().swap(names);
+}
+
+void pathtable::sort_by_size(const size_t budget, const std::string &scratch)
+{
+  const size_t n = sizes.size();
+  // the records and the radix sort's second buffer, runs are not made so
+  // small that there are too many files to merge
+  const size_t run_size = budget ? std::max(size_t(MIN_RUN_SIZE),
+                                            budget / (2 * sizeof(sortrec))) : n;
+  std::vector<uint32_t> order(n);
+
+  if(run_size >= n) {
+    std::vector<sortrec> recs(n);
+    #pragma omp parallel for
+    for(size_t i = 0 ; i < n ; i++) {
+      recs[i].key = ~sizes[i];
+      recs[i].file = uint32_t(i);
+    }
+    radix_sort(recs);
+    #pragma omp parallel for
+    for(size_t i = 0 ; i < n ; i++)
+      order[i] = recs[i].file;
+  } else {
+    // sort runs that fit into the budget, spill them and merge them
+    std::vector<run> runs((n + run_size - 1) / run_size);
+    for(size_t r = 0 ; r < runs.size() ; r++) {
+      const size_t begin = r * run_size;
+      const size_t end = std::min(n, begin + run_size);
+      std::vector<sortrec> recs(end - begin);
+      #pragma omp parallel for
+      for(size_t i = begin ; i < end ; i++) {
+        recs[i - begin].key = ~sizes[i];
+        recs[i - begin].file = uint32_t(i);
+      }
+      radix_sort(recs);
+      runs[r].fh = scratch_file(scratch);
+      if(fwrite(&recs[0], sizeof(sortrec), recs.size(), runs[r].fh) !=
+         recs.size() || fflush(runs[r].fh) != 0) {
+        fprintf(stderr, "Could not write sort run in '%s': %s\n",
+                scratch.c_str(), strerror(errno));
+        exit(1);
+      }
+      rewind(runs[r].fh);
+    }
+
+    const size_t buf_size = std::max(size_t(4096),
+                                     budget / (runs.size() * sizeof(sortrec)));
+    std::priority_queue<merge_head> heads;
+    for(size_t r = 0 ; r < runs.size() ; r++) {
+      runs[r].buf.reserve(buf_size);
+      runs[r].pos = 0;
+      merge_head head;
+      head.run = r;
+      if(runs[r].next(head.rec))
+        heads.push(head);
+    }
+    for(size_t i = 0 ; !heads.empty() ; i++) {
+      merge_head head = heads.top();
+      heads.pop();
+      order[i] = head.rec.file;
+      if(runs[head.run].next(head.rec))
+        heads.push(head);
+    }
+    for(size_t r = 0 ; r < runs.size() ; r++)
+      fclose(runs[r].fh);
+  }
+
+  // the lists are independent, each is permuted by its own thread
+  #pragma omp parallel sections
+  {
+    #pragma omp section
+    permute(file_names, order);
+    #pragma omp section
+    permute(file_dirs, order);
+    #pragma omp section
+    permute(sizes, order);
+    #pragma omp section
+    permute(modes, order);
+    #pragma omp section
+    permute(mtimes, order);
+  }
+
+  // links follow their files to their new numbers
+  std::vector<uint32_t> moved_to(n);
+  #pragma omp parallel for
+  for(size_t i = 0 ; i < n ; i++)
+    moved_to[order[i]] = uint32_t(i);
+  #pragma omp parallel for
+  for(size_t i = 0 ; i < link_files.size() ; i++)
+    link_files[i] = moved_to[link_files[i]];
+  for(size_t i = 0 ; i < lengths.size() ; i++)
+    lengths[i].first = moved_to[lengths[i].first];
+  std::sort(lengths.begin(), lengths.end());
+}
+
+uint64_t pathtable::length(const size_t i) const
+{
+  const std::pair<uint32_t, uint64_t> key(uint32_t(i), 0);
+  std::vector<std::pair<uint32_t, uint64_t> >::const_iterator it =
+    std::lower_bound(lengths.begin(), lengths.end(), key);
+  return it != lengths.end() && it->first == i ? it->second : sizes[i];
+}
+
+uint64_t pathtable::total_size() const
+{
+  uint64_t total = 0;
+  for(size_t i = 0 ; i < sizes.size() ; i++)
+    total += sizes[i];
+  return total;
+}
+
+std::string pathtable::dir_path(const uint32_t dir) const
+{
+  if(dir == 0)
+    return &names[dir_names[0]];
+  return dir_path(dir_parents[dir]) + &names[dir_names[dir]];
+}
+
+std::string pathtable::path(const size_t i) const
+{
+  return dir_path(file_dirs[i]) + &names[file_names[i]];
+}
+
+std::string pathtable::link_path(const size_t i) const
+{
+  return dir_path(link_dirs[i]) + &names[link_names[i]];
+}
+
+const char *pathtable::child_name(const uint32_t child) const
+{
+  const size_t nfiles = sizes.size();
+  const size_t nmembers = nfiles + link_files.size();
+  if(child < nfiles)
+    return &names[file_names[child]];
+  if(child < nmembers)
+    return &names[link_names[child - nfiles]];
+  return &names[dir_names[child - nmembers]];
+}
+
+void pathtable::path_order(std::vector<uint32_t> *order) const
+{
+  // A path is the path of its directory followed by its name, and names of
+  // directories end in a '/' which no file name contains. So the children of
+  // a directory sorted by name are in path order, and a depth first walk
+  // that visits them in that order yields all paths sorted.
+  const size_t nfiles = sizes.size();
+  const size_t nmembers = nfiles + link_files.size();
+  const size_t ndirs = dir_names.size();
+
+  // group the children by directory, directories are numbered after the
+  // files and links
+  std::vector<uint64_t> first(ndirs + 1, 0);
+  for(size_t i = 0 ; i < nfiles ; i++)
+    first[file_dirs[i] + 1]++;
+  for(size_t i = 0 ; i < link_dirs.size() ; i++)
+    first[link_dirs[i] + 1]++;
+  for(size_t d = 1 ; d < ndirs ; d++)
+    first[dir_parents[d] + 1]++;
+  for(size_t d = 0 ; d < ndirs ; d++)
+    first[d + 1] += first[d];
+  std::vector<uint32_t> children(first[ndirs]);
+  {
+    std::vector<uint64_t> next(first.begin(), first.end() - 1);
+    for(size_t i = 0 ; i < nfiles ; i++)
+      children[next[file_dirs[i]]++] = uint32_t(i);
+    for(size_t i = 0 ; i < link_dirs.size() ; i++)
+      children[next[link_dirs[i]]++] = uint32_t(nfiles + i);
+    for(size_t d = 1 ; d < ndirs ; d++)
+      children[next[dir_parents[d]]++] = uint32_t(nmembers + d);
+  }
+
+  #pragma omp parallel for schedule(dynamic, 1024)
+  for(size_t d = 0 ; d < ndirs ; d++) {
+    std::sort(children.begin() + first[d], children.begin() + first[d + 1],
+              [this](const uint32_t a, const uint32_t b) {
+                return strcmp(child_name(a), child_name(b)) < 0;
+              });
+  }
+
+  order->clear();
+  order->reserve(nmembers);
+  // directories being walked and the next of their children to visit
+  std::vector<std::pair<uint32_t, uint64_t> > stack;
+  stack.push_back(std::make_pair(uint32_t(0), first[0]));
+  while(!stack.empty()) {
+    std::pair<uint32_t, uint64_t> &top = stack.back();
+    if(top.second == first[top.first + 1]) {
+      stack.pop_back();
+      continue;
+    }
+    const uint32_t child = children[top.second++];
+    if(child < nmembers)
+      order->push_back(child);
+    else
+      stack.push_back(std::make_pair(uint32_t(child - nmembers),
+                                     first[child - nmembers]));
+  }
+}
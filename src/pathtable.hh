@@ -0,0 +1,129 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef PATH_TABLE_HH_
+#define PATH_TABLE_HH_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// compact list of files and their sizes
+// Instead of one string per file holding the full path, every directory is
+// stored once as a name and the id of its parent, and every file as the id of
+// its directory and its base name. All names live in one arena of NUL
+// terminated strings and sizes are kept in their own array, so a file costs
+// 32 bytes plus the length of its base name and sorting by size only touches
+// the size array.
+// Besides the size that is archived, which is what files are sorted by, the
+// mode, mtime and length (st_size) seen by the walk are kept so that members
+// can be indexed without asking the file system again. The length is only
+// stored apart for the few files where it differs from the archived size,
+// symlinks and files with holes.
+// Directory 0 is the root passed to the constructor, its name is used as the
+// prefix of all paths as is. Names of other directories get a '/' appended. A
+// file with an empty name stands for its directory.
+// Further names of a hard linked file are kept apart from the files, as links
+// that refer to the file by its number, so they follow it when it is sorted.
+class pathtable
+{
+  public:
+  pathtable(const std::string &root = "");
+  ~pathtable() {};
+
+  // returns the id of the new directory
+  uint32_t add_dir(const uint32_t parent, const char *name);
+  // size is the number of bytes archived, length the file size or the length
+  // of the target of a symlink. mode 0 marks files whose status is unknown.
+  void add_file(const uint32_t dir, const char *name, const uint64_t size,
+                const uint32_t mode = 0, const int64_t mtime = 0,
+                const uint64_t length = 0);
+  // adds another name of an already added file
+  void add_link(const uint32_t dir, const char *name, const uint32_t file);
+  void clear();
+
+  // sorts the files by size, largest first, ties keep the order they were
+  // added in. Uses a parallel radix sort, and if its working set would
+  // exceed budget bytes (0 for no limit) sorts runs within the budget, spills
+  // them to the directory scratch and merges them. The lists are reordered in
+  // place, which only takes 8 bytes per file outside of the budget for the
+  // new order and its inverse.
+  void sort_by_size(const size_t budget = 0, const std::string &scratch = "/tmp");
+
+  // accessors
+  size_t size() const { return sizes.size(); }
+  uint64_t filesize(const size_t i) const { return sizes[i]; }
+  uint32_t mode(const size_t i) const { return modes[i]; }
+  int64_t mtime(const size_t i) const { return mtimes[i]; }
+  uint64_t length(const size_t i) const;
+  uint64_t total_size() const;
+  std::string dir_path(const uint32_t dir) const;
+  std::string path(const size_t i) const;
+  size_t links() const { return link_files.size(); }
+  // number of the file link i is another name of
+  uint32_t link_file(const size_t i) const { return link_files[i]; }
+  std::string link_path(const size_t i) const;
+  // numbers of all files and links in bytewise order of their paths, where
+  // link i is numbered size() + i. Costs 4 bytes per entry on top of the
+  // result while it runs.
+  void path_order(std::vector<uint32_t> *order) const;
+
+  private:
+  // arena offsets of the names of directories and files
+  std::vector<uint64_t> dir_names;
+  std::vector<uint32_t> dir_parents;
+  std::vector<uint64_t> file_names;
+  std::vector<uint32_t> file_dirs;
+  std::vector<uint64_t> sizes;
+  std::vector<uint32_t> modes;
+  std::vector<int64_t> mtimes;
+  // lengths that differ from sizes, by file number
+  std::vector<std::pair<uint32_t, uint64_t> > lengths;
+  std::vector<uint64_t> link_names;
+  std::vector<uint32_t> link_dirs;
+  std::vector<uint32_t> link_files;
+  std::vector<char> names;
+
+  uint64_t add_name(const char *name, const bool is_dir);
+  // files, links and directories share one 32 bit numbering in path_order()
+  bool full() const {
+    return dir_names.size() + sizes.size() + link_files.size() >= UINT32_MAX;
+  }
+  const char *child_name(const uint32_t child) const;
+};
+
+#endif // PATH_TABLE_HH_
@@ -0,0 +1,242 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "prefetcher.hh"
+#include "numaplace.hh"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// one buffer is written while the other is read
+#define READ_AHEAD_BUFFERS 2
+
+prefetcher::prefetcher(const size_t bufsize_, timer *open_timer_,
+                     timer *read_timer_) :
+  bufsize(bufsize_), open_timer(open_timer_), read_timer(read_timer_),
+  closed(false), threaded(false), current_pos(0), in_fd(-1), hints(NULL),
+  extent(0), extent_pos(0)
+{
+  for(int i = 0 ; i < READ_AHEAD_BUFFERS ; i++)
+    bufs.push_back(static_cast<char*>(numaplace::alloc(bufsize)));
+  free_bufs = bufs;
+  current.buf = NULL;
+  current.size = 0;
+}
+
+prefetcher::~prefetcher()
+{
+  close_file();
+  for(size_t i = 0 ; i < bufs.size() ; i++)
+    numaplace::free(bufs[i], bufsize);
+}
+
+void prefetcher::add(const tarentry &ent)
+{
+  if(!ent.is_reg() || ent.is_hardlink() || ent.get_datasize() == 0)
+    return;
+  std::lock_guard<std::mutex> l(lock);
+  files.push_back(ent);
+  changed.notify_all();
+}
+
+void prefetcher::close()
+{
+  std::lock_guard<std::mutex> l(lock);
+  closed = true;
+  changed.notify_all();
+}
+
+void prefetcher::run()
+{
+  {
+    std::lock_guard<std::mutex> l(lock);
+    threaded = true;
+  }
+  while(fill(false))
+    ;
+}
+
+const char *prefetcher::get(const size_t size, size_t *got)
+{
+  std::unique_lock<std::mutex> l(lock);
+  // the caller is done with the last chunk once it asks for more
+  if(current.buf != NULL && current_pos == current.size) {
+    free_bufs.push_back(current.buf);
+    current.buf = NULL;
+    changed.notify_all();
+  }
+  while(current.buf == NULL) {
+    if(!full.empty()) {
+      current = full.front();
+      full.pop_front();
+      current_pos = 0;
+    } else if(threaded) {
+      changed.wait(l);
+    } else {
+      l.unlock();
+      const bool more = fill(true);
+      l.lock();
+      // more data was asked for than was added
+      assert(more);
+    }
+  }
+  *got = size < current.size - current_pos ? size : current.size - current_pos;
+  const char *p = current.buf + current_pos;
+  current_pos += *got;
+  return p;
+}
+
+bool prefetcher::fill(const bool from_get)
+{
+  std::lock_guard<std::mutex> r(reading);
+  char *buf;
+  {
+    std::unique_lock<std::mutex> l(lock);
+    // the reading thread may have started or read something meanwhile
+    if(from_get && (threaded || !full.empty()))
+      return true;
+    while(free_bufs.empty())
+      changed.wait(l);
+    buf = free_bufs.back();
+    free_bufs.pop_back();
+  }
+
+  // a buffer is handed over when it is full or no more files are queued
+  size_t used = 0;
+  while(used < bufsize) {
+    if(in_fd < 0 && !open_next(!from_get && used == 0))
+      break;
+    if(extent == extents.size()) {
+      close_file();
+      continue;
+    }
+    const tar_extent &e = extents[extent];
+    if(extent_pos == e.size) {
+      extent += 1;
+      extent_pos = 0;
+      if(extent < extents.size() && file.is_sparse() &&
+         lseek(in_fd, off_t(extents[extent].offset), SEEK_SET) == -1) {
+        fprintf(stderr, "Could not seek '%s' to %zu: %s\n",
+                file.get_filename().c_str(), extents[extent].offset,
+                strerror(errno));
+        exit(1);
+      }
+      continue;
+    }
+    const size_t want = bufsize - used < e.size - extent_pos ?
+                        bufsize - used : e.size - extent_pos;
+    read_timer->start(__LINE__);
+    const ssize_t read_sz = read(in_fd, buf + used, want);
+    read_timer->stop(__LINE__);
+    if(read_sz == -1) {
+      fprintf(stderr, "Could not read from '%s': %s\n",
+              file.get_filename().c_str(), strerror(errno));
+      exit(1);
+    }
+    if(read_sz == 0) {
+      fprintf(stderr, "Could not read from '%s': file shrank\n",
+              file.get_filename().c_str());
+      exit(1);
+    }
+    read_timer->count(size_t(read_sz));
+    used += size_t(read_sz);
+    extent_pos += size_t(read_sz);
+    hints->read_to(e.offset + extent_pos);
+  }
+
+  std::lock_guard<std::mutex> l(lock);
+  if(used > 0) {
+    const chunk c = {buf, used};
+    full.push_back(c);
+  } else {
+    free_bufs.push_back(buf);
+  }
+  changed.notify_all();
+  return used > 0;
+}
+
+bool prefetcher::open_next(const bool wait)
+{
+  {
+    std::unique_lock<std::mutex> l(lock);
+    while(wait && threaded && files.empty() && !closed)
+      changed.wait(l);
+    if(files.empty())
+      return false;
+    file = files.front();
+    files.pop_front();
+  }
+
+  const char *in_fn = file.get_filename().c_str();
+  open_timer->start(__LINE__);
+  in_fd = open(in_fn, O_RDONLY);
+  open_timer->stop(__LINE__);
+  open_timer->count(0, 1);
+  if(in_fd < 0) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", in_fn,
+            strerror(errno));
+    exit(1);
+  }
+  hints = new readhints(in_fd, 0, file.get_filesize());
+  extents = file.get_extents();
+  extent = 0;
+  extent_pos = 0;
+  if(!extents.empty() && file.is_sparse() &&
+     lseek(in_fd, off_t(extents[0].offset), SEEK_SET) == -1) {
+    fprintf(stderr, "Could not seek '%s' to %zu: %s\n", in_fn,
+            extents[0].offset, strerror(errno));
+    exit(1);
+  }
+  return true;
+}
+
+void prefetcher::close_file()
+{
+  if(in_fd < 0)
+    return;
+  open_timer->start(__LINE__);
+  hints->done();
+  delete hints;
+  hints = NULL;
+  const int ierr_close = ::close(in_fd);
+  assert(ierr_close == 0);
+  open_timer->stop(__LINE__);
+  in_fd = -1;
+}
@@ -0,0 +1,121 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef PREFETCHER_HH_
+#define PREFETCHER_HH_
+
+#include <stddef.h>
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "tarentry.hh"
+#include "iopolicy.hh"
+#include "timer.hh"
+
+// reads the data of queued files in a second thread
+// Copying a file means reading it and then writing it, so without help the
+// output is idle while the input is read and the other way round. The files
+// of the jobs a worker has taken are added here, and while the worker writes
+// one buffer a thread that calls run() reads the next files into another, so
+// copying goes as fast as the slower of the two rather than at their combined
+// rate. Small files are packed into one buffer. Without a thread running the
+// data is read by get() itself.
+class prefetcher
+{
+  public:
+  // buffers of bufsize_ bytes each, reads are timed by read_timer and opens
+  // by open_timer
+  prefetcher(const size_t bufsize_, timer *open_timer_, timer *read_timer_);
+  ~prefetcher();
+
+  // queues the data of a file, files without any are skipped
+  void add(const tarentry &ent);
+  // no more files will be added
+  void close();
+
+  // reading thread: reads everything added until close()
+  void run();
+
+  // the next up to size bytes of data of the queued files in order, the
+  // pointer stays valid until the next call
+  const char *get(const size_t size, size_t *got);
+
+  private:
+  struct chunk {
+    char *buf;
+    size_t size;
+  };
+
+  // reads into a free buffer and hands it to get(), false once all files
+  // have been read, from_get when called by get() without a reading thread
+  bool fill(const bool from_get);
+  // opens the next queued file, optionally waiting for one to be added
+  bool open_next(const bool wait);
+  void close_file();
+
+  const size_t bufsize;
+  timer *open_timer;
+  timer *read_timer;
+  std::vector<char*> bufs;
+
+  // shared between the threads, protected by lock
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<tarentry> files;
+  std::vector<char*> free_bufs;
+  std::deque<chunk> full;
+  bool closed;
+  bool threaded;
+  // the chunk get() is handing out
+  chunk current;
+  size_t current_pos;
+
+  // the reader's file, only used while holding reading
+  std::mutex reading;
+  tarentry file;
+  int in_fd;
+  readhints *hints;
+  std::vector<tar_extent> extents;
+  size_t extent;
+  size_t extent_pos;
+
+  // no copies, we own the buffers
+  prefetcher(const prefetcher&);
+  prefetcher &operator=(const prefetcher&);
+};
+
+#endif // PREFETCHER_HH_
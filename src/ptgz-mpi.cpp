@@ -8,21 +8,47 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <fstream>
 #include <sstream>
 #include <queue>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include <utility>
 #include <limits>
 
-#include "mpitar.hh"
+#include "tarappender.hh"
+#include "blockwriter.hh"
+#include "dictionary.hh"
+#include "extractor.hh"
+#include "workqueue.hh"
+#include "memberindex.hh"
+#include "numaplace.hh"
+#include "pathtable.hh"
+#include "tarentry.hh"
+#include "timer.hh"
+#include "trace.hh"
 
 #include "omp.h"
 #include "mpi.h"
+#include "zlib.h"
 
 int root = 0;
 int globalRank, globalSize;
+// Bytes copied at a time when a block is copied out of the archive.
+const uint64_t copyBufferSize = 4ul * 1024ul * 1024ul;
+// Widths of the plan line and of a block record in the progress journal.
+const uint64_t journalPlanSize = 26;
+const int journalRecordSize = 56;
+
+// Phases of compression and extraction, reported with -t.
+timer timer_walk("walk"), timer_sort("sort"), timer_lists("lists");
+timer timer_index("index"), timer_compress("compress"), timer_aggregate("aggregate");
+timer timer_decompress("decompress"), timer_metadata("metadata");
+timer timer_cleanup("cleanup");
 
 // Contains the various options the user can pass ptgz.
 // Members: 
@@ -34,6 +60,15 @@ int globalRank, globalSize;
 //      remote (bool) whether the directory is cwd.
 //      directory (std::string) name of the remote directory.
 //	    verify (bool) whether ptgz should verify the compressed archive.
+//	    timing (bool) whether ptgz should report phase timers.
+//	    deferMetadata (bool) whether file metadata is applied after extraction.
+//	    sortMemory (uint64_t) bytes the file list sort may use, 0 for no limit.
+//	    resume (bool) whether to continue an interrupted compression.
+//	    dictionary (bool) whether blocks are compressed with a trained dictionary.
+//	    dereference (bool) whether symlinks are archived as what they point to.
+//	    numa (bool) whether ranks, threads and buffers are placed on NUMA nodes.
+//	    level (int) compression level of blocks compressed in-process.
+//	    traceFile (std::string) name of the trace file to write, if any.
 //	    name (std::string) name of archive to make or extract.
 struct Settings {
 	Settings(): extract(),
@@ -43,6 +78,15 @@ struct Settings {
 				output(),
 				verify(),
 				remote(),
+				timing(),
+				deferMetadata(),
+				sortMemory(),
+				resume(),
+				dictionary(),
+				dereference(),
+				numa(),
+				level(6),
+				traceFile(),
 				name() {}
 	bool extract;
 	bool compress;
@@ -52,6 +96,15 @@ struct Settings {
 	bool remote;
 	std::string directory;
 	bool verify;
+	bool timing;
+	bool deferMetadata;
+	uint64_t sortMemory;
+	bool resume;
+	bool dictionary;
+	bool dereference;
+	bool numa;
+	int level;
+	std::string traceFile;
 	std::string name;
 };
 
@@ -74,20 +127,39 @@ void helpCheck(int argc, char *argv[]) {
 		std::cout << "    If you are compressing, your current working directory should be parent directory of all directories you\n";
 		std::cout << "    want to archive unless the (-d) flag is enabled. If you are extracting, your current working directory\n";
 		std::cout << "    should be the same as your archive." << std::endl;
-		std::cout << "    ptgz [-c|-d </path/to/directory>|-k|-v|-x|-W] <archive>\n" << std::endl;
+		std::cout << "    ptgz [-c|-d </path/to/directory>|-D|-k|-L|-M <MiB>|-n|-r|-t|-P <trace.json>|-v|-x|-W|-Z] <archive>\n" << std::endl;
 		std::cout << "    Modes:\n";
 		std::cout << "    -c    Compression           Will perform file compression. The current directory and all of it's\n";
 		std::cout << "                                children will be archived and added to a single tarball. <archive> will be \n";
 		std::cout << "                                prefix of the ptgz archive created.\n" << std::endl;
 		std::cout << "    -d    Remote Directory      ptgz will compress and bundle a specified directory from a provided path.\n" << std::endl;
+		std::cout << "    -D    Defer Metadata        Sets owner, mode and times of extracted files in one parallel pass once all\n";
+		std::cout << "                                data is written instead of after each file. (-x) must also be used.\n" << std::endl;
 		std::cout << "    -k    Keep Archive          Does not delete the ptgz archive it has been passed to extract. (-x) must\n";
 		std::cout << "                                also be used to use this option.\n" << std::endl;
 		std::cout << "    -l    Set Level             Instruct ptgz to use a specific compression level. Value must be from 1 to 9;\n";
 		std::cout << "                                1 is low compression, fast speed and 9 is high compression, low speed.\n" << std::endl;
+		std::cout << "    -L    Dereference           Archives the files and directories symlinks point to instead of the\n";
+		std::cout << "                                symlinks. (-c) must also be used. Also --dereference.\n" << std::endl;
+		std::cout << "    -M    Sort Memory           Limits the memory used to sort the file list to the given number of MiB.\n";
+		std::cout << "                                Larger lists are sorted in runs spilled to $TMPDIR (default /tmp) and merged.\n" << std::endl;
+		std::cout << "    -n    NUMA Placement        Spreads the ranks of each host over its NUMA nodes, pins every thread to\n";
+		std::cout << "                                the CPUs of its rank's node and allocates its buffers there.\n" << std::endl;
+		std::cout << "    -r    Resume                Continues an interrupted compression with the same <archive> name from\n";
+		std::cout << "                                its journal, compressing only the blocks that are missing. (-c) must also\n";
+		std::cout << "                                be used. Also --resume.\n" << std::endl;
+		std::cout << "    -t    Enable Timing         Prints min, max, mean and imbalance over ranks and threads, and the\n";
+		std::cout << "                                throughput, of every phase when done.\n" << std::endl;
+		std::cout << "    -P    Write Trace           Records every timed operation of every rank and thread and writes them to\n";
+		std::cout << "                                the given file in trace-event JSON format for Perfetto or chrome://tracing.\n" << std::endl;
 		std::cout << "    -v    Enable Verbose        Will print the commands as they are called to STDOUT\n" << std::endl;
 		std::cout << "    -x    Extraction            Signals for file extraction from an archive. The passed ptgz archive will be\n";
 		std::cout << "                                unpacked and split int64_to its component files. <archive> should be the name of\n";
 		std::cout << "                                the archive to extract.\n" << std::endl;
+		std::cout << "    -Z    Dictionary            Trains a deflate dictionary on a sample of the small files, stores it in\n";
+		std::cout << "                                the archive and compresses every block with it in-process. Helps trees of\n";
+		std::cout << "                                many small similar files. Its blocks are named *.ptgz.tar.zz and can only\n";
+		std::cout << "                                be extracted by ptgz; the *.sh script only says so.\n" << std::endl;
 		std::cout << "    -W    Verify Archive        Attempts to verify the archive after writing it.\n" << std::endl;
 		exit(0);
 	}
@@ -126,8 +198,26 @@ void getSettings(int argc, char *argv[], Settings *instance) {
 			(*instance).output = true;
 		} else if (arg == "-k") {
 			(*instance).keep = true;
+		} else if (arg == "-M") {
+			settings.pop();
+			(*instance).sortMemory = std::stoull(settings.front()) << 20;
+		} else if (arg == "-r" || arg == "--resume") {
+			(*instance).resume = true;
+		} else if (arg == "-L" || arg == "--dereference") {
+			(*instance).dereference = true;
+		} else if (arg == "-n") {
+			(*instance).numa = true;
+		} else if (arg == "-D") {
+			(*instance).deferMetadata = true;
+		} else if (arg == "-Z") {
+			(*instance).dictionary = true;
 		} else if (arg == "-W") {
 			(*instance).verify = true;
+		} else if (arg == "-t") {
+			(*instance).timing = true;
+		} else if (arg == "-P") {
+			settings.pop();
+			(*instance).traceFile = settings.front();
 		} else if (arg == "-d") {
 			(*instance).remote = true;
 			settings.pop();
@@ -136,6 +226,7 @@ void getSettings(int argc, char *argv[], Settings *instance) {
 			settings.pop();
 			int64_t level = std::stoi(settings.front());
 			if (level >= 1 && level <= 9) {
+				(*instance).level = level;
 				if (setenv("GZIP", ("-" + settings.front()).c_str(), 1) < 0) {
 					perror("ERROR: GZIP could not be set.\n");
 					exit(1);
@@ -161,83 +252,326 @@ void getSettings(int argc, char *argv[], Settings *instance) {
 		exit(1);
 	} else if ((*instance).keep && !(*instance).extract) {
 		perror("ERROR: Can't use keep option without extract. \"ptgz -h\" for help.\n");
+	} else if ((*instance).dictionary && !(*instance).compress) {
+		perror("ERROR: Can't use dictionary option without compress. \"ptgz -h\" for help.\n");
+		exit(1);
+	} else if ((*instance).dereference && !(*instance).compress) {
+		perror("ERROR: Can't use dereference option without compress. \"ptgz -h\" for help.\n");
+		exit(1);
+	} else if ((*instance).resume && !(*instance).compress) {
+		perror("ERROR: Can't use resume option without compress. \"ptgz -h\" for help.\n");
+		exit(1);
+	} else if ((*instance).deferMetadata && !(*instance).extract) {
+		perror("ERROR: Can't use defer metadata option without extract. \"ptgz -h\" for help.\n");
+		exit(1);
 	}
 }
 
-bool isLink(std::string fileName) {
-	struct stat buf;
-	int x;
-	const char* filePtr = fileName.c_str();
-
-	x = lstat (filePtr, &buf);
-	if (S_ISLNK(buf.st_mode)) {
-		return true;
-	} else {
-		return false;
+// Gets and returns the number of bytes of a file that are archived, which is
+// its size or, for sparse files, the size of its allocated blocks. tar stores
+// no data for symlinks and other special files.
+// Parameters: st (const struct stat &) status of the file.
+uint64_t getFileSize(const struct stat &st) {
+	if (!S_ISREG(st.st_mode)) {
+		return 0;
 	}
+	return std::min(static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_blocks) * 512);
 }
 
-// Gets and returns the size of a file
-// Parameters: filename (std::string) name of the file whose size to find.
-uint64_t getFileSize(std::string fileName) {
-		try {
-			const char *filePtr = fileName.c_str();
-			struct stat st;
-			if (stat(filePtr, &st) != 0) {
-				return 0;
-			}
-			return static_cast<uint64_t>(st.st_size);
-		} catch(...) {
-			return 0;
-		}
-	}
+// Adds a file to the file list along with the status the walk found, which
+// is all that is needed to index it later.
+// Parameters: filePaths (pathtable *) holder for all file paths.
+// 			   dir (uint32_t) id of the directory of the file in filePaths.
+// 			   name (const char *) base name of the file.
+// 			   st (const struct stat &) status of the file.
+void addFile(pathtable *filePaths, uint32_t dir, const char *name, const struct stat &st) {
+	filePaths->add_file(dir, name, getFileSize(st), st.st_mode, st.st_mtime, st.st_size);
+}
 
 // Gets the paths for all files in the space to store.
-// Parameters: filePaths (std::vector<std::string> *) holder for all file paths.
+// Symlinks are added as they are, as tar stores them as links, unless
+// dereference is set. Then the files and directories they point to are added
+// in their place, except directories that are already being walked, which
+// would never end, and symlinks that point nowhere.
+// Further names of files with several hard links are added as links to the
+// first one.
+// Parameters: filePaths (pathtable *) holder for all file paths.
 // 			   cwd (const char *) current working directory.
-// 			   rootPath (std::string) path from the root of the directory to be stored.
-void getPaths(std::vector<std::pair<uint64_t, std::string>> *filePaths, const char *cwd, std::string rootPath) {
-	DIR *dir;
+// 			   dir (uint32_t) id of cwd in filePaths.
+// 			   inodes (std::map<std::pair<dev_t, ino_t>, uint32_t> *) files with several hard links seen so far.
+// 			   dereference (bool) whether to follow symlinks.
+// 			   parents (std::set<std::pair<dev_t, ino_t>> *) directories being walked, when dereferencing.
+void getPaths(pathtable *filePaths, const char *cwd, uint32_t dir, std::map<std::pair<dev_t, ino_t>, uint32_t> *inodes, bool dereference, std::set<std::pair<dev_t, ino_t>> *parents) {
+	DIR *dir1;
 	struct dirent *ent;
 
 	// Check if cwd is a directory
-	if ((dir = opendir(cwd)) != NULL) {
+	if ((dir1 = opendir(cwd)) != NULL) {
+		std::pair<dev_t, ino_t> self(0, 0);
+		struct stat dirSt;
+		if (dereference && stat(cwd, &dirSt) == 0) {
+			self = std::make_pair(dirSt.st_dev, dirSt.st_ino);
+			parents->insert(self);
+		}
 		// Get all file paths within directory.
 		int64_t num = 0;
-		while ((ent = readdir (dir)) != NULL) {
-			std::string fileBuff = std::string(ent -> d_name);
-			if (fileBuff != "." && fileBuff != "..") {
+		while ((ent = readdir (dir1)) != NULL) {
+			if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
 				if (num == 0) {
 					num++;
 				}
 				DIR *dir2;
-				std::string filePath = std::string(cwd) + "/" + fileBuff;
+				std::string filePath = std::string(cwd) + "/" + ent->d_name;
+				struct stat st;
+				int err = dereference ? stat(filePath.c_str(), &st) : lstat(filePath.c_str(), &st);
 				// Check if file path is a directory.
 				if ((dir2 = opendir(filePath.c_str())) != NULL) {
 					closedir(dir2);
-					if (isLink(filePath)) {
-						filePaths->push_back(std::make_pair(0, rootPath + fileBuff));
+					if (!dereference && err == 0 && S_ISLNK(st.st_mode)) {
+						addFile(filePaths, dir, ent->d_name, st);
+					} else if (dereference && err == 0 && parents->count(std::make_pair(st.st_dev, st.st_ino))) {
+						std::cout << "ERROR: " + filePath + " is a file system loop, skipping it\n";
 					} else {
-						getPaths(filePaths, filePath.c_str(), rootPath + fileBuff + "/");
+						getPaths(filePaths, filePath.c_str(), filePaths->add_dir(dir, ent->d_name), inodes, dereference, parents);
 					}
 				} else {
-					std::string fullPath = rootPath + fileBuff;
-					filePaths->push_back(std::make_pair(getFileSize(fullPath), fullPath));
+					// tar cannot follow a symlink that points nowhere either.
+					if (dereference && err != 0 && lstat(filePath.c_str(), &st) == 0 && S_ISLNK(st.st_mode)) {
+						std::cout << "ERROR: " + filePath + " is a dangling symlink, skipping it\n";
+						continue;
+					}
+					if (err == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+						std::pair<dev_t, ino_t> inode(st.st_dev, st.st_ino);
+						if (inodes->count(inode)) {
+							filePaths->add_link(dir, ent->d_name, inodes->at(inode));
+							continue;
+						}
+						(*inodes)[inode] = filePaths->size();
+					}
+					if (err == 0) {
+						addFile(filePaths, dir, ent->d_name, st);
+					} else {
+						filePaths->add_file(dir, ent->d_name, 0);
+					}
 				}
 			}
 		}
 		if (num == 0) {
-			filePaths->push_back(std::make_pair(0, rootPath));
+			struct stat emptySt;
+			if ((dereference ? stat(cwd, &emptySt) : lstat(cwd, &emptySt)) == 0) {
+				addFile(filePaths, dir, "", emptySt);
+			} else {
+				filePaths->add_file(dir, "", 0);
+			}
+		}
+		if (dereference) {
+			parents->erase(self);
+		}
+		closedir(dir1);
+	}
+}
+
+// Computes the number of bytes a file takes up in the tar stream of its block.
+// This uses the status the walk recorded, only files with holes are looked at
+// again for their data extents.
+// Returns 0 if the file could not be indexed.
+// Parameters: filePaths (pathtable *) holder for all file paths.
+//             file (uint64_t) number of the file in filePaths.
+//             fileName (std::string) path of the file as passed to tar.
+//             linkTarget (const std::string *) path of the file this name is a
+//             hard link to, NULL for the first name of a file.
+//             offset (uint64_t) offset of the file within its block.
+uint64_t memberSize(pathtable *filePaths, uint64_t file, std::string fileName, const std::string *linkTarget, uint64_t offset) {
+	uint32_t mode = filePaths->mode(file);
+	if (mode == 0) {
+		std::cout << "ERROR: Could not index " + fileName + "\n";
+		return 0;
+	}
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	st.st_mode = mode;
+	st.st_mtime = filePaths->mtime(file);
+	st.st_size = filePaths->length(file);
+	// files with holes are archived as their allocated blocks
+	st.st_blocks = filePaths->filesize(file) / 512;
+	if (linkTarget != NULL) {
+		// tar stores later names of a file it has already seen as links
+		return tarentry::member_size(fileName, st, linkTarget->size(), true);
+	} else if (S_ISREG(mode) && filePaths->filesize(file) < uint64_t(st.st_size)) {
+		tarentry ent(fileName, offset, st);
+		return ent.size();
+	}
+	return tarentry::member_size(fileName, st, S_ISLNK(mode) ? st.st_size : 0, false);
+}
+
+// Writes the binary member index of the archive. Its entries are streamed to
+// disk in path order, walking the directories of filePaths, so that no copy
+// of the paths is kept.
+// Parameters: filePaths (pathtable *) holder for all file paths.
+//             fileName (std::string) name of the index file.
+//             numBlocks (uint64_t) number of blocks.
+//             offsets (std::vector<uint64_t> *) offset of every file and link
+//             within its block, numbered as by pathtable::path_order.
+//             tarSizes (std::vector<uint64_t> *) size of every file and link
+//             in the tar stream, 0 for the ones that could not be indexed.
+void writeIndex(pathtable *filePaths, std::string fileName, uint64_t numBlocks, std::vector<uint64_t> *offsets, std::vector<uint64_t> *tarSizes) {
+	uint64_t count = tarSizes->size() - std::count(tarSizes->begin(), tarSizes->end(), 0);
+	std::vector<uint32_t> order;
+	filePaths->path_order(&order);
+	memberindex_stream bidx(fileName.c_str(), count, numBlocks);
+	for (uint64_t i = 0; i < order.size(); ++i) {
+		uint64_t member = order[i];
+		if (tarSizes->at(member) == 0) {
+			continue;
 		}
-		closedir(dir);
+		bool link = member >= filePaths->size();
+		uint64_t file = link ? filePaths->link_file(member - filePaths->size()) : member;
+		std::string path = link ? filePaths->link_path(member - filePaths->size()) : filePaths->path(member);
+		// tar strips leading slashes from member names
+		path.erase(0, path.find_first_not_of('/'));
+		uint32_t mode = filePaths->mode(file);
+		uint64_t size = !link && S_ISREG(mode) ? filePaths->length(file) : 0;
+		bidx.add(path, file % numBlocks, offsets->at(member), size, tarSizes->at(member), mode, filePaths->mtime(file));
 	}
+	bidx.finish();
+}
+
+// Computes the size and CRC-32 of a file.
+// Returns false if the file could not be read.
+// Parameters: fileName (std::string) name of the file.
+//             size (uint64_t *) size of the file.
+//             crc (uint32_t *) CRC-32 of the content of the file.
+bool fileChecksum(std::string fileName, uint64_t *size, uint32_t *crc) {
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	std::vector<unsigned char> buf(1 << 20);
+	uLong sum = crc32(0L, Z_NULL, 0);
+	*size = 0;
+	ssize_t got;
+	while ((got = read(fd, &buf[0], buf.size())) != 0) {
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			close(fd);
+			return false;
+		}
+		sum = crc32(sum, &buf[0], uInt(got));
+		*size += got;
+	}
+	close(fd);
+	*crc = uint32_t(sum);
+	return true;
+}
+
+// Offset of the record of a block in the progress journal. The plan and every
+// record have a fixed width, so that each block has its own slot which any
+// rank can write with MPI-IO at an explicit offset, without relying on the
+// file system to keep appends of different clients apart.
+// Parameters: block (uint64_t) number of the block.
+uint64_t journalOffset(uint64_t block) {
+	return journalPlanSize + block * journalRecordSize;
+}
+
+// Starts the progress journal of a compression with the number of planned
+// blocks and an empty record for each. The block lists and name.bidx must be
+// on disk before.
+// Parameters: name (std::string) user given name for storage file.
+//             numBlocks (uint64_t) number of blocks of the plan.
+void startJournal(std::string name, uint64_t numBlocks) {
+	char line[journalRecordSize + 1];
+	snprintf(line, sizeof(line), "plan %020lu\n", (unsigned long)numBlocks);
+	std::string plan = line;
+	for (uint64_t i = 0; i < numBlocks; ++i) {
+		snprintf(line, sizeof(line), "todo %020lu %020lu %08x\n", (unsigned long)i, 0ul, 0u);
+		plan += line;
+	}
+	int fd = open((name + ".ptgz.journal").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write(fd, plan.c_str(), plan.size()) != ssize_t(plan.size()) || fsync(fd) != 0) {
+		std::cout << "ERROR: Could not write " + name + ".ptgz.journal: " + strerror(errno) + "\n";
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	close(fd);
+}
+
+// Records a compressed block in its slot of the progress journal.
+// Parameters: journal (MPI_File) journal opened by all ranks.
+//             block (uint64_t) number of the block.
+//             size (uint64_t) size of the compressed block.
+//             crc (uint32_t) CRC-32 of the compressed block.
+void journalBlock(MPI_File journal, uint64_t block, uint64_t size, uint32_t crc) {
+	char line[journalRecordSize + 1];
+	snprintf(line, sizeof(line), "done %020lu %020lu %08x\n", (unsigned long)block, (unsigned long)size, crc);
+	int ierr;
+	// the same section as in workqueue::next()
+	#pragma omp critical(mpi)
+	ierr = MPI_File_write_at(journal, MPI_Offset(journalOffset(block)), line, journalRecordSize, MPI_CHAR, MPI_STATUS_IGNORE);
+	if (ierr != MPI_SUCCESS) {
+		std::cout << "ERROR: Could not record block " + std::to_string(block) + " in the journal\n";
+	}
+}
+
+// Names the compressed file of a block. Blocks compressed with a dictionary
+// are zlib streams that neither gzip nor tar can read, so they get their own
+// suffix.
+// Parameters: block (uint64_t) number of the block.
+//             name (std::string) user given name for storage file.
+//             useDictionary (bool) whether blocks are compressed with a dictionary.
+std::string blockName(uint64_t block, std::string name, bool useDictionary) {
+	return std::to_string(block) + "." + name + (useDictionary ? ".ptgz.tar.zz" : ".ptgz.tar.gz");
+}
+
+// Reads the progress journal of an interrupted compression and checks the
+// blocks it records against their size and CRC-32.
+// Returns the number of planned blocks, 0 if there is no journal.
+// Parameters: name (std::string) user given name for storage file.
+//             useDictionary (bool) whether blocks are compressed with a dictionary.
+//             doneBlocks (std::vector<char> *) set to 1 for complete blocks.
+uint64_t readJournal(std::string name, bool useDictionary, std::vector<char> *doneBlocks) {
+	std::ifstream journal(name + ".ptgz.journal");
+	std::string word;
+	uint64_t numBlocks = 0;
+	if (!(journal >> word >> numBlocks) || word != "plan") {
+		return 0;
+	}
+	std::vector<std::pair<uint64_t, std::pair<uint64_t, uint32_t>>> recorded;
+	uint64_t block, size;
+	std::string crc;
+	while (journal >> word >> block >> size >> crc) {
+		if (word == "done" && block < numBlocks) {
+			recorded.push_back(std::make_pair(block, std::make_pair(size, uint32_t(std::stoul(crc, NULL, 16)))));
+		}
+	}
+
+	doneBlocks->assign(numBlocks, 0);
+	#pragma omp parallel for schedule(dynamic)
+	for (uint64_t i = 0; i < recorded.size(); ++i) {
+		uint64_t fileSize;
+		uint32_t fileCrc;
+		if (fileChecksum(blockName(recorded[i].first, name, useDictionary), &fileSize, &fileCrc) &&
+				fileSize == recorded[i].second.first && fileCrc == recorded[i].second.second) {
+			doneBlocks->at(recorded[i].first) = 1;
+		}
+	}
+	return numBlocks;
 }
 
 // Makes manual extraction script.
+// Blocks compressed with a dictionary can only be read by ptgz, so their
+// script only says so.
 // Parameters: name (std::string) name of the ptgz archive.
-void makeScript(std::string name) {
+//             useDictionary (bool) whether blocks are compressed with a dictionary.
+void makeScript(std::string name, bool useDictionary) {
 	std::ofstream script (name + ".sh");
-	if (script.is_open()) {
+	if (script.is_open() && useDictionary) {
+		script << "#!/bin/bash\n";
+		script << "\n";
+		script << "echo \"The *.ptgz.tar.zz blocks of this archive are compressed with the dictionary " + name + ".dict\" >&2\n";
+		script << "echo \"and can only be extracted with: ptgz -x " + name + ".ptgz.tar\" >&2\n";
+		script << "exit 1\n";
+	} else if (script.is_open()) {
 		script << "#!/bin/bash\n";
 		script << "\n";
 		script << "for TARGZ in *.ptgz.tar.gz\n";
@@ -298,17 +632,145 @@ int execute(char *const command[]) {
 	return status;
 }
 
+// Extracts a .ptgz.tar.gz block of an archive made before blocks were
+// extracted in-process. The block is copied out of the 1st layer tar ball
+// and unpacked by tar, as ptgz did back then.
+// Parameters: tarFd (int) file descriptor of the 1st layer tar ball.
+//             tarName (std::string) name of the 1st layer tar ball.
+//             archiveName (std::string) name of the block.
+//             offset (uint64_t) start of the data of the block in the tar ball.
+//             size (uint64_t) size of the block.
+//             verbose (bool) user option for verbose output.
+// Returns true if the block was extracted.
+bool extractLegacyBlock(int tarFd, std::string tarName, std::string archiveName, uint64_t offset, uint64_t size, bool verbose) {
+	int fd = open(archiveName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		std::cout << "ERROR: Could not create " + archiveName + ": " + strerror(errno) + "\n";
+		return false;
+	}
+	std::vector<char> buffer(std::min(size, copyBufferSize));
+	for (uint64_t done = 0; done < size; ) {
+		size_t chunk = std::min(size - done, uint64_t(buffer.size()));
+		pread_all(tarFd, tarName.c_str(), buffer.data(), chunk, offset + done);
+		if (write(fd, buffer.data(), chunk) != ssize_t(chunk)) {
+			std::cout << "ERROR: Could not write " + archiveName + ": " + strerror(errno) + "\n";
+			close(fd);
+			remove(archiveName.c_str());
+			return false;
+		}
+		done += chunk;
+	}
+	close(fd);
+
+	char *tarCommand[] = {
+		strToChar("tar"),
+		strToChar("-x"),
+		strToChar("-z"),
+		strToChar("-f"),
+		strToChar(archiveName),
+		NULL
+	};
+	if (verbose) {
+		printCommand(tarCommand, 5);
+	}
+	int status = execute(tarCommand);
+	for (int i = 0; i < 5; ++i) {
+		delete[] tarCommand[i];
+	}
+	if (status != 0) {
+		std::cout << "ERROR: tar could not extract " + archiveName + "\n";
+	}
+	if (remove(archiveName.c_str())) {
+		std::cout << "ERROR: " + archiveName + " could not be removed.\n";
+	}
+	return status == 0;
+}
+
+// Writes the sections of all ranks to a file, in rank order.
+// Collective, every rank passes its own section which may be empty.
+// Parameters: fileName (std::string) name of the file to create.
+// 			   section (std::string) bytes of this rank.
+void writeShared(std::string fileName, const std::string &section) {
+	uint64_t size = section.size();
+	uint64_t offset = 0;
+	uint64_t total = 0;
+	MPI_Exscan(&size, &offset, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+	if (globalRank == root) {
+		offset = 0;
+	}
+	MPI_Allreduce(&size, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+	// Collective writes are limited to INT_MAX bytes each, so every rank makes
+	// as many calls as the rank with the largest section needs.
+	const uint64_t chunkSize = 1ul << 30;
+	uint64_t chunks = (size + chunkSize - 1) / chunkSize;
+	uint64_t maxChunks = 0;
+	MPI_Allreduce(&chunks, &maxChunks, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+
+	MPI_File fh;
+	int ierr = MPI_File_open(MPI_COMM_WORLD, fileName.c_str(), MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh);
+	if (ierr == MPI_SUCCESS) {
+		ierr = MPI_File_set_size(fh, total);
+	}
+	for (uint64_t i = 0; ierr == MPI_SUCCESS && i < maxChunks; ++i) {
+		uint64_t start = i * chunkSize < size ? i * chunkSize : size;
+		uint64_t count = size - start < chunkSize ? size - start : chunkSize;
+		ierr = MPI_File_write_at_all(fh, offset + start, section.data() + start, int(count), MPI_CHAR, MPI_STATUS_IGNORE);
+	}
+	if (ierr != MPI_SUCCESS) {
+		std::cout << "ERROR: Could not write " + fileName + ".\n";
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_File_close(&fh);
+}
+
+// Trains a deflate dictionary on evenly spaced samples of the small files.
+// Parameters: filePaths (pathtable *) file list sorted by size.
+// 			   dictName (std::string) name of the dictionary file to write.
+void trainDictionary(pathtable *filePaths, std::string dictName) {
+	const uint64_t maxSampleSize = 64 * 1024;
+	const uint64_t maxSamples = 4096;
+	uint64_t firstSmall = 0;
+	while (firstSmall < filePaths->size() && filePaths->filesize(firstSmall) > maxSampleSize) {
+		++firstSmall;
+	}
+	uint64_t smallFiles = filePaths->size() - firstSmall;
+	uint64_t stride = smallFiles > maxSamples ? smallFiles / maxSamples : 1;
+
+	dictionary trainer;
+	std::vector<std::string> samples;
+	std::vector<size_t> sampleSizes;
+	for (uint64_t i = firstSmall; i < filePaths->size(); i += stride) {
+		if (filePaths->filesize(i) > 0) {
+			samples.push_back(filePaths->path(i));
+			sampleSizes.push_back(filePaths->filesize(i));
+		}
+	}
+	// The samples are read by all threads, and only as many as are used.
+	trainer.add_files(samples, sampleSizes);
+	// Headers make up much of a block of small files.
+	struct stat st;
+	if (!samples.empty() && lstat(samples[0].c_str(), &st) == 0) {
+		std::vector<char> header = tarentry(samples[0], 0, st).make_tar_header();
+		trainer.set_tail(std::string(header.begin(), header.end()));
+	}
+	dictionary::save(dictName, trainer.train());
+}
+
 // Divides files into blocks.
-// Compresses each block into a single file.
-// Combines all compressed blocks into a single file.
-// Removes temporary blocks and header files.
-// Parameters: filePaths (std::vector<std::string> *) holder for all file paths.
+// Writes the list of files of each block, name.bidx and the journal plan.
+// Returns the names of the compressed blocks, which are only set on root.
+// Parameters: filePaths (pathtable *) holder for all file paths.
 // 			   name (std::string) user given name for storage file.
-// 			   verbose (bool) user option for verbose output.
-//			   verify (bool) user option for tar archive verification.
-void compression(std::vector<std::pair<uint64_t, std::string>> *filePaths, std::string name, bool verbose, bool verify, int numThreads) {
+//			   sortMemory (uint64_t) user option for the sort memory budget.
+//			   useDictionary (bool) user option for training a dictionary.
+std::vector<std::string> *planBlocks(pathtable *filePaths, std::string name, uint64_t sortMemory, bool useDictionary, int numThreads) {
 	if (globalRank == root) {
-		std::sort(filePaths->rbegin(), filePaths->rend());
+		timer_sort.start(__LINE__);
+		const char *scratch = getenv("TMPDIR");
+		filePaths->sort_by_size(sortMemory, scratch != NULL ? scratch : "/tmp");
+		timer_sort.stop(__LINE__);
+		timer_sort.count(0, filePaths->size());
 	}
 
 	// Send the total number of files to all ranks.
@@ -321,10 +783,6 @@ void compression(std::vector<std::pair<uint64_t, std::string>> *filePaths, std::
 
 	int64_t numBlocks = numThreads * 10 * globalSize;
 	uint64_t blockSize;
-	int64_t *sendSizes = new int64_t[globalSize * 2];
-	int64_t reserved = 0;
-	int64_t tarBlock;
-	int64_t *localSize = new int64_t[2];
 
 	// Get blockSize and set tarName vector size.
 	if (filePathSize % numBlocks == 0) {
@@ -341,154 +799,336 @@ void compression(std::vector<std::pair<uint64_t, std::string>> *filePaths, std::
 
 	if (globalRank == root) {
 		// Write all files to text files.
+		// Index each file by its block and offset within the block.
+		timer_lists.start(__LINE__);
+		timer_lists.count(0, filePaths->size());
+		// Offsets and sizes are kept per file and link, numbered as by
+		// pathtable::path_order, for the index written once all are known.
+		std::vector<uint64_t> *offsets = new std::vector<uint64_t>(filePaths->size() + filePaths->links());
+		std::vector<uint64_t> *tarSizes = new std::vector<uint64_t>(offsets->size());
+		// Hard links go to the end of the block of the file they are another
+		// name of, so that tar stores them as links and extraction finds the
+		// file in place when it gets to them.
+		std::vector<std::vector<uint64_t>> *blockLinks = new std::vector<std::vector<uint64_t>>(tarNames->size());
+		for (uint64_t k = 0; k < filePaths->links(); ++k) {
+			blockLinks->at(filePaths->link_file(k) % tarNames->size()).push_back(k);
+		}
 		#pragma omp parallel for schedule(static)
 		for (uint64_t i = 0; i < tarNames->size(); ++i) {
 			if (i < filePaths->size()) {
 				std::ofstream tmp;
-				tmp.open(std::to_string(i) + "." + name + ".ptgz.tmp", std::ios_base::app);
+				uint64_t offset = 0;
+				tmp.open(std::to_string(i) + "." + name + ".ptgz.tmp", std::ios_base::trunc);
 				for (uint64_t j = i; j < filePaths->size(); j += tarNames->size()) {
-					tmp << filePaths->at(j).second + "\n";
+					std::string filePath = filePaths->path(j);
+					tmp << filePath + "\n";
+					offsets->at(j) = offset;
+					tarSizes->at(j) = memberSize(filePaths, j, filePath, NULL, offset);
+					offset += tarSizes->at(j);
+				}
+				for (uint64_t k = 0; k < blockLinks->at(i).size(); ++k) {
+					uint64_t link = blockLinks->at(i)[k];
+					uint64_t file = filePaths->link_file(link);
+					std::string filePath = filePaths->link_path(link);
+					std::string target = filePaths->path(file);
+					tmp << filePath + "\n";
+					offsets->at(filePaths->size() + link) = offset;
+					tarSizes->at(filePaths->size() + link) = memberSize(filePaths, file, filePath, &target, offset);
+					offset += tarSizes->at(filePaths->size() + link);
 				}
 				tmp.close();
-				tarNames->at(i) = std::to_string(i) + "." + name + ".ptgz.tar.gz";
+				tarNames->at(i) = blockName(i, name, useDictionary);
 			}
 		}
+		delete(blockLinks);
+		writeIndex(filePaths, name + ".bidx", tarNames->size(), offsets, tarSizes);
+		delete(offsets);
+		delete(tarSizes);
+		if (useDictionary) {
+			trainDictionary(filePaths, name + ".dict");
+		}
 		filePaths->clear();
-		delete(filePaths);
 
-		// Get tar archive block size.
-		if (tarNames->size() % globalSize == 0) {
-			tarBlock = tarNames->size() / globalSize;
-		} else {
-			tarBlock = tarNames->size() / globalSize + 1;
-		}
+		// The plan is only recorded once everything it refers to is on disk.
+		sync();
+		startJournal(name, tarNames->size());
+		timer_lists.stop(__LINE__);
+	}
 
-		// Set blocks for each rank.
-		for (int64_t i = 0; i < globalSize * 2; i += 2) {
-			sendSizes[i] = reserved;
-			reserved += tarBlock;
-			if (reserved <= tarNames->size()) {
-				sendSizes[i + 1] = tarBlock;
-			} else {
-				sendSizes[i + 1] = tarBlock - (reserved - tarNames->size());
-			}
+	return tarNames;
+}
+
+// Finds the contiguous range of blocks of this rank when blocks are split
+// evenly over all ranks by their number.
+// Parameters: numBlocks (uint64_t) total number of blocks.
+//             first (uint64_t *) first block of this rank.
+//             count (uint64_t *) number of blocks of this rank.
+void blockRange(uint64_t numBlocks, uint64_t *first, uint64_t *count) {
+	uint64_t perRank = (numBlocks + globalSize - 1) / globalSize;
+	*first = std::min(numBlocks, perRank * globalRank);
+	*count = std::min(perRank, numBlocks - *first);
+}
+
+// Reloads the plan of an interrupted compression from its journal.
+// Returns the names of the compressed blocks.
+// Parameters: name (std::string) user given name for storage file.
+//             useDictionary (bool) whether blocks are compressed with a dictionary.
+//             doneBlocks (std::vector<char> *) set to 1 for every block that
+//             is already compressed.
+std::vector<std::string> *resumeBlocks(std::string name, bool useDictionary, std::vector<char> *doneBlocks) {
+	uint64_t numTars = 0;
+	if (globalRank == root) {
+		timer_lists.start(__LINE__);
+		numTars = readJournal(name, useDictionary, doneBlocks);
+		if (numTars == 0) {
+			std::cout << "ERROR: No journal to resume from in " + name + ".ptgz.journal\n";
+			MPI_Abort(MPI_COMM_WORLD, 1);
 		}
+		std::cout << "Resuming: " + std::to_string(std::count(doneBlocks->begin(), doneBlocks->end(), 1)) + " of " + std::to_string(numTars) + " blocks already compressed.\n";
+		timer_lists.stop(__LINE__);
 	}
+	MPI_Bcast(&numTars, 1, MPI_UINT64_T, root, MPI_COMM_WORLD);
+	doneBlocks->resize(numTars);
+	MPI_Bcast(&doneBlocks->at(0), numTars, MPI_CHAR, root, MPI_COMM_WORLD);
 
-	// Send blocks to all ranks
-	sync();
-	MPI_Scatter(sendSizes, 2, MPI_INT64_T, localSize, 2, MPI_INT64_T, root, MPI_COMM_WORLD);
+	std::vector<std::string> *tarNames = new std::vector<std::string>(numTars);
+	for (uint64_t i = 0; i < numTars; ++i) {
+		tarNames->at(i) = blockName(i, name, useDictionary);
+	}
+	return tarNames;
+}
 
-	// Write tar index file
-	for (int64_t i = 0; i < globalSize; ++i) {
-		if (globalRank == i) {
-			std::ofstream oFile(name + ".idx", std::ios::out | std::ios::app);
-			for (int64_t j = localSize[0]; j < localSize[0] + localSize[1]; ++j) {
-				oFile << "---- " + std::to_string(j) + "." + name + ".ptgz.tar.gz ----\n\n";
-				std::ifstream iFile(std::to_string(j) + "." + name + ".ptgz.tmp", std::ios::in);
-				if (iFile.is_open()) {
-					oFile << iFile.rdbuf();
-				} else {
-					std::cout << "ERROR: Could not add block " + std::to_string(j) + "\n";
-				}
-				oFile << "\n";
-			}
-			oFile.close();
-		}
-		MPI_Barrier(MPI_COMM_WORLD);
+// Divides files into blocks, or continues from the journal of an interrupted
+// run.
+// Compresses each block into a single file.
+// Combines all compressed blocks into a single file.
+// Removes temporary blocks and header files.
+// Returns the number of blocks that could not be compressed on any rank, the
+// archive is only finished if there are none.
+// Parameters: filePaths (pathtable *) holder for all file paths.
+// 			   name (std::string) user given name for storage file.
+// 			   verbose (bool) user option for verbose output.
+//			   verify (bool) user option for tar archive verification.
+//			   sortMemory (uint64_t) user option for the sort memory budget.
+//			   resume (bool) user option for continuing from the journal.
+//			   useDictionary (bool) user option for compressing with a dictionary.
+//			   level (int) user option for the compression level.
+//			   dereference (bool) user option for following symlinks.
+int64_t compression(pathtable *filePaths, std::string name, bool verbose, bool verify, uint64_t sortMemory, bool resume, bool useDictionary, int level, bool dereference, int numThreads) {
+	std::vector<std::string> *tarNames;
+	std::vector<char> *doneBlocks = new std::vector<char>();
+	// A resumed run keeps using the dictionary it started with.
+	if (resume) {
+		useDictionary = access((name + ".dict").c_str(), F_OK) == 0;
+		tarNames = resumeBlocks(name, useDictionary, doneBlocks);
+	} else {
+		tarNames = planBlocks(filePaths, name, sortMemory, useDictionary, numThreads);
+		doneBlocks->assign(tarNames->size(), 0);
 	}
 
-	// Build tar archives for each block; largest to smallest.
+	// The block lists are written by root, and each rank formats and removes
+	// a contiguous range of blocks.
+	sync();
+	MPI_Barrier(MPI_COMM_WORLD);
+	uint64_t firstBlock, localBlocks;
+	blockRange(tarNames->size(), &firstBlock, &localBlocks);
+
+	// Per block sizes for reporting.
+	memberindex blockIndex;
+	bool haveBlockIndex = blockIndex.open((name + ".bidx").c_str());
+
+	// Write tar index file
+	// Every rank formats the lists of its blocks in memory, finds where its
+	// section starts from the sizes of the sections of lower ranks and writes it
+	// in one collective step.
+	timer_index.start(__LINE__);
+	std::vector<std::string> *sections = new std::vector<std::string>(localBlocks);
 	#pragma omp parallel for schedule(dynamic)
-	for (int64_t i = 0; i < localSize[1] + 2; ++i) {
-		int64_t archiveNum;
-		if (i % 2) {
-			archiveNum = (globalSize - (globalRank + 1)) + globalSize * i;
+	for (uint64_t j = 0; j < localBlocks; ++j) {
+		std::ifstream iFile(std::to_string(firstBlock + j) + "." + name + ".ptgz.tmp", std::ios::in);
+		std::stringstream section;
+		section << "---- " + blockName(firstBlock + j, name, useDictionary) + " ----\n\n";
+		if (iFile.is_open()) {
+			section << iFile.rdbuf();
 		} else {
-			archiveNum = globalRank + globalSize * i;
-		}
-		if (archiveNum < tarNames->size()) {
-			char* const gzCommand[] = {
-				"tar",
-				"-c",
-				"-z",
-				"-T",
-				strToChar(std::to_string(archiveNum) + "." + name + ".ptgz.tmp"),
-				"-f",
-				strToChar(std::to_string(archiveNum) + "." + name + ".ptgz.tar.gz"),
-				(char *) NULL
-			};
-			if (verbose) {
-				printCommand(gzCommand, 7);
-			}
-			execute(gzCommand);
-			delete[] gzCommand[4];
-			delete[] gzCommand[6];
+			std::cout << "ERROR: Could not add block " + std::to_string(firstBlock + j) + "\n";
 		}
+		section << "\n";
+		sections->at(j) = section.str();
 	}
+	std::string localIndex;
+	for (uint64_t j = 0; j < localBlocks; ++j) {
+		localIndex += sections->at(j);
+	}
+	delete(sections);
+	writeShared(name + ".idx", localIndex);
+	timer_index.stop(__LINE__);
+	timer_index.count(0, localBlocks);
+
+	// Order the blocks by uncompressed size, largest first. Every rank computes
+	// the same order from name.bidx, or keeps the block order without it.
+	std::vector<std::pair<uint64_t, uint64_t>> *weights = new std::vector<std::pair<uint64_t, uint64_t>>();
+	for (uint64_t i = 0; i < tarNames->size(); ++i) {
+		uint64_t rawSize = 0;
+		if (haveBlockIndex && i < blockIndex.nblocks()) {
+			rawSize = blockIndex.block(i).rawsize;
+		}
+		weights->push_back(std::make_pair(rawSize, i));
+	}
+	std::sort(weights->rbegin(), weights->rend());
 
-	sync();
-	MPI_Barrier(MPI_COMM_WORLD);
-
-	if (globalRank == root) {
-		// Combines gzipped blocks together into a single tarball.
-		// Write tarball names into an idx file for extraction.
-		std::ofstream idx, tmp;
-		idx.open(name + ".ptgz.idx", std::ios_base::app);
-		char* const tarCommand[] = {
-			"mpirun",
-			"-np",
-			strToChar(std::to_string(numThreads * globalSize - globalSize)),
-			"mpitar",
+	// Build tar archives for each block; largest to smallest. Every thread of
+	// every rank takes the next block from a shared queue until none are left.
+	// Finished blocks are recorded in the journal so that an interrupted run
+	// can be resumed, and appended to the ptgz.tar archive right away, in the
+	// order they finish, so that writing the archive overlaps compression.
+	// Blocks done by an interrupted run are only appended.
+	blockwriter *writer = NULL;
+	if (useDictionary) {
+		writer = new blockwriter(dictionary::load(name + ".dict"), level, dereference);
+	}
+	MPI_File journal;
+	if (MPI_File_open(MPI_COMM_WORLD, (name + ".ptgz.journal").c_str(), MPI_MODE_WRONLY, MPI_INFO_NULL, &journal) != MPI_SUCCESS) {
+		std::cout << "ERROR: Could not open " + name + ".ptgz.journal\n";
+		journal = MPI_FILE_NULL;
+	}
+	tarappender *archive = new tarappender(name + ".ptgz.tar", MPI_COMM_WORLD, root);
+	workqueue *queue = new workqueue(weights->size(), MPI_COMM_WORLD, root);
+	int64_t localFailed = 0;
+	#pragma omp parallel
+	for (int64_t i = queue->next(); i >= 0; i = queue->next()) {
+		int64_t archiveNum = weights->at(i).second;
+		// Use the same pax layout as tarentry so the offsets in name.bidx hold,
+		// which stores only the data of sparse files in GNU sparse format 1.0
+		// and symlinks as links unless told to follow them.
+		char* const gzCommand[] = {
+			"tar",
+			"--no-recursion",
+			"--format=pax",
+			"--sparse",
+			"--pax-option",
+			"delete=?time",
+			"--pax-option",
+			"exthdr.name=%d/%f.paxhdr",
 			"-c",
-			"-f",
-			strToChar(name + ".ptgz.tar"),
+			"-z",
 			"-T",
-			strToChar(name + ".ptgz.idx"),
+			strToChar(std::to_string(archiveNum) + "." + name + ".ptgz.tmp"),
+			"-f",
+			strToChar(blockName(archiveNum, name, useDictionary)),
+			dereference ? (char *) "--dereference" : (char *) NULL,
 			(char *) NULL
 		};
-		for (uint64_t i = 0; i < tarNames->size(); ++i) {
-			idx << tarNames->at(i) + "\n";
+		bool compressed = false;
+		if (!doneBlocks->at(archiveNum)) {
+			if (verbose && writer != NULL) {
+				std::cout << "compress(" + std::string(gzCommand[11]) + ", " + std::string(gzCommand[13]) + ")\n";
+			} else if (verbose) {
+				printCommand(gzCommand, dereference ? 15 : 14);
+			}
+			timer_compress.start(__LINE__);
+			int status;
+			if (writer != NULL) {
+				status = writer->write(gzCommand[11], gzCommand[13]) ? 0 : 1;
+			} else {
+				status = execute(gzCommand);
+			}
+			timer_compress.stop(__LINE__, archiveNum);
+			compressed = status == 0;
+			if (haveBlockIndex && uint64_t(archiveNum) < blockIndex.nblocks()) {
+				timer_compress.count(blockIndex.block(archiveNum).rawsize, blockIndex.block(archiveNum).count);
+			}
 		}
-		idx << name + ".ptgz.idx\n";
-		makeScript(name);
-		idx << name + ".sh\n";
-		idx << name + ".idx\n";
-		idx.close();
-		
-		if (verbose) {
-			printCommand(tarCommand, 9);
+
+		// A block that failed is left out of the archive and the journal, so
+		// that a run resumed with -r compresses it again.
+		if (!doneBlocks->at(archiveNum) && !compressed) {
+			std::cout << "ERROR: Could not compress block " + std::to_string(archiveNum) + "\n";
+			#pragma omp atomic
+			localFailed++;
+			delete[] gzCommand[11];
+			delete[] gzCommand[13];
+			continue;
 		}
 
-		delete[] tarCommand[2];
-		delete[] tarCommand[6];
-		delete[] tarCommand[8];
+		if (verbose) {
+			std::cout << "append(" + std::string(gzCommand[13]) + ", " + name + ".ptgz.tar)\n";
+		}
+		timer_aggregate.start(__LINE__);
+		uint32_t crc;
+		size_t size;
+		size_t appended = archive->add(gzCommand[13], &crc, &size);
+		timer_aggregate.stop(__LINE__, archiveNum);
+		timer_aggregate.count(appended, 1);
+		// The block is recorded with the checksum of what was copied into the
+		// archive, which spares reading it once more.
+		if (compressed && journal != MPI_FILE_NULL) {
+			journalBlock(journal, archiveNum, size, crc);
+		}
+		delete[] gzCommand[11];
+		delete[] gzCommand[13];
+	}
+	delete(queue);
+	delete(writer);
+	if (journal != MPI_FILE_NULL) {
+		MPI_File_close(&journal);
+	}
+	weights->clear();
+	delete(weights);
+	delete(doneBlocks);
+	blockIndex.close();
+
+	// Without all blocks the archive is not finished, and the blocks, their
+	// lists and the journal are kept for a run with -r.
+	int64_t failed = 0;
+	MPI_Allreduce(&localFailed, &failed, 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+	if (failed > 0) {
+		if (globalRank == root) {
+			std::cout << "ERROR: " + std::to_string(failed) + " blocks could not be compressed. Run again with -r to compress them.\n";
+			delete(tarNames);
+		}
+		delete(archive);
+		timer::print_timers();
+		trace::write();
+		MPI_Finalize();
+		return failed;
 	}
 
-	sync();
-	MPI_Barrier(MPI_COMM_WORLD);
-
-	char *mpitarCommand[] = {"mpitar", 
-							 "-c", 
-							 "-f", 
-							 strToChar(name + ".ptgz.tar"), 
-							 "-T", 
-							 strToChar(name + ".ptgz.idx"), 
-							 NULL};
-
-	mpitar(6, mpitarCommand);
-	MPI_Barrier(MPI_COMM_WORLD);
-
-	delete[] mpitarCommand[3];
-	delete[] mpitarCommand[5];
+	// Write tarball names into an idx file for extraction and add it, the
+	// script and the indices after the blocks.
+	std::vector<std::string> *extraNames = new std::vector<std::string>();
+	if (globalRank == root) {
+		std::ofstream idx;
+		idx.open(name + ".ptgz.idx", std::ios_base::trunc);
+		for (uint64_t i = 0; i < tarNames->size(); ++i) {
+			idx << tarNames->at(i) + "\n";
+		}
+		extraNames->push_back(name + ".ptgz.idx");
+		makeScript(name, useDictionary);
+		extraNames->push_back(name + ".sh");
+		extraNames->push_back(name + ".idx");
+		extraNames->push_back(name + ".bidx");
+		if (useDictionary) {
+			extraNames->push_back(name + ".dict");
+		}
+		for (uint64_t i = 0; i < extraNames->size(); ++i) {
+			idx << extraNames->at(i) + "\n";
+		}
+		idx.close();
+	}
 
-	sync();
-	MPI_Barrier(MPI_COMM_WORLD);
+	timer_aggregate.start(__LINE__);
+	archive->finish(*extraNames);
+	timer_aggregate.stop(__LINE__);
+	delete(archive);
+	delete(extraNames);
 
 	// Removes all temporary blocks.
+	timer_cleanup.start(__LINE__);
+	timer_cleanup.count(0, localBlocks);
 	#pragma omp parallel for schedule(static)
-	for (uint64_t i = localSize[0]; i < localSize[0] + localSize[1]; ++i) {
-		std::string rmCommand = std::to_string(i) + "." + name + ".ptgz.tar.gz";
+	for (uint64_t i = firstBlock; i < firstBlock + localBlocks; ++i) {
+		std::string rmCommand = blockName(i, name, useDictionary);
 		if (verbose) {
 			std::cout << "remove(" + rmCommand + ")\n";
 		}
@@ -505,9 +1145,6 @@ void compression(std::vector<std::pair<uint64_t, std::string>> *filePaths, std::
 		}
 	}
 
-	delete(sendSizes);
-	delete(localSize);
-
 	if (globalRank == root) {
 		// Removes idx file.
 		std::string rmCommand;
@@ -524,196 +1161,193 @@ void compression(std::vector<std::pair<uint64_t, std::string>> *filePaths, std::
 		if (remove((name + ".idx").c_str())) {
 			std::cout << "ERROR: " + name + ".idx could not be removed.\n";
 		}
+		if (remove((name + ".bidx").c_str())) {
+			std::cout << "ERROR: " + name + ".bidx could not be removed.\n";
+		}
 		if (remove((name + ".ptgz.tar.idx").c_str())) {
 			std::cout << "ERROR: " + name + ".ptgz.tar.idx could not be removed\n";
 		}
+		if (remove((name + ".ptgz.tar.bidx").c_str())) {
+			std::cout << "ERROR: " + name + ".ptgz.tar.bidx could not be removed\n";
+		}
+		if (remove((name + ".ptgz.journal").c_str())) {
+			std::cout << "ERROR: " + name + ".ptgz.journal could not be removed\n";
+		}
+		if (useDictionary && remove((name + ".dict").c_str())) {
+			std::cout << "ERROR: " + name + ".dict could not be removed\n";
+		}
 
 		tarNames->clear();
 		delete(tarNames);
 	}
+	timer_cleanup.stop(__LINE__);
+
+	timer::print_timers();
+	trace::write();
 	MPI_Finalize();
+	return 0;
 }
 
 // Unpacks the archive.
-// Reads in all the files from the index file.
-// Unpacks each file.
-// Deletes all temporary file blocks and header files.
+// Finds all blocks in the binary index of the ptgz.tar archive.
+// Extracts the files of each block directly from the archive, largest block
+// first, taking blocks from a queue shared by all ranks.
+// Deletes the archive unless it should be kept.
+// Returns the number of members that could not be extracted on any rank.
 // Parameters: name (std::string) name of ptgz archive file.
 // 			   verbose (bool) user option for verbose output.
 // 			   keep (bool) user option for keeping ptgz archive.
-void extraction(std::string name, bool verbose, bool keep, int numThreads) {
+// 			   deferMetadata (bool) user option for applying file metadata last.
+int64_t extraction(std::string name, bool verbose, bool keep, bool deferMetadata, int numThreads) {
 	// Get the name from the name of the 1st layer tarball
 	for (int64_t i = 0; i < 9; ++i) {
 		name.pop_back();
 	}
-
-	int64_t numArchives;
-
-	if (globalRank == root) {
-		// Unpack index from the 1st layer tar ball
-		char* const exCommand[] = {
-			"tar",
-			"-x",
-			"-f",
-			strToChar(name + ".ptgz.tar"),
-			strToChar(name + ".ptgz.idx"),
-			(char *) NULL
-		};
-		if (verbose) {
-			printCommand(exCommand, 5);
-		}
-		execute(exCommand);
-		delete[] exCommand[3];
-		delete[] exCommand[4];
-
-		// Get number of archives and delete index.
-		std::ifstream idx;
-		std::string line;
-		numArchives = 0;
-		idx.open(name + ".ptgz.idx", std::ios_base::in);
-		while (std::getline(idx, line)) {
-			++numArchives;
-		}
-		numArchives -= 3; // There are three extra files in the index file.
-		idx.close();
-		std::string idxRmCommand = name + ".ptgz.idx";
-		if (verbose) {
-			std::cout << "remove(" + idxRmCommand + ")\n";
-		}
-		if (remove(idxRmCommand.c_str())) {
-			std::cout << "ERROR: " + idxRmCommand + " could not be removed.\n";
-		}
+	std::string tarName = name + ".ptgz.tar";
+
+	// Every rank maps the binary index mpitar stored at the end of the
+	// 1st layer tar ball to find the blocks in it. Archives made before
+	// there was one only have the text index.
+	timer_index.start(__LINE__);
+	int tarFd = open(tarName.c_str(), O_RDONLY);
+	if (tarFd < 0) {
+		std::cout << "ERROR: Could not open " + tarName + ": " + strerror(errno) + "\n";
+		MPI_Abort(MPI_COMM_WORLD, 1);
 	}
-
-	int64_t blockSize;
-	int64_t *sendBlocks = new int64_t[globalSize * 2];
-	int64_t *localBlock = new int64_t[2];
-
-	if (globalRank == root) {
-		// Define block size
-		if (numArchives % globalSize == 0) {
-			blockSize = numArchives / globalSize;
+	memberindex tarIndex;
+	size_t indexOffset = 0;
+	bool legacy = !memberindex::find_in_tar(tarFd, tarName.c_str(), &indexOffset);
+	std::unordered_map<std::string, size_t> legacyIndex;
+	if (legacy) {
+		memberindex::text_in_tar(tarFd, tarName.c_str(), &legacyIndex);
+	} else if (!tarIndex.open(tarName.c_str(), indexOffset)) {
+		std::cout << "ERROR: Could not map the index of " + tarName + ": " + strerror(errno) + "\n";
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	// Offset and size of the data of each block in the 1st layer tar ball.
+	// Archives with a dictionary name their blocks apart.
+	const memberindex_entry *dictEnt = legacy ? NULL : tarIndex.find(name + ".dict");
+	std::vector<std::pair<uint64_t, uint64_t>> blockData;
+	for (;;) {
+		std::string archiveName = blockName(blockData.size(), name, dictEnt != NULL);
+		size_t dataOffset, dataSize;
+		if (legacy) {
+			std::unordered_map<std::string, size_t>::const_iterator it = legacyIndex.find(archiveName);
+			if (it == legacyIndex.end()) {
+				break;
+			}
+			tar_member_data(tarFd, tarName.c_str(), it->second, &dataOffset, &dataSize);
 		} else {
-			blockSize = numArchives / globalSize + 1;
-		}
-
-		// Define blocks for each node.
-		int64_t reserved = 0;
-		for (int64_t i = 0; i < globalSize * 2; i += 2) {
-			sendBlocks[i] = reserved;
-			reserved += blockSize;
-			if (reserved <= numArchives) {
-				sendBlocks[i + 1] = blockSize;
-			} else {
-				sendBlocks[i + 1] = blockSize - (reserved - numArchives);
+			const memberindex_entry *ent = tarIndex.find(archiveName);
+			if (ent == NULL) {
+				break;
 			}
+			// the data follows the headers, which are all there is besides padding
+			dataOffset = ent->offset + ent->tarsize - ((ent->size + 511) & ~uint64_t(511));
+			dataSize = ent->size;
 		}
+		blockData.push_back(std::make_pair(dataOffset, dataSize));
 	}
-
-	// Send each node their block
-	MPI_Scatter(sendBlocks, 2, MPI_INT64_T, localBlock, 2, MPI_INT64_T, root, MPI_COMM_WORLD);
-	// printf("Process %d, %d, %d\n", globalRank, localBlock[0], localBlock[1]);
-
-	// Extract compressed archives from ptgz.tar archive
-	#pragma omp parallel for schedule(dynamic)
-	for (uint64_t i = localBlock[0]; i < localBlock[0] + localBlock[1]; ++i) {
-		char* const tarCommand[] = {
-			"tar",
-			"-x",
-			"-f",
-			strToChar(name + ".ptgz.tar"),
-			strToChar(std::to_string(i) + "." + name + ".ptgz.tar.gz"),
-			(char *) NULL
-		};
-		execute(tarCommand);
-		delete[] tarCommand[3];
-		delete[] tarCommand[4];
-	}
-
-	sync();
-	MPI_Barrier(MPI_COMM_WORLD);
-
-	// Fill weights vector and sort by file size descending
-	std::vector<std::pair<uint64_t, std::string>> *weights = new std::vector<std::pair<uint64_t, std::string>>(localBlock[1]);
-	#pragma omp parallel for schedule(static)
-	for (uint64_t i = 0; i < localBlock[1]; ++i) {
-		std::string archiveName = std::to_string(i + localBlock[0]) + "." + name + ".ptgz.tar.gz";
-		weights->at(i) = std::make_pair(getFileSize(archiveName), archiveName);
+	int64_t numArchives = blockData.size();
+
+	// Order the blocks by uncompressed size, largest first, from the per block
+	// totals in name.bidx, which is stored in the archive. Archives without it
+	// fall back to the compressed size. Every rank computes the same order.
+	std::vector<std::pair<uint64_t, uint64_t>> *weights = new std::vector<std::pair<uint64_t, uint64_t>>(numArchives);
+	memberindex blockIndex;
+	const memberindex_entry *bidxEnt = legacy ? NULL : tarIndex.find(name + ".bidx");
+	bool haveBlockIndex = bidxEnt != NULL &&
+		blockIndex.open(tarName.c_str(), bidxEnt->offset + bidxEnt->tarsize - ((bidxEnt->size + 511) & ~uint64_t(511))) &&
+		blockIndex.nblocks() == uint64_t(numArchives);
+	for (int64_t i = 0; i < numArchives; ++i) {
+		if (haveBlockIndex) {
+			weights->at(i) = std::make_pair(blockIndex.block(i).rawsize, i);
+		} else {
+			weights->at(i) = std::make_pair(blockData[i].second, i);
+		}
 	}
+	blockIndex.close();
 	std::sort(weights->rbegin(), weights->rend());
-
-	// Unpack each .ptgz.tar.gz file.
-	#pragma omp parallel for schedule(dynamic)
-	for (uint64_t i = 0; i < weights->size(); ++i) {
-		char* const gzCommand[] = {
-			"tar",
-			"-x",
-			"-z",
-			"--null",
-			"-f",
-			strToChar(weights->at(i).second),
-			(char *) NULL
-		};
-		if (verbose) {
-			printCommand(gzCommand, 6);
-		}
-		execute(gzCommand);
-		delete[] gzCommand[5];
+	timer_index.stop(__LINE__);
+
+	// Extract the files of each .ptgz.tar.gz block straight from the archive.
+	// Every thread of every rank takes the next largest block from a shared
+	// queue until none are left.
+	extractor unpacker(deferMetadata);
+	if (dictEnt != NULL) {
+		std::vector<char> dict(dictEnt->size);
+		pread_all(tarFd, tarName.c_str(), dict.data(), dict.size(), dictEnt->offset + dictEnt->tarsize - ((dictEnt->size + 511) & ~uint64_t(511)));
+		unpacker.set_dictionary(std::string(dict.begin(), dict.end()));
 	}
-
-	// Double check unpacking.
-	#pragma omp parallel for schedule(dynamic)
-	for (uint64_t i = 0; i < weights->size(); ++i) {
-		// std::string gzCommand = "tar -x -k -z --null -f " + weights->at(i).second;
-		char* const gzCommand[] = {
-			"tar",
-			"-x",
-			"-k",
-			"-z",
-			"--null",
-			"-f",
-			strToChar(weights->at(i).second),
-			(char *) NULL
-		};
+	int64_t legacyErrors = 0;
+	workqueue *queue = new workqueue(numArchives, MPI_COMM_WORLD, root);
+	#pragma omp parallel
+	for (int64_t i = queue->next(); i >= 0; i = queue->next()) {
+		uint64_t block = weights->at(i).second;
+		std::string archiveName = blockName(block, name, dictEnt != NULL);
 		if (verbose) {
-			printCommand(gzCommand, 7);
+			std::cout << "extract(" + archiveName + ")\n";
+		}
+		timer_decompress.start(__LINE__);
+		uint64_t rawSize = 0;
+		if (!legacy) {
+			rawSize = unpacker.extract(tarFd, tarName.c_str(), blockData[block].first, blockData[block].second);
+		} else if (!extractLegacyBlock(tarFd, tarName, archiveName, blockData[block].first, blockData[block].second, verbose)) {
+			#pragma omp atomic
+			++legacyErrors;
 		}
-		execute(gzCommand);
-		delete[] gzCommand[6];
+		timer_decompress.stop(__LINE__, block);
+		timer_decompress.count(rawSize, 1);
 	}
+	delete(queue);
 
-	delete(sendBlocks);
-	delete(localBlock);
-
-	// Delete each .ptgz.tar.gz file
-	#pragma omp parallel for schedule(static)
-	for (uint64_t i = 0; i < weights->size(); ++i) {
-		std::string gzRmCommand = weights->at(i).second;
-		if (verbose) {
-			std::cout << "remove(" + gzRmCommand + ")\n";
-		}
-		if (remove(gzRmCommand.c_str())) {
-			std::cout << "ERROR: " + gzRmCommand + " could not be removed.\n";
-		}
+	// Directory times may only be set once no rank writes into them anymore.
+	// Directories go from the deepest up in lockstep across ranks since a
+	// directory that loses write or search permission on one rank would
+	// block its subdirectories that another rank has not done yet.
+	MPI_Barrier(MPI_COMM_WORLD);
+	timer_metadata.start(__LINE__);
+	size_t updated = unpacker.finish_files();
+	uint64_t localLevels = unpacker.dir_levels();
+	uint64_t levels = 0;
+	MPI_Allreduce(&localLevels, &levels, 1, MPI_UINT64_T, MPI_MAX, MPI_COMM_WORLD);
+	for (uint64_t level = levels; level-- > 0; ) {
+		updated += unpacker.finish_dirs(level);
+		MPI_Barrier(MPI_COMM_WORLD);
 	}
-	
+	timer_metadata.stop(__LINE__);
+	timer_metadata.count(0, updated);
+
+	int64_t localErrors = unpacker.errors() + legacyErrors;
+	int64_t errors = 0;
+	MPI_Allreduce(&localErrors, &errors, 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+	if (globalRank == root && errors > 0) {
+		std::cout << "ERROR: " + std::to_string(errors) + " errors during extraction.\n";
+	}
+
+	timer_cleanup.start(__LINE__);
+	tarIndex.close();
+	close(tarFd);
 	if (globalRank == root) {
 		// Decided whether or not to keep the ptgz.tar archive
 		if (!keep) {
-			std::string tarRmCommand = name + ".ptgz.tar";
 			if (verbose) {
-				std::cout << "remove(" + tarRmCommand + ")\n";
+				std::cout << "remove(" + tarName + ")\n";
 			}
-			if (remove(tarRmCommand.c_str())) {
-				std::cout << "ERROR: " + tarRmCommand + " could not be removed.\n";
+			if (remove(tarName.c_str())) {
+				std::cout << "ERROR: " + tarName + " could not be removed.\n";
 			}
 		}
 	}
+	timer_cleanup.stop(__LINE__);
 
 	// End message passing and clean up
+	timer::print_timers();
+	trace::write();
 	MPI_Finalize();
 	weights->clear();
 	delete(weights);
+	return errors;
 }
 
 char cwd [PATH_MAX];
@@ -725,10 +1359,19 @@ char cwd [PATH_MAX];
 // Either compresses the files or extracts the ptgz.tar archive.
 int main(int argc, char *argv[]) {
 	// Start messsage passing
-	MPI_Init(NULL, NULL);
+	// Threads take work items from a shared MPI window one at a time.
+	int provided;
+	MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &provided);
 	MPI_Comm_rank(MPI_COMM_WORLD, &globalRank);
 	MPI_Comm_size(MPI_COMM_WORLD, &globalSize);
+	if (provided < MPI_THREAD_SERIALIZED) {
+		if (globalRank == root) {
+			std::cout << "ERROR: The MPI library does not support calls from more than one thread.\n";
+		}
+		MPI_Abort(MPI_COMM_WORLD, 1);
+	}
 	Settings *instance = new Settings;
+	int status = 0;
 	int numThreads = omp_get_max_threads();
 	omp_set_num_threads(numThreads);
 	
@@ -736,6 +1379,13 @@ int main(int argc, char *argv[]) {
 		helpCheck(argc, argv);
 	}
 	getSettings(argc, argv, instance);
+	timer::enable((*instance).timing);
+	if ((*instance).numa && !numaplace::enable(MPI_COMM_WORLD) && globalRank == root) {
+		std::cout << "ERROR: NUMA placement is not available, ignoring -n.\n";
+	}
+	if (!(*instance).traceFile.empty()) {
+		trace::enable((*instance).traceFile);
+	}
 	
 	if ((*instance).remote) {
 		strcpy(cwd, (*instance).directory.c_str());
@@ -744,26 +1394,36 @@ int main(int argc, char *argv[]) {
 	}
 
 	if ((*instance).compress) {
-		std::vector<std::pair<uint64_t, std::string>> *filePaths = new std::vector<std::pair<uint64_t, std::string>>();
-		if (globalRank == root) {
-			if ((*instance).remote) {
-				getPaths(filePaths, cwd, cwd);
-			} else {
-				getPaths(filePaths, cwd, "");
+		pathtable *filePaths = new pathtable((*instance).remote ? cwd : "");
+		if (globalRank == root && !(*instance).resume) {
+			timer_walk.start(__LINE__);
+			std::map<std::pair<dev_t, ino_t>, uint32_t> *inodes = new std::map<std::pair<dev_t, ino_t>, uint32_t>();
+			std::set<std::pair<dev_t, ino_t>> *parents = new std::set<std::pair<dev_t, ino_t>>();
+			getPaths(filePaths, cwd, 0, inodes, (*instance).dereference, parents);
+			delete(parents);
+			delete(inodes);
+			timer_walk.stop(__LINE__);
+			if (timer::is_enabled()) {
+				timer_walk.count(filePaths->total_size(), filePaths->size());
 			}
 			if ((*instance).verbose) {
-				for (uint64_t i = 0; i < (*filePaths).size(); i++) {
-					std::cout << (*filePaths).at(i).second + "\n";
+				for (uint64_t i = 0; i < filePaths->size(); i++) {
+					std::cout << filePaths->path(i) + "\n";
 				}
 			}
 		}
 		MPI_Barrier(MPI_COMM_WORLD);
-		compression(filePaths, (*instance).name, (*instance).verbose, (*instance).verify, numThreads);
+		if (compression(filePaths, (*instance).name, (*instance).verbose, (*instance).verify, (*instance).sortMemory, (*instance).resume, (*instance).dictionary, (*instance).level, (*instance).dereference, numThreads) > 0) {
+			status = 1;
+		}
+		delete(filePaths);
 	} else {
 		MPI_Barrier(MPI_COMM_WORLD);
-		extraction((*instance).name, (*instance).verbose, (*instance).keep, numThreads);
+		if (extraction((*instance).name, (*instance).verbose, (*instance).keep, (*instance).deferMetadata, numThreads) > 0) {
+			status = 1;
+		}
 	}
 
 	delete(instance);
-	return 0;
+	return status;
 }
@@ -0,0 +1,283 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "tarappender.hh"
+#include "memberindex.hh"
+#include "iopolicy.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define COPY_SIZE (4ul*1024ul*1024ul)
+
+namespace {
+void pwrite_all(int fd, const char *fn, const char *buf, size_t sz,
+                size_t off)
+{
+  while(sz > 0) {
+    const ssize_t written = pwrite(fd, buf, sz, off_t(off));
+    if(written < 0 && errno == EINTR)
+      continue;
+    if(written <= 0) {
+      fprintf(stderr, "Could not write %zu bytes to '%s' at %zu: %s\n", sz,
+              fn, off, strerror(errno));
+      exit(1);
+    }
+    buf += written;
+    sz -= size_t(written);
+    off += size_t(written);
+  }
+}
+
+bool by_offset(const tarentry &a, const tarentry &b)
+{
+  return a.get_offset() < b.get_offset();
+}
+}
+
+tarappender::tarappender(const std::string &fn_, MPI_Comm comm_,
+                         const int owner_) :
+  fn(fn_), comm(comm_), owner(owner_), fd(-1), end(0)
+{
+  MPI_Comm_rank(comm, &rank);
+  // everybody else opens the file only once the owner truncated it
+  if(rank == owner) {
+    fd = open(fn.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0666);
+  }
+  MPI_Barrier(comm);
+  if(rank != owner) {
+    fd = open(fn.c_str(), O_WRONLY);
+  }
+  if(fd < 0) {
+    fprintf(stderr, "Could not open '%s' for writing: %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  const int ierr = MPI_Win_create(&end, rank == owner ? sizeof(end) : 0,
+                                  sizeof(end), MPI_INFO_NULL, comm, &win);
+  if(ierr != MPI_SUCCESS) {
+    fprintf(stderr, "Could not create archive offset window: %d\n", ierr);
+    exit(1);
+  }
+}
+
+tarappender::~tarappender()
+{
+  MPI_Win_free(&win);
+}
+
+size_t tarappender::claim(const size_t sz)
+{
+  const uint64_t want = sz;
+  uint64_t off = 0;
+  // the same section as in workqueue::next()
+  #pragma omp critical(mpi)
+  {
+    MPI_Win_lock(MPI_LOCK_SHARED, owner, 0, win);
+    MPI_Fetch_and_op(&want, &off, MPI_UINT64_T, owner, 0, MPI_SUM, win);
+    MPI_Win_unlock(owner, win);
+  }
+  return size_t(off);
+}
+
+size_t tarappender::add(const std::string &member_fn, uint32_t *crc,
+                        size_t *datasize)
+{
+  struct stat st;
+  if(lstat(member_fn.c_str(), &st) != 0) {
+    fprintf(stderr, "Could not stat '%s': %s\n", member_fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  const size_t sz = tarentry(member_fn, 0, st).size();
+  const tarentry ent(member_fn, claim(sz), st);
+  write_member(ent, crc);
+  if(datasize)
+    *datasize = ent.get_filesize();
+  #pragma omp critical(tarappender)
+  added.push_back(ent);
+  return sz;
+}
+
+void tarappender::write_member(const tarentry &ent, uint32_t *crc) const
+{
+  uLong sum = crc32(0L, Z_NULL, 0);
+  if(crc)
+    *crc = uint32_t(sum);
+  const std::vector<char> hdr(ent.make_tar_header());
+  pwrite_all(fd, fn.c_str(), &hdr[0], hdr.size(), ent.get_offset());
+  if(!ent.is_reg() || ent.is_hardlink())
+    return;
+
+  const char *in_fn = ent.get_filename().c_str();
+  const int in_fd = open(in_fn, O_RDONLY);
+  if(in_fd < 0) {
+    fprintf(stderr, "Could not open '%s' for reading: %s\n", in_fn,
+            strerror(errno));
+    exit(1);
+  }
+  readhints hints(in_fd, 0, ent.get_filesize());
+  writeback wb(fd, ent.get_offset());
+  // the padding up to the next block is left as a hole, it reads as zeros
+  size_t data_off = ent.get_offset() + ent.header_size();
+  const std::vector<char> map(ent.make_sparse_map());
+  if(!map.empty())
+    pwrite_all(fd, fn.c_str(), &map[0], map.size(), data_off);
+  data_off += map.size();
+  const std::vector<tar_extent> extents(ent.get_extents());
+  std::vector<char> buf(std::min(size_t(COPY_SIZE), ent.get_datasize()));
+  for(size_t e = 0 ; e < extents.size() ; e++) {
+    const tar_extent &ext = extents[e];
+    for(size_t done = 0 ; done < ext.size ; ) {
+      const ssize_t read_sz = pread(in_fd, &buf[0],
+                                    std::min(buf.size(), ext.size-done),
+                                    off_t(ext.offset+done));
+      if(read_sz < 0 && errno == EINTR)
+        continue;
+      if(read_sz <= 0) {
+        fprintf(stderr, "Could not read from '%s': %s\n", in_fn,
+                read_sz == 0 ? "file shrank" : strerror(errno));
+        exit(1);
+      }
+      pwrite_all(fd, fn.c_str(), &buf[0], size_t(read_sz), data_off);
+      if(crc)
+        sum = crc32(sum, reinterpret_cast<const Bytef*>(&buf[0]),
+                    uInt(read_sz));
+      data_off += size_t(read_sz);
+      done += size_t(read_sz);
+      hints.read_to(ext.offset + done);
+      wb.written_to(data_off);
+    }
+  }
+  hints.done();
+  wb.done();
+  close(in_fd);
+  if(crc)
+    *crc = uint32_t(sum);
+}
+
+void tarappender::finish(const std::vector<std::string> &extra)
+{
+  int size;
+  MPI_Comm_size(comm, &size);
+
+  std::string local;
+  for(size_t i = 0 ; i < added.size() ; i++)
+    local += added[i].serialize();
+  const int local_sz = int(local.size());
+  std::vector<int> sizes(rank == owner ? size : 1);
+  MPI_Gather(&local_sz, 1, MPI_INT, &sizes[0], 1, MPI_INT, owner, comm);
+  std::vector<int> displs(sizes.size());
+  for(size_t i = 1 ; rank == owner && i < sizes.size() ; i++)
+    displs[i] = displs[i-1] + sizes[i-1];
+  std::string all(rank == owner ? size_t(displs.back() + sizes.back()) : 0,
+                  '\0');
+  // once the owner has heard from everyone no more offsets are claimed
+  MPI_Gatherv(&local[0], local_sz, MPI_BYTE, &all[0], &sizes[0], &displs[0],
+              MPI_BYTE, owner, comm);
+
+  if(rank == owner) {
+    std::vector<tarentry> entries;
+    for(size_t p = 0 ; p < all.size() ; ) {
+      entries.push_back(tarentry());
+      p += entries.back().deserialize(&all[p]);
+    }
+    std::sort(entries.begin(), entries.end(), by_offset);
+
+    size_t off = claim(0);
+    for(size_t i = 0 ; i < extra.size() ; i++) {
+      entries.push_back(tarentry(extra[i], off));
+      write_member(entries.back());
+      off += entries.back().size();
+    }
+
+    // the binary index, then the text index listing both last, like mpitar
+    const std::string idx_fn = fn + ".idx";
+    const std::string bidx_fn = fn + ".bidx";
+    FILE *idx_fh = fopen(idx_fn.c_str(), "w");
+    if(idx_fh == NULL) {
+      fprintf(stderr, "Could not open '%s' for writing: %s\n", idx_fn.c_str(),
+              strerror(errno));
+      exit(1);
+    }
+    memberindex_writer bidx;
+    for(size_t i = 0 ; i < entries.size() ; i++) {
+      const tarentry &ent = entries[i];
+      fprintf(idx_fh, "%zu %s\n", ent.get_offset(),
+              ent.get_filename().c_str());
+      bidx.add(ent.get_filename(), MEMBERINDEX_NO_BLOCK, ent.get_offset(),
+               ent.get_filesize(), ent.size(), ent.get_mode(),
+               ent.get_mtime());
+    }
+    bidx.write(bidx_fn.c_str());
+    fprintf(idx_fh, "%zu %s\n", off, bidx_fn.c_str());
+    const tarentry bidx_ent(bidx_fn, off);
+    write_member(bidx_ent);
+    off += bidx_ent.size();
+
+    fprintf(idx_fh, "%zu %s\n", off, idx_fn.c_str());
+    if(fclose(idx_fh) != 0) {
+      fprintf(stderr, "Could not write to '%s': %s\n", idx_fn.c_str(),
+              strerror(errno));
+      exit(1);
+    }
+    const tarentry idx_ent(idx_fn, off);
+    write_member(idx_ent);
+    off += idx_ent.size();
+
+    // terminate the tar file with two zero blocks
+    if(ftruncate(fd, off_t(off + 2*BLOCKSIZE)) != 0) {
+      fprintf(stderr, "Could not extend '%s' to %zu bytes: %s\n", fn.c_str(),
+              off + 2*BLOCKSIZE, strerror(errno));
+      exit(1);
+    }
+  }
+
+  if(close(fd) != 0) {
+    fprintf(stderr, "Could not write to '%s': %s\n", fn.c_str(),
+            strerror(errno));
+    exit(1);
+  }
+  fd = -1;
+  MPI_Barrier(comm);
+}
@@ -0,0 +1,93 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef TAR_APPENDER_HH_
+#define TAR_APPENDER_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "tarentry.hh"
+
+// tar file that all threads of all ranks of a communicator append to
+// Members are placed in the order they are added: add() claims the space of a
+// member by advancing the end of the archive, a counter on the owner rank,
+// with an atomic MPI_Fetch_and_op and then writes header and data at the
+// claimed offset itself, so nobody waits for anybody else. finish() collects
+// the members of all ranks on the owner, which appends its own files and then
+// the same binary and text indices as mpitar, so that readers of mpitar
+// archives can read the result.
+// Construction, finish() and destruction are collective. add() is thread safe
+// but needs at least MPI_THREAD_SERIALIZED.
+class tarappender
+{
+  public:
+  // creates or truncates fn
+  tarappender(const std::string &fn_, MPI_Comm comm_, const int owner_ = 0);
+  ~tarappender();
+
+  // appends the file member_fn, returns the number of bytes it takes up in
+  // the archive, exits on error. If crc is given it receives the CRC-32 of
+  // the data of the file as it is copied and datasize its size.
+  size_t add(const std::string &member_fn, uint32_t *crc = NULL,
+             size_t *datasize = NULL);
+  // appends the files in extra on the owner, then the indices, and
+  // terminates the archive, exits on error
+  void finish(const std::vector<std::string> &extra);
+
+  private:
+  const std::string fn;
+  MPI_Comm comm;
+  const int owner;
+  int rank;
+  int fd;
+  uint64_t end;
+  MPI_Win win;
+  std::vector<tarentry> added;
+
+  // reserve sz bytes at the end of the archive, returns their offset
+  size_t claim(const size_t sz);
+  void write_member(const tarentry &ent, uint32_t *crc = NULL) const;
+
+  // no copies, we own the file and the window
+  tarappender(const tarappender&);
+  tarappender &operator=(const tarappender&);
+};
+
+#endif // TAR_APPENDER_HH_
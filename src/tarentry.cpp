@@ -39,14 +39,18 @@
 #include <cerrno>
 #include <algorithm>
 
-#include <libgen.h>
 #include <limits.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <grp.h>
 #include <pwd.h>
 
+#if defined(__SSE2__) && defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
 tarentry::tarentry(const std::string fn, const size_t off) : offset(off),
-                   filename(fn)
+                   paxsize(0), datasize(0), filename(fn)
 {
   int ierr = lstat(filename.c_str(), &statbuf);
   if(ierr) {
@@ -55,6 +59,18 @@ tarentry::tarentry(const std::string fn, const size_t off) : offset(off),
     exit(1);
   }
 
+  init_from_stat();
+}
+
+tarentry::tarentry(const std::string fn, const size_t off,
+                   const struct stat &st) : offset(off), paxsize(0),
+                   datasize(0), statbuf(st), filename(fn)
+{
+  init_from_stat();
+}
+
+void tarentry::init_from_stat()
+{
   if(S_ISLNK(statbuf.st_mode))
   {
     char buf[PATH_MAX];
@@ -73,6 +89,12 @@ tarentry::tarentry(const std::string fn, const size_t off) : offset(off),
   if(S_ISDIR(statbuf.st_mode) && *filename.rbegin() != '/') {
     filename += "/";
   }
+
+  if(S_ISREG(statbuf.st_mode)) {
+    find_holes();
+  }
+  datasize = get_datasize_from_map();
+  paxsize = get_paxsize();
 }
 
 size_t tarentry::deserialize(const char *buf)
@@ -90,7 +112,16 @@ size_t tarentry::deserialize(const char *buf)
   if(linknamelen > 0) { // two statements!
     linkname = std::string(p, linknamelen); p += linknamelen;
   }
+  size_t extents;
+  memcpy(&extents, p, sizeof(extents)); p += sizeof(extents);
+  sparse_map.resize(extents);
+  if(extents > 0) { // two statements!
+    memcpy(&sparse_map[0], p, extents*sizeof(tar_extent));
+    p += extents*sizeof(tar_extent);
+  }
   assert(sz == size_t(p-buf));
+  datasize = get_datasize_from_map();
+  paxsize = get_paxsize();
   return sz;
 }
 
@@ -99,108 +130,405 @@ std::string tarentry::serialize() const
   std::string buf;
   size_t sz = sizeof(size_t) + sizeof(statbuf) + sizeof(size_t) +
               sizeof(size_t) + filename.size() + sizeof(size_t) +
-              linkname.size();
+              linkname.size() + sizeof(size_t) +
+              sparse_map.size()*sizeof(tar_extent);
   size_t fnsz = filename.size();
   size_t lnsz = linkname.size();
+  size_t extents = sparse_map.size();
   buf = std::string(reinterpret_cast<const char*>(&sz), sizeof(sz)) +
         std::string(reinterpret_cast<const char*>(&statbuf), sizeof(statbuf)) +
         std::string(reinterpret_cast<const char*>(&offset), sizeof(offset)) +
         std::string(reinterpret_cast<const char*>(&fnsz), sizeof(fnsz)) +
         filename +
         std::string(reinterpret_cast<const char*>(&lnsz), sizeof(lnsz)) +
-        linkname;
+        linkname +
+        std::string(reinterpret_cast<const char*>(&extents), sizeof(extents)) +
+        std::string(reinterpret_cast<const char*>(sparse_map.data()),
+                    extents*sizeof(tar_extent));
   return buf;
 }
 
-std::vector<char> tarentry::make_tar_header() const
+namespace {
+// write v as a zero padded octal number filling all but the last byte of
+// field, which is set to NUL, just like "%0*o" does for values that fit
+void format_octal(char *field, size_t width, unsigned long long v)
 {
-  size_t pax_sz = get_paxsize();
-  size_t pax_hdr_sz = pax_sz > 0 ? round_to_block(BLOCKSIZE + pax_sz) : 0;
-  size_t full_hdr_sz = BLOCKSIZE + pax_hdr_sz;
-  std::vector<char> full_hdr(full_hdr_sz);
+  static const char digits[] = "01234567";
+  field[width-1] = '\0';
+  for(size_t i = width-1 ; i > 0 ; i--) {
+    field[i-1] = digits[v & 7];
+    v >>= 3;
+  }
+}
 
-  ustar_hdr &pax_hdr = *reinterpret_cast<ustar_hdr*>(&full_hdr[0]);
-  ustar_hdr &hdr = *reinterpret_cast<ustar_hdr*>(&full_hdr[pax_hdr_sz]);
-  if(pax_sz > 0) {
-    struct stat pax_statbuf = statbuf;
-    char *dirpart = strdup(filename.c_str());
-    char *filepart = strdup(filename.c_str());
-    // anything, really
-    std::string pax_filename(std::string(dirname(dirpart))+"/"+
-                             std::string(basename(filepart))+".paxhdr");
-    free(filepart);
-    free(dirpart);
-    pax_statbuf.st_mode = 0644 | S_IFREG;
-    pax_statbuf.st_size = off_t(get_paxsize());
-    make_ustar_header_block(pax_hdr, XHDTYPE, pax_statbuf,
-                            pax_filename.c_str(), "");
-
-    char *p = &full_hdr[BLOCKSIZE];
-    // end pointer of pax header space plus 1
-    // this claims one more byte so that snprintf can write its NUL terminator,
-    // it writes into the ustar header which is NUL initailized anyway
-    char *q = &full_hdr[pax_hdr_sz]+1;
-    if(filename.size() > sizeof(((ustar_hdr*)0)->name)) {
-      int sz = record_length("path", filename.c_str());
-      p += snprintf(p, q-p, "%d path=%s\n", sz, filename.c_str());
+// write v in decimal without padding, returns the end of the number
+char *format_decimal(char *p, unsigned long long v)
+{
+  char buf[24];
+  char *q = buf + sizeof(buf);
+  do {
+    *--q = char('0' + v % 10);
+    v /= 10;
+  } while(v);
+  const size_t len = size_t(buf + sizeof(buf) - q);
+  memcpy(p, q, len);
+  return p + len;
+}
+
+// copy at most end-p bytes of src to p, returns the end of the copied data
+char *append(char *p, const char *end, const char *src, size_t len)
+{
+  if(len > size_t(end - p))
+    len = size_t(end - p);
+  memcpy(p, src, len);
+  return p + len;
+}
+
+size_t decimal_digits(size_t v)
+{
+  size_t n = 1;
+  while(v >= 10) {
+    v /= 10;
+    n++;
+  }
+  return n;
+}
+
+// sum of all bytes of the header
+unsigned long checksum(const ustar_hdr &hdr)
+{
+#if defined(__SSE2__) && defined(__x86_64__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i *p = reinterpret_cast<const __m128i*>(&hdr);
+  __m128i sum = zero;
+  for(size_t i = 0 ; i < sizeof(hdr) / sizeof(__m128i) ; i++)
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(_mm_loadu_si128(p + i), zero));
+  return (unsigned long)(_mm_cvtsi128_si64(sum) +
+                         _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)));
+#else
+  unsigned long sum = 0;
+  for(size_t j = 0 ; j < sizeof(hdr) ; j++)
+    sum += ((const unsigned char*)&hdr)[j];
+  return sum;
+#endif
+}
+
+// user and group names of the last id looked up by this thread, getpwuid and
+// getgrgid otherwise read /etc/passwd and /etc/group (or ask nscd) for every
+// single file
+struct name_cache {
+  bool valid;
+  unsigned int id;
+  char name[32];
+};
+thread_local name_cache user_cache = {false, 0, ""};
+thread_local name_cache group_cache = {false, 0, ""};
+
+const char *user_name(uid_t uid)
+{
+  if(!user_cache.valid || user_cache.id != uid) {
+    errno = 0;
+    struct passwd *pwd = getpwuid(uid);
+    if(!pwd) {
+      fprintf(stderr, "Could not get user name for user '%d': %s\n",
+              int(uid), strerror(errno));
+      exit(1);
     }
-    assert(p < q);
-    if(linkname.size() > sizeof(((ustar_hdr*)0)->linkname)) {
-      int sz = record_length("linkpath", linkname.c_str());
-      p += snprintf(p, q-p, "%d linkpath=%s\n", sz, linkname.c_str());
+    snprintf(user_cache.name, sizeof(user_cache.name), "%s", pwd->pw_name);
+    user_cache.id = uid;
+    user_cache.valid = true;
+  }
+  return user_cache.name;
+}
+
+const char *group_name(gid_t gid)
+{
+  if(!group_cache.valid || group_cache.id != gid) {
+    errno = 0;
+    struct group *grp = getgrgid(gid);
+    if(!grp) {
+      fprintf(stderr, "Could not get group name for group '%d': %s\n",
+              int(gid), strerror(errno));
+      exit(1);
     }
-    assert(p < q);
-    if(S_ISREG(statbuf.st_mode) && statbuf.st_size > MAX_FILE_SIZE) {
-      char buf[128];
-      sprintf(buf, "%zu", size_t(statbuf.st_size));
-      int sz = record_length("size", buf);
-      p += snprintf(p, q-p, "%d size=%s\n", sz, buf);
+    snprintf(group_cache.name, sizeof(group_cache.name), "%s", grp->gr_name);
+    group_cache.id = gid;
+    group_cache.valid = true;
+  }
+  return group_cache.name;
+}
+}
+
+void tarentry::find_holes()
+{
+  // like GNU tar --sparse, only files with fewer allocated 512 byte units than
+  // their size needs are looked at
+  const size_t size = size_t(statbuf.st_size);
+  if(size_t(statbuf.st_blocks) >= size / 512 + (size % 512 != 0))
+    return;
+  // whoever reads the data reports files that cannot be opened
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    return;
+  bool ok = true;
+  size_t pos = 0;
+  while(pos < size) {
+    const off_t data = lseek(fd, off_t(pos), SEEK_DATA);
+    if(data < 0) {
+      // ENXIO: only a hole is left
+      ok = errno == ENXIO;
+      break;
     }
-    assert(p < q);
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if(hole < 0 || size_t(hole) > size)
+      hole = off_t(size);
+    const tar_extent ext = {size_t(data), size_t(hole - data)};
+    sparse_map.push_back(ext);
+    pos = size_t(hole);
+  }
+  close(fd);
+  // the file system cannot tell, store the file in full
+  if(!ok) {
+    sparse_map.clear();
+    return;
+  }
+  const tar_extent end = {size, 0};
+  sparse_map.push_back(end);
+}
+
+size_t tarentry::get_mapsize() const
+{
+  // "<count>\n" followed by "<offset>\n<size>\n" for each extent
+  size_t sz = decimal_digits(sparse_map.size()) + 1;
+  for(size_t i = 0 ; i < sparse_map.size() ; i++)
+    sz += decimal_digits(sparse_map[i].offset) + 1 +
+          decimal_digits(sparse_map[i].size) + 1;
+  return round_to_block(sz);
+}
+
+size_t tarentry::get_datasize_from_map() const
+{
+  if(!is_reg() || is_hardlink())
+    return 0;
+  if(sparse_map.empty())
+    return size_t(statbuf.st_size);
+  size_t sz = get_mapsize();
+  for(size_t i = 0 ; i < sparse_map.size() ; i++)
+    sz += sparse_map[i].size;
+  return sz;
+}
+
+std::vector<char> tarentry::make_sparse_map() const
+{
+  std::vector<char> map(is_sparse() ? get_mapsize() : 0);
+  if(map.empty())
+    return map;
+  char *p = format_decimal(&map[0], sparse_map.size());
+  *p++ = '\n';
+  for(size_t i = 0 ; i < sparse_map.size() ; i++) {
+    p = format_decimal(p, sparse_map[i].offset);
+    *p++ = '\n';
+    p = format_decimal(p, sparse_map[i].size);
+    *p++ = '\n';
+  }
+  return map;
+}
+
+std::vector<tar_extent> tarentry::get_extents() const
+{
+  if(is_sparse())
+    return sparse_map;
+  std::vector<tar_extent> extents;
+  if(is_reg() && !is_hardlink()) {
+    const tar_extent all = {0, size_t(statbuf.st_size)};
+    extents.push_back(all);
   }
-  make_ustar_header_block(hdr, 0, statbuf, filename.c_str(), linkname.c_str());
+  return extents;
+}
+
+void tarentry::make_hardlink(const std::string &target)
+{
+  linkname = target;
+  sparse_map.clear();
+  datasize = get_datasize_from_map();
+  paxsize = get_paxsize();
+}
 
+std::vector<char> tarentry::make_tar_header() const
+{
+  std::vector<char> full_hdr(header_size());
+  make_tar_header(&full_hdr[0]);
   return full_hdr;
 }
 
-size_t tarentry::size() const
+size_t tarentry::headers_size(const tarentry *first, const tarentry *last)
 {
-  size_t pax_sz = get_paxsize();
-  size_t pax_hdr_sz = pax_sz > 0 ? round_to_block(BLOCKSIZE + pax_sz) : 0;
-  size_t full_hdr_sz = BLOCKSIZE + pax_hdr_sz;
-  return round_to_block(full_hdr_sz + get_filesize());
+  size_t sz = 0;
+  for(const tarentry *ent = first ; ent != last ; ++ent)
+    sz += ent->header_size();
+  return sz;
 }
 
-size_t tarentry::get_paxsize() const
+size_t tarentry::make_tar_headers(const tarentry *first, const tarentry *last,
+                                  char *buf)
 {
-  size_t pax_sz = 0;
+  char *p = buf;
+  for(const tarentry *ent = first ; ent != last ; ++ent)
+    p += ent->make_tar_header(p);
+  return size_t(p - buf);
+}
+
+size_t tarentry::make_tar_header(char *buf) const
+{
+  const size_t pax_hdr_sz =
+    paxsize > 0 ? round_to_block(BLOCKSIZE + paxsize) : 0;
+  const size_t full_hdr_sz = BLOCKSIZE + pax_hdr_sz;
+
+  ustar_hdr &hdr = *reinterpret_cast<ustar_hdr*>(buf + pax_hdr_sz);
+  // the ustar header of a sparse file carries the size of the stored data and
+  // GNU tar's dirname(filename)/GNUSparseFile.<pid>/basename(filename), the
+  // real name and size are pax records
+  struct stat ustar_statbuf = statbuf;
+  if(S_ISREG(statbuf.st_mode))
+    ustar_statbuf.st_size = off_t(datasize);
+  char sparse_filename[sizeof(hdr.name)+1];
+  if(paxsize > 0) {
+    ustar_hdr &pax_hdr = *reinterpret_cast<ustar_hdr*>(buf);
+    struct stat pax_statbuf = statbuf;
+    // anything, really, this is dirname(filename)/basename(filename).paxhdr
+    char pax_filename[sizeof(hdr.name)+1];
+    const char *fn = filename.c_str();
+    size_t fn_len = filename.size();
+    while(fn_len > 1 && fn[fn_len-1] == '/')
+      fn_len--;
+    size_t base = fn_len;
+    while(base > 0 && fn[base-1] != '/')
+      base--;
+    size_t dir_len = base;
+    while(dir_len > 1 && fn[dir_len-1] == '/')
+      dir_len--;
+    // only the first sizeof(hdr.name) bytes end up in the header
+    char *q = pax_filename, *end = pax_filename + sizeof(hdr.name);
+    q = append(q, end, dir_len ? fn : ".", dir_len ? dir_len : 1);
+    q = append(q, end, "/", 1);
+    q = append(q, end, fn + base, fn_len - base);
+    q = append(q, end, ".paxhdr", 7);
+    *q = '\0';
+    if(is_sparse()) {
+      char pid[24];
+      const size_t pid_len =
+        size_t(format_decimal(pid, (unsigned long long)getpid()) - pid);
+      q = sparse_filename;
+      end = sparse_filename + sizeof(hdr.name);
+      q = append(q, end, dir_len ? fn : ".", dir_len ? dir_len : 1);
+      q = append(q, end, "/GNUSparseFile.", 15);
+      q = append(q, end, pid, pid_len);
+      q = append(q, end, "/", 1);
+      q = append(q, end, fn + base, fn_len - base);
+      *q = '\0';
+    }
+    pax_statbuf.st_mode = 0644 | S_IFREG;
+    pax_statbuf.st_size = off_t(paxsize);
+    make_ustar_header_block(pax_hdr, XHDTYPE, pax_statbuf, pax_filename, "");
+
+    char *p = make_pax_records(buf + BLOCKSIZE);
+    assert(size_t(p - (buf + BLOCKSIZE)) == paxsize);
+    memset(p, 0, pax_hdr_sz - BLOCKSIZE - paxsize);
+  }
+  make_ustar_header_block(hdr, 0, ustar_statbuf,
+                          is_sparse() ? sparse_filename : filename.c_str(),
+                          linkname.c_str());
 
+  return full_hdr_sz;
+}
+
+char *tarentry::make_pax_records(char *p) const
+{
   // format of a pax extended record:
   // "%d %s=%s\n", <length>, <keyword>, <value>
-  // where length is the length of the record including the newline and %d may
-  // be space padded
-  if(filename.size() > sizeof(((ustar_hdr*)0)->name)) {
-    pax_sz += record_length("path", filename.c_str());
+  // where length is the length of the record including the newline
+  if(is_sparse()) {
+    // in the order GNU tar writes them, the name replaces a path record
+    static const char version[] = "22 GNU.sparse.major=1\n"
+                                  "22 GNU.sparse.minor=0\n";
+    memcpy(p, version, sizeof(version)-1); p += sizeof(version)-1;
+    p = format_decimal(p, record_length(15, filename.size()));
+    memcpy(p, " GNU.sparse.name=", 17); p += 17;
+    memcpy(p, filename.data(), filename.size()); p += filename.size();
+    *p++ = '\n';
+    const size_t sz = size_t(statbuf.st_size);
+    p = format_decimal(p, record_length(19, decimal_digits(sz)));
+    memcpy(p, " GNU.sparse.realsize=", 21); p += 21;
+    p = format_decimal(p, sz);
+    *p++ = '\n';
+  } else if(filename.size() > sizeof(((ustar_hdr*)0)->name)) {
+    p = format_decimal(p, record_length(4, filename.size()));
+    memcpy(p, " path=", 6); p += 6;
+    memcpy(p, filename.data(), filename.size()); p += filename.size();
+    *p++ = '\n';
   }
   if(linkname.size() > sizeof(((ustar_hdr*)0)->linkname)) {
-    pax_sz += record_length("linkpath", linkname.c_str());
+    p = format_decimal(p, record_length(8, linkname.size()));
+    memcpy(p, " linkpath=", 10); p += 10;
+    memcpy(p, linkname.data(), linkname.size()); p += linkname.size();
+    *p++ = '\n';
+  }
+  if(S_ISREG(statbuf.st_mode) && datasize > MAX_FILE_SIZE) {
+    const size_t sz = datasize;
+    p = format_decimal(p, record_length(4, decimal_digits(sz)));
+    memcpy(p, " size=", 6); p += 6;
+    p = format_decimal(p, sz);
+    *p++ = '\n';
   }
-  if(S_ISREG(statbuf.st_mode) && statbuf.st_size > MAX_FILE_SIZE) {
-    char buf[128];
-    sprintf(buf, "%zu", size_t(statbuf.st_size));
-    pax_sz += record_length("size", buf);
+  return p;
+}
+
+size_t tarentry::get_paxsize() const
+{
+  return pax_size(filename.size(), linkname.size(), is_sparse(), statbuf,
+                  datasize);
+}
+
+size_t tarentry::pax_size(const size_t fn_len, const size_t ln_len,
+                          const bool sparse, const struct stat &st,
+                          const size_t datasize)
+{
+  size_t pax_sz = 0;
+
+  if(sparse) {
+    pax_sz += 2*22 + record_length(15, fn_len) +
+              record_length(19, decimal_digits(size_t(st.st_size)));
+  } else if(fn_len > sizeof(((ustar_hdr*)0)->name)) {
+    pax_sz += record_length(4, fn_len);
+  }
+  if(ln_len > sizeof(((ustar_hdr*)0)->linkname)) {
+    pax_sz += record_length(8, ln_len);
+  }
+  if(S_ISREG(st.st_mode) && datasize > MAX_FILE_SIZE) {
+    pax_sz += record_length(4, decimal_digits(datasize));
   }
 
   return pax_sz;
 }
 
+size_t tarentry::member_size(const std::string &fn, const struct stat &st,
+                             const size_t link_len, const bool hardlink)
+{
+  // init_from_stat() appends a slash to directory names
+  const size_t fn_len = fn.size() +
+    (S_ISDIR(st.st_mode) && (fn.empty() || *fn.rbegin() != '/'));
+  const size_t data =
+    S_ISREG(st.st_mode) && !hardlink ? size_t(st.st_size) : 0;
+  const size_t pax = pax_size(fn_len, link_len, false, st, data);
+  return round_to_block(BLOCKSIZE +
+                        (pax > 0 ? round_to_block(BLOCKSIZE + pax) : 0) +
+                        data);
+}
+
 void tarentry::make_ustar_header_block(ustar_hdr &hdr, const int xtype,
                                        const struct stat &statbuf,
                                        const char *filename, const char *ln)
 {
-  struct group *grp;
-  struct passwd *pwd;
-
   if(!(S_ISLNK(statbuf.st_mode) || S_ISREG(statbuf.st_mode) ||
        S_ISDIR(statbuf.st_mode))) {
     fprintf(stderr, "Only symbolic links, regular files and directories are supported. '%s' is neither one.\n",
@@ -208,45 +536,24 @@ void tarentry::make_ustar_header_block(ustar_hdr &hdr, const int xtype,
     exit(1);
   }
 
-  errno = 0;
-  grp = getgrgid(statbuf.st_gid);
-  if(!grp) {
-    fprintf(stderr, "Could not get group name for group '%d': %s\n",
-            int(statbuf.st_gid), strerror(errno));
-    exit(1);
-  }
-  errno = 0;
-  pwd = getpwuid(statbuf.st_uid);
-  if(!pwd) {
-    fprintf(stderr, "Could not get user name for user '%d': %s\n",
-            int(statbuf.st_gid), strerror(errno));
-    exit(1);
-  }
+  const char *gname = group_name(statbuf.st_gid);
+  const char *uname = user_name(statbuf.st_uid);
 
   memset(&hdr, 0, BLOCKSIZE);
-  if(S_ISLNK(statbuf.st_mode))
+  if(S_ISLNK(statbuf.st_mode) || (S_ISREG(statbuf.st_mode) && *ln))
   {
     strncpy(hdr.linkname, ln, sizeof(hdr.linkname));
-    hdr.linkname[statbuf.st_size] = '\0';
-  }
-  else
-  {
-    strcpy(hdr.linkname, "");
   }
 
   // name is set at the end due to funny handling of long file names
-  snprintf(hdr.mode, sizeof(hdr.mode), "%0*o",
-           (int)sizeof(hdr.mode)-1, statbuf.st_mode & MODE_MASK);
-  snprintf(hdr.uid, sizeof(hdr.uid), "%0*o",
-           (int)sizeof(hdr.uid)-1, xtype ? 0 : statbuf.st_uid);
-  snprintf(hdr.gid, sizeof(hdr.gid), "%0*o",
-           (int)sizeof(hdr.gid)-1, xtype ? 0 : statbuf.st_gid);
+  format_octal(hdr.mode, sizeof(hdr.mode), statbuf.st_mode & MODE_MASK);
+  format_octal(hdr.uid, sizeof(hdr.uid), xtype ? 0 : statbuf.st_uid);
+  format_octal(hdr.gid, sizeof(hdr.gid), xtype ? 0 : statbuf.st_gid);
   // tar requires zero size for links and allows it for dirs
   off_t size = S_ISREG(statbuf.st_mode) ? statbuf.st_size : 0;
-  snprintf(hdr.size, sizeof(hdr.size), "%0*lo",
-           (int)sizeof(hdr.size)-1, size < MAX_FILE_SIZE ? size : 0);
-  snprintf(hdr.mtime, sizeof(hdr.mtime), "%0*lo",
-           (int)sizeof(hdr.mtime)-1, statbuf.st_mtime);
+  format_octal(hdr.size, sizeof(hdr.size), size <= MAX_FILE_SIZE ? size : 0);
+  format_octal(hdr.mtime, sizeof(hdr.mtime),
+               (unsigned long long)statbuf.st_mtime);
   memset(hdr.chksum, ' ', sizeof(hdr.chksum));
   if(xtype)
     hdr.typeflag = char(xtype);
@@ -255,38 +562,121 @@ void tarentry::make_ustar_header_block(ustar_hdr &hdr, const int xtype,
   else if(S_ISDIR(statbuf.st_mode))
     hdr.typeflag = DIRTYPE;
   else if(S_ISREG(statbuf.st_mode))
-    hdr.typeflag = REGTYPE;
+    hdr.typeflag = *ln ? LNKTYPE : REGTYPE;
   else
     assert(0);
 
   // link name already set
-  strncpy(hdr.magic, TMAGIC, sizeof(hdr.magic));
-  strncpy(hdr.version, TVERSION, sizeof(hdr.version));
+  memcpy(hdr.magic, TMAGIC, sizeof(hdr.magic));
+  memcpy(hdr.version, TVERSION, sizeof(hdr.version));
   if(!xtype) {
-    snprintf(hdr.uname, sizeof(hdr.uname), "%s", pwd->pw_name);
-    snprintf(hdr.gname, sizeof(hdr.gname), "%s", grp->gr_name);
-    snprintf(hdr.devmajor, sizeof(hdr.devmajor), "%0*o",
-             (int)sizeof(hdr.devmajor)-1, 0);
-    snprintf(hdr.devminor, sizeof(hdr.devminor), "%0*o",
-             (int)sizeof(hdr.devminor)-1, 0);
+    strncpy(hdr.uname, uname, sizeof(hdr.uname)-1);
+    strncpy(hdr.gname, gname, sizeof(hdr.gname)-1);
+    format_octal(hdr.devmajor, sizeof(hdr.devmajor), 0);
+    format_octal(hdr.devminor, sizeof(hdr.devminor), 0);
   }
   strncpy(hdr.name, filename, sizeof(hdr.name));
 
-  unsigned long int checksum = 0;
-  for(size_t j = 0 ; j < sizeof(hdr) ; j++)
-    checksum += ((unsigned char*)&hdr)[j];
-  snprintf(hdr.chksum, sizeof(hdr.chksum), "0%-lo", checksum);
+  // "0%-lo", the byte after the NUL keeps its blank
+  char digits[sizeof(hdr.chksum)];
+  char *q = digits + sizeof(digits);
+  unsigned long sum = checksum(hdr);
+  do {
+    *--q = char('0' + (sum & 7));
+    sum >>= 3;
+  } while(sum);
+  char *p = hdr.chksum;
+  *p++ = '0';
+  while(q < digits + sizeof(digits) && p < hdr.chksum + sizeof(hdr.chksum)-1)
+    *p++ = *q++;
+  *p = '\0';
 }
 
-size_t tarentry::record_length(const char *keyword, const char *value)
+size_t tarentry::record_length(size_t keyword_len, size_t value_len)
 {
-  int oldlen = 0, newlen = strlen(keyword)+strlen(value)+5; // would be 2 digits
-  int count = 0;
-  do {
-    oldlen = newlen;
-    newlen = snprintf(NULL, 0, "%d %s=%s\n", oldlen, keyword, value);
-    assert(count++ < 3);
-  } while(oldlen != newlen);
+  // length of "<length> <keyword>=<value>\n" where <length> counts itself
+  const size_t base = keyword_len + value_len + 3;
+  size_t len = base + decimal_digits(base);
+  if(decimal_digits(len) != decimal_digits(base))
+    len = base + decimal_digits(len);
+  return len;
+}
+
+void hardlinks::add(tarentry &ent)
+{
+  const struct stat &st = ent.get_stat();
+  if(!S_ISREG(st.st_mode) || st.st_nlink < 2)
+    return;
+  const std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+  std::map<std::pair<dev_t, ino_t>, std::string>::const_iterator it =
+    first.find(key);
+  if(it == first.end())
+    first[key] = ent.get_filename();
+  else
+    ent.make_hardlink(it->second);
+}
+
+void pread_all(int fd, const char *fn, char *buf, size_t sz, size_t off)
+{
+  while(sz > 0) {
+    ssize_t read_sz = pread(fd, buf, sz, off_t(off));
+    if(read_sz <= 0) {
+      fprintf(stderr, "Could not read %zu bytes at %zu from '%s': %s\n", sz,
+              off, fn, read_sz == 0 ? "Unexpected end of file" :
+              strerror(errno));
+      exit(1);
+    }
+    buf += read_sz;
+    sz -= size_t(read_sz);
+    off += size_t(read_sz);
+  }
+}
+
+size_t tar_size_field(const ustar_hdr &hdr)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char*>(hdr.size);
+  size_t sz = 0;
+  if(p[0] & 0x80) {
+    for(size_t i = 1 ; i < sizeof(hdr.size) ; i++)
+      sz = (sz << 8) | p[i];
+  } else {
+    char buf[sizeof(hdr.size)+1];
+    memcpy(buf, hdr.size, sizeof(hdr.size));
+    buf[sizeof(hdr.size)] = '\0';
+    sz = size_t(strtoull(buf, NULL, 8));
+  }
+  return sz;
+}
+
+void tar_member_data(int fd, const char *fn, size_t off, size_t *data_off,
+                     size_t *data_sz)
+{
+  ustar_hdr hdr;
+  pread_all(fd, fn, reinterpret_cast<char*>(&hdr), sizeof(hdr), off);
+  *data_off = off + BLOCKSIZE;
+  *data_sz = tar_size_field(hdr);
+  if(hdr.typeflag != XHDTYPE)
+    return;
 
-  return size_t(newlen);
+  const size_t ext_sz = *data_sz;
+  const size_t ext_end = off + BLOCKSIZE + ((ext_sz + BLOCKSIZE-1) & ~size_t(BLOCKSIZE-1));
+  std::vector<char> exthdr(ext_sz+1);
+  pread_all(fd, fn, &exthdr[0], ext_sz, off+BLOCKSIZE);
+  exthdr[ext_sz] = '\0';
+  pread_all(fd, fn, reinterpret_cast<char*>(&hdr), sizeof(hdr), ext_end);
+  *data_off = ext_end + BLOCKSIZE;
+  *data_sz = tar_size_field(hdr);
+  // check if the extended records contain a size and use that if found
+  for(const char *p = &exthdr[0] ; p < &exthdr[0] + ext_sz ; ) {
+    char *end;
+    size_t len = size_t(strtoull(p, &end, 10));
+    if(end == p || *end != ' ' || len == 0) {
+      fprintf(stderr, "Invalid extended header record in member at %zu of '%s'\n",
+              off, fn);
+      exit(1);
+    }
+    if(strncmp(end+1, "size=", 5) == 0)
+      *data_sz = size_t(strtoull(end+6, NULL, 10));
+    p += len;
+  }
 }
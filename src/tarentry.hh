@@ -39,7 +39,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 struct ustar_hdr {
@@ -64,6 +66,7 @@ struct ustar_hdr {
 #define BLOCKSIZE 512
 namespace { typedef int ustar_hdr_size_assert[(sizeof(ustar_hdr) == BLOCKSIZE) ? 1 : -1]; }
 #define REGTYPE '0'
+#define LNKTYPE '1'
 #define SYMTYPE '2'
 #define DIRTYPE '5'
 #define XHDTYPE 'x'
@@ -73,17 +76,53 @@ namespace { typedef int ustar_hdr_size_assert[(sizeof(ustar_hdr) == BLOCKSIZE) ?
 
 #define MAX_FILE_SIZE 077777777777
 
+// a range of bytes of a file
+struct tar_extent {
+  size_t offset;
+  size_t size;
+};
+
 class tarentry
 {
   public:
   tarentry(const std::string fn, const size_t off);
-  tarentry() {};
+  // use an already obtained lstat() result instead of calling lstat again
+  tarentry(const std::string fn, const size_t off, const struct stat &st);
+  tarentry() : offset(0), paxsize(0), datasize(0) {};
   ~tarentry() {};
 
+  // store a regular file as a hard link to target, which must be an earlier
+  // member of the same archive, like tar does for files it has seen before
+  void make_hardlink(const std::string &target);
+
   // construct a tar header
   std::vector<char> make_tar_header() const;
+  // write the tar header into buf, which must hold header_size() bytes,
+  // returns the number of bytes written
+  size_t make_tar_header(char *buf) const;
+  // write the headers of [first, last) back to back into buf, which must hold
+  // headers_size(first, last) bytes, returns the number of bytes written
+  static size_t make_tar_headers(const tarentry *first, const tarentry *last,
+                                 char *buf);
+  static size_t headers_size(const tarentry *first, const tarentry *last);
+  // size() of the member of a file without holes from what is already known
+  // about it, without asking the file system: fn is its name, st its status
+  // and link_len the length of the target of a symlink or, with hardlink set,
+  // of the earlier member a regular file is a hard link to
+  static size_t member_size(const std::string &fn, const struct stat &st,
+                            const size_t link_len, const bool hardlink);
+  // size of the header(s) in front of the file data
+  size_t header_size() const {
+    return BLOCKSIZE + (paxsize > 0 ? round_to_block(BLOCKSIZE + paxsize) : 0);
+  }
   // size of tar entry in the file
-  size_t size() const;
+  size_t size() const { return round_to_block(header_size() + datasize); }
+  // the sparse map that goes in front of the data of a sparse file, padded
+  // to whole blocks, empty for other members
+  std::vector<char> make_sparse_map() const;
+  // the ranges of the file whose bytes follow the header(s) and the sparse
+  // map in the archive, back to back
+  std::vector<tar_extent> get_extents() const;
 
   // serialize and de-serialize data for MPI transmission
   size_t deserialize(const char *buf);
@@ -91,25 +130,81 @@ class tarentry
 
   // accessors
   const std::string &get_filename() const { return filename; }
-  size_t get_filesize() const { return is_reg() ? size_t(statbuf.st_size) : 0; }
+  size_t get_filesize() const {
+    return is_reg() && !is_hardlink() ? size_t(statbuf.st_size) : 0;
+  }
   bool is_reg() const { return S_ISREG(statbuf.st_mode); }
+  // a regular file with a link name is a hard link
+  bool is_hardlink() const { return is_reg() && !linkname.empty(); }
+  // stored in GNU pax sparse format 1.0, only the data extents are archived
+  bool is_sparse() const { return !sparse_map.empty(); }
+  // bytes following the header(s), the sparse map and the data extents for
+  // sparse files
+  size_t get_datasize() const { return datasize; }
   size_t get_offset() const { return offset; }
+  mode_t get_mode() const { return statbuf.st_mode; }
+  time_t get_mtime() const { return statbuf.st_mtime; }
+  const struct stat &get_stat() const { return statbuf; }
 
   private:
   size_t offset;
+  // size of the pax extended records, 0 if none are needed
+  size_t paxsize;
+  // data extents of a sparse file followed by an empty one at its end, just
+  // like GNU tar records them, empty if the file is stored in full
+  std::vector<tar_extent> sparse_map;
+  size_t datasize;
   struct stat statbuf;
   std::string filename;
   std::string linkname;
 
-  // size of pax extended header
+  // read link target and fix up directory names once statbuf is set
+  void init_from_stat();
+  // find the data extents of regular files that have holes
+  void find_holes();
+  // size of the data following the header(s), computed once the sparse map
+  // is known
+  size_t get_datasize_from_map() const;
+  size_t get_mapsize() const;
+  // size of pax extended header, computed once filename and statbuf are set
   size_t get_paxsize() const;
+  static size_t pax_size(const size_t fn_len, const size_t ln_len,
+                         const bool sparse, const struct stat &st,
+                         const size_t datasize);
+  // write the pax records, returns the end of the written data
+  char *make_pax_records(char *p) const;
   static void make_ustar_header_block(ustar_hdr &hdr, const int xtype,
                                       const struct stat &statbuf,
                                       const char *fn, const char *ln);
   static size_t round_to_block(size_t sz) {
     return (sz + BLOCKSIZE-1) & ~(BLOCKSIZE-1);
   }
-  static size_t record_length(const char *keyword, const char *value);
+  static size_t record_length(size_t keyword_len, size_t value_len);
+};
+
+// first names of the files with several hard links added to a tar stream so
+// far, which tar stores only once, later names become links to the first one
+class hardlinks
+{
+  public:
+  hardlinks() {};
+  ~hardlinks() {};
+
+  // makes ent a hard link if its file was added before, not thread safe
+  void add(tarentry &ent);
+
+  private:
+  std::map<std::pair<dev_t, ino_t>, std::string> first;
 };
 
+// helpers to read existing tar files, these print a message and exit on errors
+// read exactly sz bytes at off
+void pread_all(int fd, const char *fn, char *buf, size_t sz, size_t off);
+// size field of a tar header, either octal or base-256 encoded
+size_t tar_size_field(const ustar_hdr &hdr);
+// find the data of the tar member whose first header is at off, skipping
+// over an extended header which may contain the real file size
+void tar_member_data(int fd, const char *fn, size_t off, size_t *data_off,
+                     size_t *data_sz);
+
 #endif // TAR_ENTRY_HH_
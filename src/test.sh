@@ -4,6 +4,9 @@ set -e
 
 LOREM="Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua. Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat. Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur. Excepteur sint occaecat cupidatat non proident, sunt in culpa qui officia deserunt mollit anim id est laborum."
 
+# where ptgz, mpitar and choptar are, bin/ of the top level Makefile by default
+BIN=${BIN:-$PWD/../bin}
+
 mkdir test
 cd test
 exec &>test.log
@@ -43,14 +46,197 @@ echo "file4 $LOREM$LOREM$LOREM$LOREM" >dir1/dir11/file3
 echo "Longfile $LOREM$LOREM" >dir1/$LONGNAME
 
 find file2 dir2 -type f -or -type l -or -type d >files.txt
-cat files.txt | mpirun -n 2 ../mpitar -f mpitar.tar -c file1 dir1 -T -
-$TAR --recursion file1 dir1 --no-recursion -T files.txt -c -f tar.tar mpitar.tar.idx
+cat files.txt | mpirun -n 2 $BIN/mpitar -f mpitar.tar -c file1 dir1 -T -
+$TAR --recursion file1 dir1 --no-recursion -T files.txt -c -f tar.tar mpitar.tar.bidx mpitar.tar.idx
 cmptar tar.tar mpitar.tar
 
+# enough files for many jobs so that the host leader passes batches on to the
+# other workers of the host through its ring
+mkdir many
+for i in `seq 1 1000` ; do echo "many$i $LOREM" >many/file$i ; done
+find many -type f >many.txt
+mpirun -n 4 $BIN/mpitar -f many.tar -c -T many.txt
+$TAR -T many.txt -c -f many_tar.tar many.tar.bidx many.tar.idx
+cmptar many_tar.tar many.tar
+
+# more batches than the master keeps in flight, it sends the next ones as
+# the workers acknowledge earlier ones
+for n in 2 3 ; do
+  mpirun -n $n $BIN/mpitar -f many$n.tar -c -T many.txt
+  $TAR -T many.txt -c -f many${n}_tar.tar many$n.tar.bidx many$n.tar.idx
+  cmptar many${n}_tar.tar many$n.tar
+done
+
+# empty, small and large files mixed, which the workers read ahead in a
+# second thread
+mkdir sizes
+for i in `seq 1 50` ; do
+  : >sizes/empty$i
+  echo "small$i" >sizes/small$i
+  head -c $((i*65537)) /dev/urandom >sizes/large$i
+done
+find sizes -type f >sizes.txt
+mpirun -n 3 $BIN/mpitar -f sizes.tar -c -T sizes.txt
+$TAR -T sizes.txt -c -f sizes_tar.tar sizes.tar.bidx sizes.tar.idx
+cmptar sizes_tar.tar sizes.tar
+
 grep -v file2 <mpitar.tar.idx >nofile2.idx
-../choptar.pl nofile2.idx mpitar.tar >chopped.tar
+$BIN/choptar nofile2.idx mpitar.tar >chopped.tar
 awk '{print $2}' nofile2.idx | $TAR -T - -c -f nofile2.tar
 cmptar nofile2.tar chopped.tar
 
+$BIN/choptar nofile2.idx mpitar.tar | cat >chopped_pipe.tar
+cmp chopped.tar chopped_pipe.tar
+
+grep -v 'idx$' <nofile2.idx | awk '{print $2}' >nofile2.txt
+$BIN/choptar -T nofile2.txt mpitar.tar >chopped_names.tar
+grep -v 'idx$' <nofile2.idx >nofile2_noidx.idx
+$BIN/choptar nofile2_noidx.idx mpitar.tar >chopped_noidx.tar
+cmp chopped_noidx.tar chopped_names.tar
+
 ../extractindex.pl mpitar.tar >extracted_mpitar.tar.idx
 cmp mpitar.tar.idx extracted_mpitar.tar.idx
+
+# ../legacy.ptgz.tar was made by "ptgz -c legacy" from these files with a
+# ptgz from before the binary index, whose archives must still extract
+mkdir -p legacy/dir1
+echo "file1 $LOREM" >legacy/file1
+echo "file3 $LOREM$LOREM$LOREM" >legacy/dir1/file3
+ln -s file1 legacy/link1
+mkdir legacy_x
+cp ../legacy.ptgz.tar legacy_x/
+(cd legacy_x && mpirun -n 2 $BIN/ptgz -x legacy.ptgz.tar)
+diff -r --no-dereference legacy legacy_x/legacy
+
+# ptgz round trips of a tree with holes, hard links and symlinks, dangling
+# ones included, through the in-process extractor
+mkdir -p ptgz/src/dir1/dir11 ptgz/src/dir2/$LONGDIR ptgz/src/empty
+echo "file1 $LOREM" >ptgz/src/file1
+for i in `seq 1 100` ; do echo "small$i $LOREM" >ptgz/src/dir1/small$i ; done
+for i in `seq 1 20` ; do head -c $((i*65537)) /dev/urandom >ptgz/src/dir1/dir11/large$i ; done
+echo "Longfile $LOREM" >ptgz/src/dir2/$LONGDIR/$LONGNAME
+chmod 640 ptgz/src/dir1/small1
+truncate -s 8M ptgz/src/sparse
+echo "sparse $LOREM" | dd of=ptgz/src/sparse bs=1 seek=4194304 conv=notrunc
+ln ptgz/src/file1 ptgz/src/dir2/hard1
+ln ptgz/src/file1 ptgz/src/hard2
+ln -s file1 ptgz/src/link1
+ln -s dir1 ptgz/src/linkdir
+ln -s nowhere ptgz/src/dangling
+
+# enough files for the file list sort to spill sorted runs with -M 1
+mkdir -p ptgz/spill/many
+(cd ptgz/spill/many && perl -e 'for(1..70000){open F,">f$_";print F "x" x ($_ % 97);close F}')
+
+# a tar that kills the rank that runs it for block 4, as if it was killed
+mkdir ptgz/fake
+cat >ptgz/fake/tar <<'EOT'
+#!/bin/bash
+for a in "$@" ; do case "$a" in *.ptgz.tmp) n=${a%%.*} ;; esac ; done
+if [ "$n" = 4 ] ; then kill -KILL $PPID ; exit 1 ; fi
+PATH=${PATH#*:} exec tar "$@"
+EOT
+chmod +x ptgz/fake/tar
+
+# compresses ptgz/src with the options in $2 and extracts it into ptgz/$1
+# with the options in $3
+function ptgzrt() { (
+  cd ptgz/src
+  mpirun -n $n $BIN/ptgz -c $2 arch
+  mkdir ../$1
+  mv arch.ptgz.tar ../$1/
+  cd ../$1
+  mpirun -n $n $BIN/ptgz -x $3 arch.ptgz.tar
+)}
+
+# type, mode, link count, size and mtime of everything in a tree but the
+# directories that have files, which are not members of their own
+function ptgzmeta() { (
+  cd $1
+  find . -mindepth 1 \( ! -type d -o -empty \) -printf '%p %y %M %n %s %Ts\n' | sort
+)}
+
+# checks that every member in a block is where the binary index says it is
+function ptgzbidx() { (
+  cd $1
+  tar -xf arch.ptgz.tar arch.bidx `tar -tf arch.ptgz.tar | grep 'ptgz.tar.gz$'`
+  ../../../dumpbidx.pl arch.bidx >bidx.txt
+  test -s bidx.txt
+  while read block offset tarsize path ; do
+    gzip -dc $block.arch.ptgz.tar.gz | tail -c +$((offset+1)) | head -c $tarsize | tar -t >member.txt
+    test "`cat member.txt`" = "$path"
+  done <bidx.txt
+)}
+
+ptgzmeta ptgz/src >ptgz/src.meta
+for n in 2 3 ; do
+  ptgzrt plain$n "" -k
+  mv ptgz/plain$n/arch.ptgz.tar ptgz/plain$n.ptgz.tar
+  diff -r --no-dereference ptgz/src ptgz/plain$n
+  ptgzmeta ptgz/plain$n | cmp ptgz/src.meta -
+  test `du -k ptgz/plain$n/sparse | cut -f1` -lt 1024
+  test `stat -c %h ptgz/plain$n/file1` = 3
+  test `stat -c %i ptgz/plain$n/file1` = `stat -c %i ptgz/plain$n/dir2/hard1`
+  test "`readlink ptgz/plain$n/dangling`" = nowhere
+
+  mkdir ptgz/bidx$n
+  cp ptgz/plain$n.ptgz.tar ptgz/bidx$n/arch.ptgz.tar
+  ptgzbidx ptgz/bidx$n
+
+  ptgzrt defer$n "" -D
+  diff -r --no-dereference ptgz/src ptgz/defer$n
+  ptgzmeta ptgz/defer$n | cmp ptgz/src.meta -
+
+  # dictionary blocks are not gzip files, so the script must refuse them
+  ptgzrt dict$n -Z -k
+  mv ptgz/dict$n/arch.ptgz.tar ptgz/dict$n.ptgz.tar
+  diff -r --no-dereference ptgz/src ptgz/dict$n
+  ptgzmeta ptgz/dict$n | cmp ptgz/src.meta -
+  test `tar -tf ptgz/dict$n.ptgz.tar | grep -c 'ptgz.tar.zz$'` -gt 0
+  if tar -xOf ptgz/dict$n.ptgz.tar arch.sh | bash ; then false ; fi
+
+  # symlinks are followed, dangling ones are left out
+  ptgzrt deref$n -L
+  diff -r -x dangling ptgz/src ptgz/deref$n
+  test ! -L ptgz/deref$n/link1 -a ! -L ptgz/deref$n/linkdir -a -d ptgz/deref$n/linkdir
+  test ! -e ptgz/deref$n/dangling -a ! -L ptgz/deref$n/dangling
+
+  # a member that cannot be written fails the extraction but not the others
+  mkdir ptgz/blocked$n
+  cp ptgz/plain$n.ptgz.tar ptgz/blocked$n/arch.ptgz.tar
+  touch ptgz/blocked$n/dir1
+  if (cd ptgz/blocked$n && mpirun -n $n $BIN/ptgz -x -k arch.ptgz.tar >x.log 2>&1) ; then false ; fi
+  grep "Could not extract 'dir1/" ptgz/blocked$n/x.log
+  diff -r --no-dereference -x dir1 -x x.log -x arch.ptgz.tar ptgz/src ptgz/blocked$n
+
+  # a block with a bad gzip CRC fails the extraction
+  mkdir ptgz/crc$n
+  cp ptgz/plain$n.ptgz.tar ptgz/crc$n/arch.ptgz.tar
+  off=`../extractindex.pl ptgz/crc$n/arch.ptgz.tar | awk '$2 == "1.arch.ptgz.tar.gz" {print $1}'`
+  size=`tar -tvf ptgz/crc$n/arch.ptgz.tar 1.arch.ptgz.tar.gz | awk '{print $3}'`
+  printf '\377\377\377\377' | dd of=ptgz/crc$n/arch.ptgz.tar bs=1 seek=$((off+512+size-8)) conv=notrunc
+  if (cd ptgz/crc$n && mpirun -n $n $BIN/ptgz -x arch.ptgz.tar >x.log 2>&1) ; then false ; fi
+  grep "Could not extract the tar stream" ptgz/crc$n/x.log
+
+  # a killed run is finished by -r
+  if (cd ptgz/src && PATH=$PWD/../fake:$PATH mpirun -n $n $BIN/ptgz -c arch) ; then false ; fi
+  test -f ptgz/src/arch.ptgz.journal
+  (cd ptgz/src && mpirun -n $n $BIN/ptgz -c -r arch >../resume$n.log)
+  grep Resuming ptgz/resume$n.log
+  mkdir ptgz/resume$n
+  mv ptgz/src/arch.ptgz.tar ptgz/resume$n/
+  (cd ptgz/resume$n && mpirun -n $n $BIN/ptgz -x arch.ptgz.tar)
+  diff -r --no-dereference ptgz/src ptgz/resume$n
+  ptgzmeta ptgz/resume$n | cmp ptgz/src.meta -
+
+  # the spilled sort of the file list makes the same blocks
+  for m in 0 1 ; do
+    (cd ptgz/spill && mpirun -n $n $BIN/ptgz -c -M $m arch)
+    mkdir ptgz/spill$n-$m
+    mv ptgz/spill/arch.ptgz.tar ptgz/spill$n-$m/
+    (cd ptgz/spill$n-$m && tar -xf arch.ptgz.tar arch.bidx arch.idx && mpirun -n $n $BIN/ptgz -x arch.ptgz.tar)
+    diff -r ptgz/spill/many ptgz/spill$n-$m/many
+  done
+  cmp ptgz/spill$n-0/arch.bidx ptgz/spill$n-1/arch.bidx
+  cmp ptgz/spill$n-0/arch.idx ptgz/spill$n-1/arch.idx
+done
@@ -36,84 +36,192 @@
 #define TIMER_HH_
 
 #include <mpi.h>
+#include <omp.h>
+#include <stdint.h>
 #include <vector>
 #include <algorithm>
+#include <cassert>
 #include <cstdio>
 #include <string>
 
-#ifdef DO_TIMING
+#include "trace.hh"
+
+// phase timers that are switched on at runtime
+// Each OpenMP thread accumulates into its own slot so timers can be started
+// and stopped inside of parallel regions. print_timers() is collective and
+// reports the spread of each timer over ranks and threads so that stragglers
+// stand out. When tracing is on every start/stop pair is also recorded as a
+// span. A disabled timer costs a test of two static flags.
 class timer
 {
   public:
-  timer(std::string const name_) : acc(0), start_time(-1), name(name_) {
-    all_timers.push_back(this);
+  timer(std::string const name_) : name(name_) {
+    // at least two for the read ahead thread of mpitar workers
+    slots.resize(size_t(std::max(omp_get_max_threads(), 2)));
+    all_timers().push_back(this);
   };
   ~timer() {
     std::vector<timer*>::iterator it =
-      std::find(all_timers.begin(), all_timers.end(), this);
-    all_timers.erase(it);
+      std::find(all_timers().begin(), all_timers().end(), this);
+    all_timers().erase(it);
   };
 
+  static void enable(const bool on = true) { enabled() = on; }
+  static bool is_enabled() { return enabled(); }
+
   void start(int line) {
-    if(start_time != -1) {
+    if(!enabled() && !trace::is_enabled())
+      return;
+    slot &s = get_slot();
+    if(s.start_time != -1) {
       fprintf(stderr, "Incorrect nesting for %s at line %d\n", name.c_str(), line);
       assert(0);
     }
-    start_time = MPI_Wtime();
+    s.start_time = MPI_Wtime();
   }
-  void stop(const int line) {
-    if(start_time == -1) {
+  // arg, if not negative, is attached to the trace span (e.g. a block number)
+  void stop(const int line, const int64_t arg = -1) {
+    if(!enabled() && !trace::is_enabled())
+      return;
+    slot &s = get_slot();
+    if(s.start_time == -1) {
       fprintf(stderr, "Incorrect nesting for %s at line %d\n", name.c_str(), line);
       assert(0);
     }
-    acc += MPI_Wtime() - start_time;
-    start_time = -1;
+    const double now = MPI_Wtime();
+    trace::record(name.c_str(), s.start_time, now, arg);
+    s.acc += now - s.start_time;
+    s.start_time = -1;
+    s.calls += 1;
+  }
+  // attribute work to the phase this timer measures
+  void count(const uint64_t bytes, const uint64_t files = 0) {
+    if(!enabled())
+      return;
+    slot &s = get_slot();
+    s.bytes += bytes;
+    s.files += files;
   }
+
+  // collective, prints one line per used timer on rank 0
   static void print_timers() {
-    std::vector<double> timers(all_timers.size());
-    for(size_t i = 0 ; i < all_timers.size() ; ++i) {
-      timers[i] = all_timers[i]->get(__LINE__);
-    }
-    std::vector<double> sum_timers(all_timers.size());
-    MPI_Reduce(&timers[0], &sum_timers[0], int(timers.size()), MPI_DOUBLE,
-               MPI_SUM, 0, MPI_COMM_WORLD);
-    int rank;
+    if(!enabled())
+      return;
+    std::vector<timer*> &timers = all_timers();
+    const size_t n = timers.size();
+    int rank, size;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    if(rank == 0) {
-      for(size_t i = 0 ; i < all_timers.size() ; ++i) {
-        fprintf(stdout, "%s%s: %g", i>0?" ":"", all_timers[i]->name.c_str(), sum_timers[i]);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // per rank: time of the slowest thread and number of calls, per thread:
+    // min/max/sum over threads that used the timer
+    std::vector<double> rank_time(2*n), thread_min(n), thread_max(n),
+                        thread_sum(n), thread_cnt(n), work(2*n);
+    for(size_t i = 0 ; i < n ; ++i) {
+      timers[i]->summarize(&rank_time[2*i], &rank_time[2*i+1], &thread_min[i],
+                           &thread_max[i], &thread_sum[i], &thread_cnt[i],
+                           &work[2*i]);
+    }
+    std::vector<double> all_rank_time(rank == 0 ? 2*n*size_t(size) : 1);
+    MPI_Gather(&rank_time[0], int(2*n), MPI_DOUBLE, &all_rank_time[0],
+               int(2*n), MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    std::vector<double> min_thread(n), max_thread(n), sum_thread(n),
+                        cnt_thread(n), sum_work(2*n);
+    MPI_Reduce(&thread_min[0], &min_thread[0], int(n), MPI_DOUBLE, MPI_MIN, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&thread_max[0], &max_thread[0], int(n), MPI_DOUBLE, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&thread_sum[0], &sum_thread[0], int(n), MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&thread_cnt[0], &cnt_thread[0], int(n), MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&work[0], &sum_work[0], int(2*n), MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    if(rank != 0)
+      return;
+
+    for(size_t i = 0 ; i < n ; ++i) {
+      if(cnt_thread[i] == 0)
+        continue;
+      // only ranks that ran the phase count, so that phases of a single rank
+      // do not look imbalanced
+      double rmin = 1e300, rmax = 0, rsum = 0;
+      int slowest = 0, ranks = 0;
+      for(int r = 0 ; r < size ; ++r) {
+        const double t = all_rank_time[2*(size_t(r)*n + i)];
+        if(all_rank_time[2*(size_t(r)*n + i) + 1] == 0)
+          continue;
+        rmin = std::min(rmin, t);
+        if(ranks == 0 || t > rmax) {
+          rmax = t;
+          slowest = r;
+        }
+        rsum += t;
+        ranks++;
       }
-      fprintf(stdout, "\n");
+      const double rmean = rsum / ranks;
+      const double bytes = sum_work[2*i], files = sum_work[2*i+1];
+      fprintf(stdout, "timer %s: ranks=%d rank_min=%.6f rank_max=%.6f "
+              "rank_mean=%.6f imbalance=%.3f slowest_rank=%d thread_min=%.6f "
+              "thread_max=%.6f thread_mean=%.6f bytes=%.0f files=%.0f "
+              "MB/s=%.3f files/s=%.1f\n",
+              timers[i]->name.c_str(), ranks, rmin, rmax, rmean,
+              rmean > 0 ? rmax/rmean - 1. : 0., slowest,
+              min_thread[i], max_thread[i], sum_thread[i]/cnt_thread[i],
+              bytes, files, rmax > 0 ? bytes/rmax/1e6 : 0.,
+              rmax > 0 ? files/rmax : 0.);
     }
+    fflush(stdout);
   }
 
   private:
-  static std::vector<timer*> all_timers;
-
-  double acc, start_time;
+  struct slot {
+    slot() : acc(0), start_time(-1), calls(0), bytes(0), files(0) {};
+    double acc, start_time;
+    uint64_t calls, bytes, files;
+    char pad[64 - 2*sizeof(double) - 3*sizeof(uint64_t)]; // no false sharing
+  };
+  std::vector<slot> slots;
   const std::string name;
 
-  double get(const int line) {
-    if(start_time != -1) {
-      fprintf(stderr, "Incorrect nesting for %s at line %d\n", name.c_str(), line);
-      assert(0);
-    }
-    return acc;
+  static std::vector<timer*> &all_timers() {
+    static std::vector<timer*> timers;
+    return timers;
+  }
+  static bool &enabled() {
+    static bool on = false;
+    return on;
   }
 
+  slot &get_slot() {
+    const size_t thread = size_t(omp_get_thread_num());
+    assert(thread < slots.size());
+    return slots[thread];
+  }
+
+  void summarize(double *rank_time, double *calls, double *tmin, double *tmax,
+                 double *tsum, double *tcnt, double *work) const {
+    *rank_time = *calls = *tsum = *tcnt = work[0] = work[1] = 0;
+    *tmin = 1e300;
+    *tmax = 0;
+    for(size_t t = 0 ; t < slots.size() ; ++t) {
+      const slot &s = slots[t];
+      if(s.start_time != -1) {
+        fprintf(stderr, "Incorrect nesting for %s\n", name.c_str());
+        assert(0);
+      }
+      if(s.calls == 0)
+        continue;
+      *rank_time = std::max(*rank_time, s.acc);
+      *calls += double(s.calls);
+      *tmin = std::min(*tmin, s.acc);
+      *tmax = std::max(*tmax, s.acc);
+      *tsum += s.acc;
+      *tcnt += 1;
+      work[0] += double(s.bytes);
+      work[1] += double(s.files);
+    }
+  }
 };
-#else // dummy class
-class timer
-{
-  public:
-  timer(std::string const) {};
-  ~timer() {};
-  void start(int) {};
-  void stop(const int) {};
-  static void print_timers() {};
-  private:
-  static std::vector<timer*> all_timers;
-};
-#endif
 
 #endif // TIMER_HH_
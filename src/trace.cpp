@@ -0,0 +1,182 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "trace.hh"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+
+#include <mpi.h>
+#include <omp.h>
+
+#define TRACE_EVENTS_PER_THREAD (1u << 16)
+// bytes written by a single MPI-IO call
+#define TRACE_WRITE_SIZE (1u << 30)
+
+namespace {
+struct span {
+  const char *name;
+  double start, end;
+  int64_t arg;
+};
+
+struct ring {
+  ring() : next(0), dropped(0) {};
+  std::vector<span> spans;
+  size_t next;      // total number of spans recorded
+  size_t dropped;
+  char pad[64];     // keep rings of different threads apart
+};
+
+std::string trace_fn;
+double trace_t0;
+std::vector<ring> rings;
+}
+
+bool trace::enabled = false;
+
+void trace::enable(const std::string &fn)
+{
+  trace_fn = fn;
+  // sized like the timer slots, which include the read ahead thread of
+  // mpitar workers
+  rings.resize(size_t(std::max(omp_get_max_threads(), 2)));
+  for(size_t t = 0 ; t < rings.size() ; t++)
+    rings[t].spans.resize(TRACE_EVENTS_PER_THREAD);
+  MPI_Barrier(MPI_COMM_WORLD);
+  trace_t0 = MPI_Wtime();
+  enabled = true;
+}
+
+void trace::record(const char *name, const double start, const double end,
+                   const int64_t arg)
+{
+  if(!enabled)
+    return;
+  const size_t thread = size_t(omp_get_thread_num());
+  if(thread >= rings.size())
+    return;
+  ring &r = rings[thread];
+  span &s = r.spans[r.next % r.spans.size()];
+  if(r.next >= r.spans.size())
+    r.dropped += 1;
+  s.name = name;
+  s.start = start;
+  s.end = end;
+  s.arg = arg;
+  r.next += 1;
+}
+
+void trace::write()
+{
+  if(!enabled)
+    return;
+  enabled = false;
+
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  // format this rank's events, timestamps in microseconds. Every rank has at
+  // least its process name, so the separators between ranks go in front.
+  std::string events;
+  if(rank == 0)
+    events += "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  else
+    events += ",\n";
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+           "\"args\":{\"name\":\"rank %d\"}}", rank, rank);
+  events += buf;
+  size_t dropped = 0;
+  for(size_t t = 0 ; t < rings.size() ; t++) {
+    const ring &r = rings[t];
+    const size_t n = r.next < r.spans.size() ? r.next : r.spans.size();
+    for(size_t i = r.next - n ; i < r.next ; i++) {
+      const span &s = r.spans[i % r.spans.size()];
+      int len = snprintf(buf, sizeof(buf),
+                         ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                         "\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f", s.name, rank,
+                         t, (s.start - trace_t0)*1e6, (s.end - s.start)*1e6);
+      if(s.arg >= 0)
+        len += snprintf(buf+len, sizeof(buf)-size_t(len),
+                        ",\"args\":{\"block\":%lld}", (long long)s.arg);
+      events.append(buf, size_t(len));
+      events += "}";
+    }
+    dropped += r.dropped;
+  }
+  if(rank == size - 1)
+    events += "\n]}\n";
+  rings.clear();
+  if(dropped > 0) {
+    fprintf(stderr, "Trace buffers of rank %d overflowed, dropped %zu oldest spans\n",
+            rank, dropped);
+  }
+
+  // every rank writes its events at the offset of its own, with 64 bit
+  // sizes and offsets since a long run easily has more than 2 GiB of them
+  uint64_t len = events.size();
+  uint64_t off = 0, total = 0;
+  MPI_Exscan(&len, &off, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+  if(rank == 0)
+    off = 0;
+  MPI_Allreduce(&len, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+
+  MPI_File fh;
+  int ierr = MPI_File_open(MPI_COMM_WORLD, trace_fn.c_str(),
+                           MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                           &fh);
+  if(ierr != MPI_SUCCESS) {
+    if(rank == 0)
+      fprintf(stderr, "Could not open '%s' for writing\n", trace_fn.c_str());
+    return;
+  }
+  ierr = MPI_File_set_size(fh, MPI_Offset(total));
+  // a single write is limited to INT_MAX bytes
+  for(uint64_t done = 0 ; ierr == MPI_SUCCESS && done < len ; ) {
+    const uint64_t count = std::min(len - done, uint64_t(TRACE_WRITE_SIZE));
+    ierr = MPI_File_write_at(fh, MPI_Offset(off + done), &events[done],
+                             int(count), MPI_CHAR, MPI_STATUS_IGNORE);
+    done += count;
+  }
+  if(ierr != MPI_SUCCESS)
+    fprintf(stderr, "Could not write to '%s'\n", trace_fn.c_str());
+  MPI_File_close(&fh);
+}
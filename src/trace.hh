@@ -0,0 +1,65 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef TRACE_HH_
+#define TRACE_HH_
+
+#include <stdint.h>
+#include <string>
+
+// optional recording of time-stamped spans for chrome://tracing or Perfetto
+// Every OpenMP thread records into its own fixed size ring buffer, so
+// recording takes no locks and the oldest spans are dropped if a run produces
+// more than fit. write() is collective: every rank writes its spans into its
+// own part of a single trace-event JSON file with MPI-IO, with one process per
+// rank and one thread per OpenMP thread.
+class trace
+{
+  public:
+  // collective, timestamps are relative to the barrier in here
+  static void enable(const std::string &fn);
+  static bool is_enabled() { return enabled; }
+
+  // start and end are MPI_Wtime() values, arg is shown if not negative
+  static void record(const char *name, const double start, const double end,
+                     const int64_t arg = -1);
+
+  // collective, does nothing unless enabled
+  static void write();
+
+  private:
+  static bool enabled;
+};
+
+#endif // TRACE_HH_
@@ -0,0 +1,78 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#include "workqueue.hh"
+
+#include <cstdio>
+#include <cstdlib>
+
+workqueue::workqueue(const int64_t count_, MPI_Comm comm, const int owner_) :
+  count(count_), owner(owner_), counter(0), done(count_ <= 0)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  // only the owner exposes memory, everyone else targets it
+  const int ierr = MPI_Win_create(&counter,
+                                  rank == owner ? sizeof(counter) : 0,
+                                  sizeof(counter), MPI_INFO_NULL, comm, &win);
+  if(ierr != MPI_SUCCESS) {
+    fprintf(stderr, "Could not create work queue window: %d\n", ierr);
+    exit(1);
+  }
+}
+
+workqueue::~workqueue()
+{
+  MPI_Win_free(&win);
+}
+
+int64_t workqueue::next()
+{
+  int64_t item = -1;
+  // shares its name with the other MPI calls made from threads, e.g. in
+  // tarappender, so that only one thread at a time calls into MPI
+  #pragma omp critical(mpi)
+  if(!done) {
+    const int64_t one = 1;
+    MPI_Win_lock(MPI_LOCK_SHARED, owner, 0, win);
+    MPI_Fetch_and_op(&one, &item, MPI_INT64_T, owner, 0, MPI_SUM, win);
+    MPI_Win_unlock(owner, win);
+    // no need to ask again once the counter ran past the end
+    if(item >= count) {
+      done = true;
+      item = -1;
+    }
+  }
+  return item;
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2017 The Board of Trustees of the University of Illinois
+ * All rights reserved.
+ *
+ * Developed by: National Center for Supercomputing Applications
+ *               University of Illinois at Urbana-Champaign
+ *               http://www.ncsa.illinois.edu/
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal with the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimers.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimers in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the names of the National Center for Supercomputing Applications,
+ * University of Illinois at Urbana-Champaign, nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * Software without specific prior written permission.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * CONTRIBUTORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * WITH THE SOFTWARE.  */
+
+#ifndef WORK_QUEUE_HH_
+#define WORK_QUEUE_HH_
+
+#include <stdint.h>
+
+#include <mpi.h>
+
+// global queue of work items 0..count-1 shared by all ranks of a
+// communicator
+// The next item is a counter on the owner rank which every rank and thread
+// advances with an atomic MPI_Fetch_and_op, so ranks that finish their items
+// early keep taking items from slower ones. Callers hand out items in the
+// order they want them processed, e.g. an index into a list sorted largest
+// first that every rank computed the same way.
+// Construction and destruction are collective. next() is thread safe but
+// needs at least MPI_THREAD_SERIALIZED.
+class workqueue
+{
+  public:
+  workqueue(const int64_t count_, MPI_Comm comm, const int owner_ = 0);
+  ~workqueue();
+
+  // the next item or -1 once all are taken
+  int64_t next();
+
+  private:
+  const int64_t count;
+  const int owner;
+  int64_t counter;
+  MPI_Win win;
+  bool done;
+
+  // no copies, we own the window
+  workqueue(const workqueue&);
+  workqueue &operator=(const workqueue&);
+};
+
+#endif // WORK_QUEUE_HH_